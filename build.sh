@@ -2,13 +2,15 @@ set -e
 
 #-Wall -Wextra -Wpedantic -Wconversion
 CXX_FLAGS="-g -std=c++20 -Wall -Wextra -Wno-unused-variable -Xlinker /SUBSYSTEM:CONSOLE -Xlinker /NODEFAULTLIB:MSVCRTD"
-CXX_FILES="server/main.cpp server/win32_chat_server.cpp server/journal.cpp"
+CXX_FILES="server/main.cpp server/win32_chat_server.cpp server/journal.cpp server/legacy_journal.cpp server/journal_benchmark.cpp server/blob_store.cpp server/replication.cpp server/compression.cpp server/snapshot_image.cpp"
 CXX_FILES_CLIENT="client/main.cpp client/win32_chat_client.cpp client/vulkan.cpp client/server_connection.cpp ./thirdparty/imgui/imgui.cpp ./thirdparty/imgui/imgui_draw.cpp ./thirdparty/imgui/imgui_tables.cpp ./thirdparty/imgui/imgui_widgets.cpp ./thirdparty/imgui/imgui_impl_win32.cpp ./thirdparty/imgui/imgui_impl_vulkan.cpp ./thirdparty/imgui/imgui_demo.cpp"
 CXX_FILES_TESTS="win32_unit_tests.cpp client/server_connection.cpp"
-LIBS="user32 ${VULKAN_SDK}/Lib/vulkan-1.lib -lcomdlg32 -lWs2_32"
+CXX_FILES_JOURNAL_TOOL="server/chatjournal.cpp server/linux_chat_server.cpp server/journal.cpp server/legacy_journal.cpp server/compression.cpp server/point_in_time.cpp server/snapshot_image.cpp"
+LIBS="user32 ${VULKAN_SDK}/Lib/vulkan-1.lib -lcomdlg32 -lWs2_32 -lMswsock"
 EXE_NAME="chat.exe"
 CLIENT_EXE_NAME="chat_client.exe"
 TEST_EXE_NAME="chat_unit_tests.exe"
+JOURNAL_TOOL_EXE_NAME="chatjournal"
 INCLUDE="thirdparty/include -I ${VULKAN_SDK}/Include"
 
 mkdir -p build
@@ -46,6 +48,19 @@ if [ "${1}" = "tests" ]; then
     exit 0
 fi
 
+if [ "${1}" = "bench" ]; then
+    clang ${CXX_FLAGS} -l ${LIBS} -I ${INCLUDE} ${CXX_FILES} -o build/${EXE_NAME}
+    cd build
+    ./$EXE_NAME --journal-benchmark
+    exit 0
+fi
+
+# The journal tool is built on linux, to inspect journals copied off the server.
+if [ "${1}" = "chatjournal" ]; then
+    clang++ -g -O2 -std=c++20 -Wall -Wextra -Wno-unused-variable ${CXX_FILES_JOURNAL_TOOL} -lpthread -o build/${JOURNAL_TOOL_EXE_NAME}
+    exit 0
+fi
+
 if [ "${1}" = "shader" ]; then
     glslc shaders/main.frag -o build/frag.spv
     glslc shaders/main.vert -o build/vert.spv
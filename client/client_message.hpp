@@ -41,7 +41,7 @@ public:
         if (result != Error::SUCCESS)
             return false;
 
-        Util::IchigoVector<std::string> recipient_usernames = Message::recipient()->usernames();
+        const Util::IchigoSmallVector<std::string, 1> recipient_usernames = Message::recipient()->usernames();
         u8 recipient_type;
         std::string recipient_name;
         if (recipient_usernames.size() > 1) {
@@ -49,7 +49,7 @@ public:
             recipient_name = static_cast<const Group *>(Message::recipient())->name();
         } else {
             recipient_type = RECIPIENT_TYPE_USER;
-            recipient_name = Message::recipient()->usernames().at(0);
+            recipient_name = recipient_usernames.at(0);
         }
 
         ::send(socket, reinterpret_cast<char *>(&recipient_type), sizeof(recipient_type), 0);
@@ -62,6 +62,14 @@ public:
         ::send(socket, reinterpret_cast<char *>(&message_length), sizeof(message_length), 0);
         ::send(socket, Message::content().c_str(), Message::content().length(), 0);
 
+        u32 digest_length = Message::attachment_digest().length();
+        ::send(socket, reinterpret_cast<char *>(&digest_length), sizeof(digest_length), 0);
+        ::send(socket, Message::attachment_digest().c_str(), Message::attachment_digest().length(), 0);
+
+        u32 attachment_name_length = Message::attachment_name().length();
+        ::send(socket, reinterpret_cast<char *>(&attachment_name_length), sizeof(attachment_name_length), 0);
+        ::send(socket, Message::attachment_name().c_str(), Message::attachment_name().length(), 0);
+
         recv(socket, reinterpret_cast<char *>(&result), sizeof(result), 0);
 
         return result == Error::SUCCESS;
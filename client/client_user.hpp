@@ -16,8 +16,8 @@ public:
     ClientUser() : User() {}
     ClientUser(const std::string &name) : User(name) {}
 
-    Util::IchigoVector<std::string> usernames() const override {
-        Util::IchigoVector<std::string> ret(1);
+    Util::IchigoSmallVector<std::string, 1> usernames() const override {
+        Util::IchigoSmallVector<std::string, 1> ret;
         ret.append(name());
         return ret;
     }
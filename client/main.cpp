@@ -117,6 +117,30 @@ static void export_messages(const std::string &filename) {
     std::fclose(output_file);
 }
 
+/*
+    Upload a file and attach it to a message. Does nothing if 'path' is empty.
+    Parameter 'message': The message to attach the file to.
+    Parameter 'path': The path to the file to attach.
+    Returns whether or not the file was attached (or if there was nothing to attach).
+*/
+static bool attach_file(ClientMessage &message, const char *path) {
+    if (path[0] == '\0')
+        return true;
+
+    std::string digest;
+    if (!ServerConnection::upload_attachment(path, &digest))
+        return false;
+
+    // Only the file name is sent along with the message, not the sender's directory structure.
+    std::string name = path;
+    u64 separator_index = name.find_last_of("/\\");
+    if (separator_index != std::string::npos)
+        name = name.substr(separator_index + 1);
+
+    message.set_attachment(digest, name.substr(0, CHAT_MAX_ATTACHMENT_NAME_LENGTH));
+    return true;
+}
+
 /*
     Present one frame. Begin the vulkan render pass, fill command buffers with Dear ImGui draw data,
     and submit the queue for presentation.
@@ -301,6 +325,7 @@ void ChatClient::do_frame(float dpi_scale) {
         check_boxes: A vector of checkbox state.
     */
     static char text_input_buffer[CHAT_MAX_MESSAGE_LENGTH];
+    static char attachment_path_buffer[1024];
     static ClientUser *message_recipient = nullptr;
     static Group *group_message_recipient = nullptr;
     static bool modal_request_failed = false;
@@ -327,6 +352,8 @@ void ChatClient::do_frame(float dpi_scale) {
                         ImGui::Text("%s", ServerConnection::cached_inbox.at(i).sender()->name().c_str());
                         ImGui::TableNextColumn();
                         ImGui::Text("%s", ServerConnection::cached_inbox.at(i).content().c_str());
+                        if (ServerConnection::cached_inbox.at(i).has_attachment())
+                            ImGui::TextDisabled("Attachment: %s", ServerConnection::cached_inbox.at(i).attachment_name().c_str());
                         ImGui::TableNextColumn();
 
                         // **Hack** check if the current row is hovered
@@ -342,6 +369,12 @@ void ChatClient::do_frame(float dpi_scale) {
                         // Only show the delete message button if the row is being hovered
                         bool hovered = ImGui::IsMouseHoveringRect(row_rect.Min, row_rect.Max, false);
                         ImGui::PushID(i);
+                        if (hovered && ServerConnection::cached_inbox.at(i).has_attachment() && ImGui::SmallButton("Save")) {
+                            static const char *extension = "*.*";
+                            const std::string filename = ChatClient::platform_get_save_file_name(&extension, 1);
+                            if (!filename.empty() && !ServerConnection::download_attachment(ServerConnection::cached_inbox.at(i), filename))
+                                ICHIGO_ERROR("Failed to download attachment");
+                        }
                         if (hovered && ImGui::SmallButton("Delete")) {
                             if (!ServerConnection::delete_message(ServerConnection::cached_inbox.at(i)))
                                 ICHIGO_ERROR("Failed to delete message");
@@ -406,6 +439,7 @@ void ChatClient::do_frame(float dpi_scale) {
                 if (ImGui::Selectable(ServerConnection::cached_users.at(i).name().c_str(), false, ImGuiSelectableFlags_SpanAllColumns)) {
                     modal_request_failed = false;
                     std::memset(text_input_buffer, 0, ARRAY_LEN(text_input_buffer));
+                    std::memset(attachment_path_buffer, 0, ARRAY_LEN(attachment_path_buffer));
                     message_recipient = &ServerConnection::cached_users.at(i);
                     ImGui::OpenPopup("Send message");
                 }
@@ -423,6 +457,7 @@ void ChatClient::do_frame(float dpi_scale) {
                 if (message_recipient) {
                     ImGui::Text("New message to %s", message_recipient->name().c_str());
                     ImGui::InputText("Content", text_input_buffer, ARRAY_LEN(text_input_buffer));
+                    ImGui::InputText("Attachment (optional path)", attachment_path_buffer, ARRAY_LEN(attachment_path_buffer));
                     ImGui::Separator();
 
                     if (ImGui::Button("Send", ImVec2(120, 0))) {
@@ -430,7 +465,7 @@ void ChatClient::do_frame(float dpi_scale) {
                             modal_request_failed = true;
                         } else {
                             ClientMessage message(text_input_buffer, message_recipient, &ServerConnection::logged_in_user);
-                            if (!ServerConnection::send_message(message)) {
+                            if (!attach_file(message, attachment_path_buffer) || !ServerConnection::send_message(message)) {
                                 modal_request_failed = true;
                             } else {
                                 ServerConnection::cached_outbox.append(message);
@@ -467,6 +502,7 @@ void ChatClient::do_frame(float dpi_scale) {
                 if (ImGui::Selectable(ServerConnection::cached_groups.at(i).name().c_str(), false, ImGuiSelectableFlags_SpanAllColumns)) {
                     modal_request_failed = false;
                     std::memset(text_input_buffer, 0, ARRAY_LEN(text_input_buffer));
+                    std::memset(attachment_path_buffer, 0, ARRAY_LEN(attachment_path_buffer));
                     group_message_recipient = &ServerConnection::cached_groups.at(i);
                     ImGui::OpenPopup("Send group message");
                 }
@@ -481,6 +517,7 @@ void ChatClient::do_frame(float dpi_scale) {
                 if (group_message_recipient) {
                     ImGui::Text("New group message to group \"%s\"", group_message_recipient->name().c_str());
                     ImGui::InputText("Content", text_input_buffer, ARRAY_LEN(text_input_buffer));
+                    ImGui::InputText("Attachment (optional path)", attachment_path_buffer, ARRAY_LEN(attachment_path_buffer));
                     ImGui::Separator();
 
                     if (ImGui::Button("Send", ImVec2(120, 0))) {
@@ -488,7 +525,7 @@ void ChatClient::do_frame(float dpi_scale) {
                             modal_request_failed = true;
                         } else {
                             ClientMessage message(text_input_buffer, group_message_recipient, &ServerConnection::logged_in_user);
-                            if (!ServerConnection::send_message(message)) {
+                            if (!attach_file(message, attachment_path_buffer) || !ServerConnection::send_message(message)) {
                                 modal_request_failed = true;
                             } else {
                                 ServerConnection::cached_outbox.append(message);
@@ -7,6 +7,7 @@
 
 #include "server_connection.hpp"
 #include "chat_client.hpp"
+#include "../sha256.hpp"
 #include <thread>
 #include <mutex>
 
@@ -20,12 +21,16 @@ ClientUser ServerConnection::logged_in_user("");
 static u32 socket_fd = INVALID_SOCKET;
 // Static receiving buffer.
 static char buffer[4096]{};
+// Buffer for attachment chunks.
+static char chunk_buffer[CHAT_ATTACHMENT_CHUNK_SIZE]{};
 // Heartbeat thread. Keeps the connection alive even if the UI is blocking.
 static std::thread heartbeat_thread;
 // This mutex is locked before the heartbeat thread enters. Unlock to wake heartbeat thread so it can kill itself.
 static std::timed_mutex kill_heartbeat_mutex;
 // Guard socket access between main thread and heartbeat thread.
 static std::mutex socket_access_mutex;
+// Set when the last inbox received was partial (the server was still loading its message history).
+static bool inbox_partial = false;
 
 /*
     Find the index of a user by name.
@@ -41,6 +46,20 @@ static i32 find_user_index_by_name(const std::string &name) {
     return -1;
 }
 
+/*
+    Find the index of a message in the cached inbox by its ID.
+    Parameter 'id': The ID of the message to find.
+    Returns the index of the message or -1 if not found.
+*/
+static i32 find_inbox_index_by_id(i32 id) {
+    for (u32 i = 0; i < ServerConnection::cached_inbox.size(); ++i) {
+        if (ServerConnection::cached_inbox.at(i).id() == id)
+            return i;
+    }
+
+    return -1;
+}
+
 /*
     The heartbeat thread entry procedure.
 
@@ -198,6 +217,7 @@ bool ServerConnection::logout() {
         ServerConnection::logged_in_user = ClientUser("");
         ServerConnection::cached_users.clear();
         ServerConnection::cached_inbox.clear();
+        inbox_partial = false;
         return true;
     }
 
@@ -317,7 +337,8 @@ i32 ServerConnection::refresh() {
         recv(socket_fd, reinterpret_cast<char *>(&message_count), sizeof(message_count), 0);
         std::printf("Number of messages: %u\n", message_count);
 
-        u32 old_message_count = cached_inbox.size();
+        Util::IchigoVector<ClientMessage> received_messages;
+        u32 new_message_count = 0;
         for (u32 i = 0; i < message_count; ++i) {
             i32 message_id = -1;
             recv(socket_fd, reinterpret_cast<char *>(&message_id), sizeof(message_id), 0);
@@ -335,22 +356,223 @@ i32 ServerConnection::refresh() {
             n = recv(socket_fd, buffer, size, 0);
             assert(n != -1);
             buffer[n] = 0;
+            std::string content = buffer;
 
+            recv(socket_fd, reinterpret_cast<char *>(&size), sizeof(size), 0);
+            n = recv(socket_fd, buffer, size, 0);
+            assert(n != -1);
+            std::string attachment_digest(buffer, n);
 
-            for (u32 i = 0; i < cached_inbox.size(); ++i) {
-                if (cached_inbox.at(i).id() == message_id)
-                    goto next;
-            }
+            recv(socket_fd, reinterpret_cast<char *>(&size), sizeof(size), 0);
+            n = recv(socket_fd, buffer, size, 0);
+            assert(n != -1);
+            std::string attachment_name(buffer, n);
+
+            ClientMessage message(content, &ServerConnection::logged_in_user, &cached_users.at(index), message_id);
+            message.set_attachment(attachment_digest, attachment_name);
+            received_messages.append(std::move(message));
 
-            cached_inbox.append(ClientMessage(buffer, &ServerConnection::logged_in_user, &cached_users.at(index), message_id));
-next:;
+            if (find_inbox_index_by_id(message_id) == -1)
+                ++new_message_count;
         }
 
         recv(socket_fd, reinterpret_cast<char *>(&result), sizeof(result), 0);
-        assert(result == Error::SUCCESS);
+        assert(result == Error::SUCCESS || result == Error::PARTIAL);
+
+        // A partial inbox (from a server still loading its history) is filled in by later refreshes, since messages are merged by ID.
+        // It can also hold messages whose deletion was not replayed yet, so the first full inbox after it replaces the cache instead.
+        if (inbox_partial && result == Error::SUCCESS) {
+            cached_inbox = std::move(received_messages);
+        } else {
+            for (u32 i = 0; i < received_messages.size(); ++i) {
+                if (find_inbox_index_by_id(received_messages.at(i).id()) == -1)
+                    cached_inbox.append(std::move(received_messages.at(i)));
+            }
+        }
+
+        inbox_partial = result == Error::PARTIAL;
+        return new_message_count;
+    }
+}
+
+/*
+    Receive exactly 'length' bytes from the server.
+    Parameter 'data': The buffer to receive into.
+    Parameter 'length': The number of bytes to receive.
+    Returns whether or not all of the bytes were received.
+*/
+static bool recv_all(char *data, u64 length) {
+    for (u64 received = 0; received < length;) {
+        i32 n = recv(socket_fd, data + received, length - received, 0);
+        if (n <= 0)
+            return false;
+
+        received += n;
+    }
+
+    return true;
+}
+
+bool ServerConnection::upload_attachment(const std::string &path, std::string *out_digest) {
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    // Hash the file first. If the server already has a file with this digest we never have to send it.
+    Util::Sha256 hash;
+    u64 size = 0;
+    for (u64 n; (n = std::fread(chunk_buffer, sizeof(char), sizeof(chunk_buffer), file)) > 0; size += n)
+        hash.update(chunk_buffer, n);
+
+    std::string digest = hash.finish();
+    u32 digest_length = digest.length();
+    u64 offset;
+    i8 result;
+
+    {
+        std::lock_guard<std::mutex> guard(socket_access_mutex);
+
+        buffer[0] = Opcode::UPLOAD_ATTACHMENT;
+        send(socket_fd, buffer, 1, 0);
+        i32 id = ServerConnection::logged_in_user.id();
+        send(socket_fd, reinterpret_cast<char *>(&id), sizeof(id), 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS)
+            goto fail;
+
+        send(socket_fd, reinterpret_cast<char *>(&digest_length), sizeof(digest_length), 0);
+        send(socket_fd, digest.c_str(), digest_length, 0);
+        send(socket_fd, reinterpret_cast<char *>(&size), sizeof(size), 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS)
+            goto fail;
+
+        if (!recv_all(reinterpret_cast<char *>(&offset), sizeof(offset)))
+            goto fail;
+    }
+
+    std::printf("Uploading attachment %s: server has %llu of %llu bytes\n", digest.c_str(), static_cast<unsigned long long>(offset), static_cast<unsigned long long>(size));
+    std::fseek(file, offset, SEEK_SET);
+
+    // The socket is released between chunks so that the heartbeat thread is not starved during large uploads.
+    while (offset < size) {
+        u32 length = std::fread(chunk_buffer, sizeof(char), sizeof(chunk_buffer), file);
+        if (length == 0)
+            goto fail;
+
+        std::lock_guard<std::mutex> guard(socket_access_mutex);
+
+        buffer[0] = Opcode::UPLOAD_ATTACHMENT_CHUNK;
+        send(socket_fd, buffer, 1, 0);
+        i32 id = ServerConnection::logged_in_user.id();
+        send(socket_fd, reinterpret_cast<char *>(&id), sizeof(id), 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS)
+            goto fail;
+
+        send(socket_fd, reinterpret_cast<char *>(&digest_length), sizeof(digest_length), 0);
+        send(socket_fd, digest.c_str(), digest_length, 0);
+        send(socket_fd, reinterpret_cast<char *>(&offset), sizeof(offset), 0);
+        send(socket_fd, reinterpret_cast<char *>(&length), sizeof(length), 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS)
+            goto fail;
+
+        send(socket_fd, chunk_buffer, length, 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS)
+            goto fail;
+
+        offset += length;
+    }
+
+    std::fclose(file);
+    *out_digest = digest;
+    return true;
+
+fail:
+    std::fclose(file);
+    return false;
+}
 
-        return cached_inbox.size() - old_message_count;
+bool ServerConnection::download_attachment(const ClientMessage &message, const std::string &path) {
+    u32 digest_length = message.attachment_digest().length();
+    u64 size;
+    i8 result;
+
+    {
+        std::lock_guard<std::mutex> guard(socket_access_mutex);
+
+        buffer[0] = Opcode::DOWNLOAD_ATTACHMENT;
+        send(socket_fd, buffer, 1, 0);
+        i32 id = ServerConnection::logged_in_user.id();
+        send(socket_fd, reinterpret_cast<char *>(&id), sizeof(id), 0);
+        send(socket_fd, reinterpret_cast<char *>(&digest_length), sizeof(digest_length), 0);
+        send(socket_fd, message.attachment_digest().c_str(), digest_length, 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS || !recv_all(reinterpret_cast<char *>(&size), sizeof(size)))
+            return false;
     }
+
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    // The socket is released between chunks so that the heartbeat thread is not starved during large downloads.
+    for (u64 offset = 0; offset < size;) {
+        u64 length = size - offset < sizeof(chunk_buffer) ? size - offset : sizeof(chunk_buffer);
+
+        std::lock_guard<std::mutex> guard(socket_access_mutex);
+
+        buffer[0] = Opcode::DOWNLOAD_ATTACHMENT_CHUNK;
+        send(socket_fd, buffer, 1, 0);
+        i32 id = ServerConnection::logged_in_user.id();
+        send(socket_fd, reinterpret_cast<char *>(&id), sizeof(id), 0);
+        send(socket_fd, reinterpret_cast<char *>(&digest_length), sizeof(digest_length), 0);
+        send(socket_fd, message.attachment_digest().c_str(), digest_length, 0);
+        send(socket_fd, reinterpret_cast<char *>(&offset), sizeof(offset), 0);
+
+        recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+        if (result != Error::SUCCESS || !recv_all(chunk_buffer, length) || std::fwrite(chunk_buffer, sizeof(char), length, file) != length) {
+            std::fclose(file);
+            return false;
+        }
+
+        offset += length;
+    }
+
+    std::fclose(file);
+    return true;
+}
+
+bool ServerConnection::backup(const std::string &name, u64 *out_position) {
+    std::lock_guard<std::mutex> guard(socket_access_mutex);
+
+    buffer[0] = Opcode::BACKUP;
+    send(socket_fd, buffer, 1, 0);
+    i32 id = ServerConnection::logged_in_user.id();
+    send(socket_fd, reinterpret_cast<char *>(&id), sizeof(id), 0);
+
+    i8 result;
+    recv(socket_fd, reinterpret_cast<char *>(&result), 1, 0);
+    if (result != Error::SUCCESS)
+        return false;
+
+    u32 length = name.length();
+    send(socket_fd, reinterpret_cast<char *>(&length), sizeof(length), 0);
+    send(socket_fd, name.c_str(), name.length(), 0);
+
+    // The server answers once the backup is durable, however long that takes.
+    if (!recv_all(reinterpret_cast<char *>(&result), 1) || result != Error::SUCCESS)
+        return false;
+
+    return recv_all(reinterpret_cast<char *>(out_position), sizeof(*out_position));
 }
 
 void ServerConnection::deinit() {
@@ -44,7 +44,9 @@ void connect_to_server();
     5. Send the name of the recipient (user/group). As with all string communication,
        first send the length of the string, and then 'length' characters.
     6. Send the message content string (following string sending conventions)
-    7. Receive a result.
+    7. Send the attachment digest and attachment name strings (both empty if the message has no attachment).
+       The attachment must be uploaded with 'upload_attachment()' first.
+    8. Receive a result.
 
     Parameter 'message': The message to be sent
     Returns whether or not the send was successful
@@ -170,13 +172,84 @@ bool logout();
     3. Receive a result from the server. If the result is Error::SUCCESS, proceed.
        If it is not abort.
     4. Receive the number of messages for the logged in user.
-    5. Receive n message ID and content pairs (i32 and string).
-    6. Receive a result.
+    5. Receive n messages (i32 ID, then sender, content, attachment digest, and attachment name strings).
+    6. Receive a result. Error::PARTIAL if the server is still loading its message history and some messages may be missing.
 
     Returns the number of new messages (used to determine if the new message popup must be shown)
 */
 i32 refresh();
 
+/*
+    Upload a file to the server's attachment store. The file is addressed by the SHA-256 digest of its contents,
+    so if the server already has it (eg. someone else sent the same file) nothing is uploaded.
+
+    The flow between the client and server is as follows:
+    1. Send UPLOAD_ATTACHMENT opcode.
+    2. Send user ID of the logged in user.
+    3. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+       If it is not abort.
+    4. Send the digest string and the size of the file (u64).
+    5. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+       If it is not abort.
+    6. Receive the number of bytes the server already has (u64).
+    7. For every remaining chunk of at most CHAT_ATTACHMENT_CHUNK_SIZE bytes:
+        7a. Send UPLOAD_ATTACHMENT_CHUNK opcode.
+        7b. Send user ID of the logged in user.
+        7c. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+            If it is not abort.
+        7d. Send the digest string, the offset of the chunk (u64), and the length of the chunk (u32).
+        7e. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+            If it is not abort.
+        7f. Send the chunk data.
+        7g. Receive a result.
+
+    Parameter 'path': The path to the file to upload.
+    Parameter 'out_digest': Set to the digest of the uploaded file on success.
+    Returns whether or not the upload was successful
+*/
+bool upload_attachment(const std::string &path, std::string *out_digest);
+
+/*
+    Download the attachment of a message.
+
+    The flow between the client and server is as follows:
+    1. Send DOWNLOAD_ATTACHMENT opcode.
+    2. Send user ID of the logged in user.
+    3. Send the digest string of the attachment.
+    4. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+       If it is not abort.
+    5. Receive the size of the attachment (u64).
+    6. For every chunk of at most CHAT_ATTACHMENT_CHUNK_SIZE bytes:
+        6a. Send DOWNLOAD_ATTACHMENT_CHUNK opcode.
+        6b. Send user ID of the logged in user.
+        6c. Send the digest string and the offset of the chunk (u64).
+        6d. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+            If it is not abort.
+        6e. Receive the chunk data.
+
+    Parameter 'message': The message whose attachment should be downloaded.
+    Parameter 'path': The path to save the attachment to.
+    Returns whether or not the download was successful
+*/
+bool download_attachment(const ClientMessage &message, const std::string &path);
+
+/*
+    Take a backup of the journal of the running server. Only the admin user of the server can take backups.
+
+    The flow between the client and server is as follows:
+    1. Send BACKUP opcode.
+    2. Send user ID of the logged in user.
+    3. Receive a result from the server. If the result is Error::SUCCESS, proceed.
+       If it is not abort.
+    4. Send the name of the backup as a string. The server writes it next to its journal, to be started from with '--journal-name'.
+    5. Receive a result once the backup is complete. If the result is Error::SUCCESS, receive the journal position the backup covers up to (u64).
+
+    Parameter 'name': The name of the backup.
+    Parameter 'out_position': Set to the journal position the backup covers up to on success.
+    Returns whether or not the backup was taken
+*/
+bool backup(const std::string &name, u64 *out_position);
+
 /*
     Close the connection to the server.
 
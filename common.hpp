@@ -28,6 +28,9 @@ using f64 = double;
 
 #define CHAT_MAX_STATUS_LENGTH 32
 #define CHAT_MAX_MESSAGE_LENGTH 256
+#define CHAT_MAX_ATTACHMENT_NAME_LENGTH 256
+#define CHAT_MAX_ATTACHMENT_SIZE (64ull * 1024 * 1024)
+#define CHAT_ATTACHMENT_CHUNK_SIZE (64 * 1024)
 
 #define RECIPIENT_TYPE_USER  0
 #define RECIPIENT_TYPE_GROUP 1
@@ -45,12 +48,19 @@ enum Opcode {
     REGISTER_GROUP,
     GOODBYE,
     HEARTBEAT,
+    UPLOAD_ATTACHMENT,
+    UPLOAD_ATTACHMENT_CHUNK,
+    DOWNLOAD_ATTACHMENT,
+    BACKUP,
+    DOWNLOAD_ATTACHMENT_CHUNK,
 };
 
 enum Error {
     SUCCESS,
     INVALID_REQUEST,
     UNAUTHORIZED,
+    // The request succeeded, but the server is still loading its message history, so the messages sent back may be incomplete.
+    PARTIAL,
 };
 
 #ifdef _WIN32
@@ -7,15 +7,24 @@
 
 #pragma once
 #include "recipient.hpp"
+#include <string_view>
 
 class Group : public Recipient {
 public:
     Group() = default;
     // Specialization for allowing the vector of usernames to be moved instead of copied to the group class.
-    Group(const std::string &name, Util::IchigoVector<std::string> &&users)      : m_name(name), m_users(users) {}
-    Group(const std::string &name, const Util::IchigoVector<std::string> &users) : m_name(name), m_users(users) {}
+    Group(std::string_view name, Util::IchigoVector<std::string> &&users)      : m_name(name), m_users(std::move(users)) {}
+    Group(std::string_view name, const Util::IchigoVector<std::string> &users) : m_name(name), m_users(users) {}
 
-    Util::IchigoVector<std::string> usernames() const override { return m_users; }
+    Util::IchigoSmallVector<std::string, 1> usernames() const override {
+        Util::IchigoSmallVector<std::string, 1> ret(m_users.size());
+        for (u64 i = 0; i < m_users.size(); ++i)
+            ret.append(m_users.at(i));
+
+        return ret;
+    }
+    // The usernames without copying them.
+    const Util::IchigoVector<std::string> &members() const     { return m_users; }
     const std::string &name() const                            { return m_name; }
 private:
     std::string m_name;
@@ -7,6 +7,7 @@
 
 #pragma once
 #include <string>
+#include <string_view>
 
 #include "util.hpp"
 #include "recipient.hpp"
@@ -15,16 +16,24 @@
 class Message {
 public:
     Message() = default;
-    Message(const std::string &message, Recipient *recipient, User *sender)         : m_content(message), m_recipient(recipient), m_sender(sender) {}
-    Message(const std::string &message, Recipient *recipient, User *sender, i32 id) : m_content(message), m_recipient(recipient), m_sender(sender), m_id(id) {}
+    Message(std::string_view message, Recipient *recipient, User *sender)         : m_content(message), m_recipient(recipient), m_sender(sender) {}
+    Message(std::string_view message, Recipient *recipient, User *sender, i32 id) : m_content(message), m_recipient(recipient), m_sender(sender), m_id(id) {}
 
     const std::string &content() const { return m_content; }
     const Recipient *recipient() const { return m_recipient; }
     const User *sender() const         { return m_sender; }
     i32 id() const                     { return m_id; }
     void set_id(i32 id)                { m_id = id; }
+
+    // Attachments are referenced by the SHA-256 digest of their contents. An empty digest means there is no attachment.
+    bool has_attachment() const                  { return !m_attachment_digest.empty(); }
+    const std::string &attachment_digest() const { return m_attachment_digest; }
+    const std::string &attachment_name() const   { return m_attachment_name; }
+    void set_attachment(std::string_view digest, std::string_view name) { m_attachment_digest = digest; m_attachment_name = name; }
 private:
     std::string m_content;
+    std::string m_attachment_digest;
+    std::string m_attachment_name;
     Recipient *m_recipient;
     User *m_sender;
     i32 m_id = -1;
@@ -11,6 +11,7 @@
 
 class Recipient {
 public:
-    virtual Util::IchigoVector<std::string> usernames() const = 0;
+    // Most recipients are a single user, so the usernames are returned in a vector that holds one without allocating.
+    virtual Util::IchigoSmallVector<std::string, 1> usernames() const = 0;
     virtual ~Recipient() {};
 };
@@ -0,0 +1,232 @@
+/*
+    Server attachment blob store module implementation. See header (blob_store.hpp) for public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "blob_store.hpp"
+#include "chat_server.hpp"
+#include "../sha256.hpp"
+#include <ctime>
+
+/*
+    State of an upload that has not received all of its chunks yet.
+    The digest is computed incrementally as chunks arrive so the file never has to be read back for verification.
+*/
+struct PendingUpload {
+    std::string digest;
+    // The user that began the upload, and when it last received a chunk.
+    std::string owner;
+    u64 last_active   = 0;
+    u64 size          = 0;
+    u64 received      = 0;
+    std::FILE *file   = nullptr;
+    Util::Sha256 hash;
+};
+
+// The directory that blobs are stored in
+static std::string store_directory;
+// All uploads that are currently in progress
+static Util::IchigoVector<PendingUpload *> pending_uploads;
+
+static std::string partial_path_of(const std::string &digest) {
+    return store_directory + "/" + digest + ".partial";
+}
+
+static i32 find_pending_upload_index(const std::string &digest) {
+    for (u32 i = 0; i < pending_uploads.size(); ++i) {
+        if (pending_uploads.at(i)->digest == digest)
+            return i;
+    }
+
+    return -1;
+}
+
+static void discard_pending_upload(u32 index) {
+    PendingUpload *upload = pending_uploads.remove(index);
+    std::fclose(upload->file);
+    std::remove(partial_path_of(upload->digest).c_str());
+    delete upload;
+}
+
+/*
+    Mark a pending upload as active now. Uploads are kept in the order they were last active, so it moves to the end.
+*/
+static void touch_pending_upload(u32 index) {
+    pending_uploads.at(index)->last_active = time(nullptr);
+    pending_uploads.append(pending_uploads.remove(index));
+}
+
+/*
+    Discard pending uploads until a user has room for another one: those that timed out, then the idlest of the user's own
+    uploads over BLOB_STORE_MAX_UPLOADS_PER_USER, then the idlest of all over BLOB_STORE_MAX_UPLOADS.
+    Parameter 'owner': The user about to begin an upload.
+*/
+static void make_room_for_upload(const std::string &owner) {
+    const u64 now = time(nullptr);
+    for (u32 i = pending_uploads.size(); i > 0; --i) {
+        if (now - pending_uploads.at(i - 1)->last_active > BLOB_STORE_UPLOAD_TIMEOUT) {
+            ICHIGO_INFO("Discarding idle upload of blob %s", pending_uploads.at(i - 1)->digest.c_str());
+            discard_pending_upload(i - 1);
+        }
+    }
+
+    // The idlest uploads come first (see 'touch_pending_upload()').
+    u32 owned = 0;
+    for (u32 i = 0; i < pending_uploads.size(); ++i)
+        owned += pending_uploads.at(i)->owner == owner;
+
+    for (u32 i = 0; i < pending_uploads.size() && owned >= BLOB_STORE_MAX_UPLOADS_PER_USER;) {
+        if (pending_uploads.at(i)->owner != owner) {
+            ++i;
+            continue;
+        }
+
+        ICHIGO_INFO("%s has too many uploads in progress. Discarding the upload of blob %s.", owner.c_str(), pending_uploads.at(i)->digest.c_str());
+        discard_pending_upload(i);
+        --owned;
+    }
+
+    while (pending_uploads.size() >= BLOB_STORE_MAX_UPLOADS) {
+        ICHIGO_INFO("Too many uploads in progress. Discarding the upload of blob %s.", pending_uploads.at(0)->digest.c_str());
+        discard_pending_upload(0);
+    }
+}
+
+void BlobStore::init(const std::string &directory) {
+    store_directory = directory;
+    ChatServer::platform_create_directory(directory);
+
+    // Uploads in progress are only kept in memory, so they cannot be resumed after a restart.
+    const char *partial_extension[] = { "partial" };
+    Util::IchigoVector<std::string> partial_files = ChatServer::platform_recurse_directory(directory, partial_extension, 1);
+    for (u32 i = 0; i < partial_files.size(); ++i)
+        std::remove(partial_files.at(i).c_str());
+
+    ICHIGO_INFO("Blob store initialized at: %s", directory.c_str());
+}
+
+bool BlobStore::contains(const std::string &digest) {
+    return Util::Sha256::is_valid_digest(digest) && ChatServer::platform_file_exists(path_of(digest).c_str());
+}
+
+bool BlobStore::begin_upload(const std::string &owner, const std::string &digest, u64 size, u64 *stored) {
+    assert(Util::Sha256::is_valid_digest(digest));
+
+    if (contains(digest)) {
+        *stored = size_of(digest);
+        return true;
+    }
+
+    i32 index = find_pending_upload_index(digest);
+    if (index != -1) {
+        if (pending_uploads.at(index)->size == size) {
+            *stored = pending_uploads.at(index)->received;
+            touch_pending_upload(index);
+            return true;
+        }
+
+        // Someone started an upload of this digest with a different size. One of them is lying, so start over.
+        discard_pending_upload(index);
+    }
+
+    *stored = 0;
+
+    // No chunk ever completes an empty blob, so it is checked and stored here.
+    if (size == 0) {
+        if (Util::Sha256().finish() != digest)
+            return false;
+
+        std::FILE *file = ChatServer::platform_open_file(path_of(digest), "wb");
+        if (!file) {
+            ICHIGO_ERROR("Failed to create blob file for %s", digest.c_str());
+            return false;
+        }
+
+        std::fclose(file);
+        ICHIGO_INFO("Stored blob %s (0 bytes)", digest.c_str());
+        return true;
+    }
+
+    make_room_for_upload(owner);
+
+    PendingUpload *upload = new PendingUpload;
+    upload->digest      = digest;
+    upload->owner       = owner;
+    upload->last_active = time(nullptr);
+    upload->size        = size;
+    upload->file        = ChatServer::platform_open_file(partial_path_of(digest), "wb");
+
+    if (!upload->file) {
+        ICHIGO_ERROR("Failed to create partial blob file for %s", digest.c_str());
+        delete upload;
+        return false;
+    }
+
+    pending_uploads.append(upload);
+    return true;
+}
+
+bool BlobStore::write_chunk(const std::string &digest, u64 offset, const char *data, u32 length) {
+    i32 index = find_pending_upload_index(digest);
+    if (index == -1)
+        return false;
+
+    PendingUpload *upload = pending_uploads.at(index);
+    if (offset != upload->received || upload->received + length > upload->size)
+        return false;
+
+    if (std::fwrite(data, sizeof(char), length, upload->file) != length) {
+        ICHIGO_ERROR("Failed to write chunk to blob %s", digest.c_str());
+        discard_pending_upload(index);
+        return false;
+    }
+
+    upload->hash.update(data, length);
+    upload->received += length;
+
+    if (upload->received < upload->size) {
+        touch_pending_upload(index);
+        return true;
+    }
+
+    // Final chunk. Verify the contents before making the blob visible under its digest.
+    if (upload->hash.finish() != digest) {
+        ICHIGO_ERROR("Uploaded blob does not match its digest (%s). Discarding.", digest.c_str());
+        discard_pending_upload(index);
+        return false;
+    }
+
+    // A message referencing the blob is acknowledged once its journal record is durable, so the blob has to be durable before it
+    // is visible under its digest. Otherwise a crash could leave an acknowledged message pointing at a blob that is gone.
+    if (std::fflush(upload->file) != 0 || !ChatServer::platform_sync_file(upload->file)) {
+        ICHIGO_ERROR("Failed to sync blob %s", digest.c_str());
+        discard_pending_upload(index);
+        return false;
+    }
+
+    pending_uploads.remove(index);
+    std::fclose(upload->file);
+
+    bool renamed = std::rename(partial_path_of(digest).c_str(), path_of(digest).c_str()) == 0;
+    if (!renamed) {
+        // Lost a race with an identical upload. The blob is stored either way.
+        std::remove(partial_path_of(digest).c_str());
+    }
+
+    ICHIGO_INFO("Stored blob %s (%llu bytes)", digest.c_str(), static_cast<unsigned long long>(upload->size));
+    delete upload;
+    return contains(digest);
+}
+
+std::string BlobStore::path_of(const std::string &digest) {
+    return store_directory + "/" + digest;
+}
+
+u64 BlobStore::size_of(const std::string &digest) {
+    if (!contains(digest))
+        return 0;
+
+    return ChatServer::platform_file_size(path_of(digest));
+}
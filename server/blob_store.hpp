@@ -0,0 +1,79 @@
+/*
+    Server attachment blob store module. Stores attachment contents on local disk addressed by the SHA-256
+    digest of their contents (digest -> file). Identical attachments, whether uploaded by different users or
+    fanned out to every member of a group, are stored exactly once and referenced from messages by digest.
+
+    Uploads arrive in chunks and are verified against their digest before they become visible.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+
+#include "../common.hpp"
+#include <string>
+
+// The most uploads a user can have in progress at once. Beginning another discards the one that was left idle the longest.
+#define BLOB_STORE_MAX_UPLOADS_PER_USER 4
+// The most uploads in progress at once across all users, so that abandoned uploads cannot use up the file handles of the server.
+#define BLOB_STORE_MAX_UPLOADS 64
+// How long an upload can go without receiving a chunk before it is discarded, in seconds.
+#define BLOB_STORE_UPLOAD_TIMEOUT (10 * 60)
+
+namespace BlobStore {
+    /*
+        Initialize the blob store module. Creates the store directory if it does not exist, and deletes the partial files
+        of uploads that were in progress when the server last stopped.
+
+        Parameter 'directory': The path to the directory that blobs are stored in.
+    */
+    void init(const std::string &directory);
+
+    /*
+        Check if a blob is fully stored.
+        Parameter 'digest': The SHA-256 digest of the blob (64 lowercase hex characters).
+        Returns whether or not the blob is present in the store.
+    */
+    bool contains(const std::string &digest);
+
+    /*
+        Begin (or resume) an upload of a blob. An empty blob has nothing to upload, so it is stored right away.
+        Uploads that have been idle for longer than BLOB_STORE_UPLOAD_TIMEOUT are discarded first, and then the idlest uploads
+        over the limits (BLOB_STORE_MAX_UPLOADS_PER_USER and BLOB_STORE_MAX_UPLOADS).
+        Parameter 'owner': The name of the user uploading the blob.
+        Parameter 'digest': The SHA-256 digest of the blob being uploaded.
+        Parameter 'size': The total size of the blob in bytes.
+        Parameter 'stored': Set to the number of bytes the store already has for this blob. If this is equal to 'size', the
+        blob is already stored and nothing has to be uploaded.
+        Returns whether or not the upload could be begun. It cannot if the blob is empty but does not match the digest, or if
+        its partial file could not be created.
+    */
+    bool begin_upload(const std::string &owner, const std::string &digest, u64 size, u64 *stored);
+
+    /*
+        Write a chunk of an upload started with 'begin_upload()'. Chunks must be written in order.
+        When the final chunk is written the contents are verified against the digest and the blob is made visible.
+
+        Parameter 'digest': The SHA-256 digest of the blob being uploaded.
+        Parameter 'offset': The offset of this chunk in the blob.
+        Parameter 'data': The chunk data.
+        Parameter 'length': The length of the chunk in bytes.
+        Returns whether or not the chunk was accepted. A chunk is rejected if there is no upload in progress,
+        if it is out of order, or if it completes the blob but the contents do not match the digest (the upload is discarded).
+    */
+    bool write_chunk(const std::string &digest, u64 offset, const char *data, u32 length);
+
+    /*
+        Get the path to the file holding a stored blob. Only valid if 'contains()' returns true.
+        Parameter 'digest': The SHA-256 digest of the blob.
+    */
+    std::string path_of(const std::string &digest);
+
+    /*
+        Get the size of a stored blob.
+        Parameter 'digest': The SHA-256 digest of the blob.
+        Returns the size in bytes of the blob, or 0 if it is not stored.
+    */
+    u64 size_of(const std::string &digest);
+}
@@ -16,15 +16,108 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
-#else
+#elif !defined(__linux__)
+// Linux only has the file services (see linux_chat_server.cpp), for tools built on the journal module.
 #error "Unsupported platform"
 #endif
 
 namespace ChatServer {
-void init();
+/*
+    Init and run the server.
+    Parameter 'argc': The number of command line arguments.
+    Parameter 'argv': The command line arguments. Supported options:
+        --durability sync|interval|none: When journal commits are made durable (default sync). See 'Journal::Durability'.
+        --sync-interval-ms N: The maximum time between journal syncs in interval mode (default 100).
+        --snapshot-interval-mb N: Write a snapshot (and compact the journal) every N megabytes of journal (default 64).
+        --segment-size-mb N: The size of each journal segment file (default 64).
+        --no-segment-compression: Leave sealed journal segments uncompressed (they are compressed by default).
+        --port N: The localhost port to accept clients on (default 8080).
+        --journal-name NAME: Keep the journal and snapshot in NAME.chatjournal and NAME.chatsnapshot (default "default").
+        --replication-port N: Stream the journal to followers connecting on this localhost port (see replication.hpp).
+        --follow N: Run as a read-only follower of the primary streaming on this localhost port.
+        --promote-after-s N: Take over as the primary once the primary has been unreachable for N seconds (default 0, never).
+        --admin NAME: The user allowed to take backups of the journal while the server runs (default none).
+        --journal-benchmark: Run the journal benchmark instead of the server (see journal_benchmark.hpp).
+        --benchmark-records N, --benchmark-batch N: Benchmark parameters.
+*/
+void init(i32 argc, char **argv);
 void deinit();
 
 std::FILE *platform_open_file(const std::string &path, const std::string &mode);
 bool platform_file_exists(const char *path);
 Util::IchigoVector<std::string> platform_recurse_directory(const std::string &path, const char **extension_filter, const u16 extension_filter_count);
+
+/*
+    Flush a file's data to stable storage (FlushFileBuffers on win32, fdatasync on posix).
+    The stdio buffer of the file must be flushed first.
+    Parameter 'file': The file to sync.
+    Returns whether or not the file was synced.
+*/
+bool platform_sync_file(std::FILE *file);
+
+/*
+    Reserve disk space for a file without changing its size, so that appending up to that size does not have to
+    allocate space as it goes (SetFileInformationByHandle(FileAllocationInfo) on win32, fallocate(FALLOC_FL_KEEP_SIZE) on linux).
+    Parameter 'file': The file to preallocate. Must stay open while it is written, or the reservation may be released.
+    Parameter 'size': The number of bytes to reserve.
+    Returns whether or not the space was reserved.
+*/
+bool platform_preallocate_file(std::FILE *file, u64 size);
+
+/*
+    Truncate an open file. Anything buffered for it is flushed first.
+    Parameter 'file': The file to truncate. Must not be mapped.
+    Parameter 'size': The size to truncate the file to.
+    Returns whether or not the file was truncated.
+*/
+bool platform_truncate_file(std::FILE *file, u64 size);
+
+/*
+    Create a directory if it does not already exist.
+    Parameter 'path': The path to the directory to create.
+*/
+void platform_create_directory(const std::string &path);
+
+/*
+    Get the size of a file.
+    Parameter 'path': The path to the file.
+    Returns the size of the file in bytes, or 0 if it does not exist.
+*/
+u64 platform_file_size(const std::string &path);
+
+/*
+    Atomically replace a file with another (MoveFileEx on win32, rename on posix). The replacement is durable
+    once this returns. Neither file may be open.
+    Parameter 'source': The path to the new file.
+    Parameter 'destination': The path to the file to replace. Created if it does not exist.
+    Returns whether or not the file was replaced.
+*/
+bool platform_replace_file(const std::string &source, const std::string &destination);
+
+/*
+    Map a whole file into memory read-only, hinting to the OS that it will be read sequentially
+    (MapViewOfFile and PrefetchVirtualMemory on win32, mmap and madvise on posix).
+    Parameter 'path': The path to the file to map.
+    Parameter 'out_size': Set to the size of the file in bytes.
+    Returns a pointer to the start of the mapping, or nullptr if the file could not be mapped (or is empty).
+    The mapping must be released with 'platform_unmap_file()'.
+*/
+const char *platform_map_file(const std::string &path, u64 *out_size);
+
+/*
+    Release a mapping created by 'platform_map_file()'.
+    Parameter 'mapping': The pointer returned by 'platform_map_file()'.
+    Parameter 'size': The size of the mapping.
+*/
+void platform_unmap_file(const char *mapping, u64 size);
+
+/*
+    Send part of a file over a socket without copying it through user space (TransmitFile on win32).
+    Parameter 'socket': The socket to send the file on.
+    Parameter 'path': The path to the file to send.
+    Parameter 'offset': Where in the file to start sending from.
+    Parameter 'length': The number of bytes to send. Must not run past the end of the file.
+    Returns whether or not all of it was sent.
+*/
+bool platform_send_file(u32 socket, const std::string &path, u64 offset, u32 length);
 }
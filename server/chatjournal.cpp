@@ -0,0 +1,672 @@
+/*
+    Offline journal tool. Reads a journal (and optionally a snapshot) with the same parser and parallel replay as the
+    server (see 'Journal::open_read_only()'), and never modifies it. Runs on linux with the linux platform layer.
+
+    Usage: chatjournal <command> <journal> [options]
+        stats:            Count the records of each operation and their size, the users, groups, and messages, and how many
+                          of the messages were deleted.
+        verify:           Check every record checksum, that the journal does not end with a torn record, and that every record
+                          only refers to users, groups, and messages that exist (which the server assumes when it replays).
+                          Exits with status 1 if anything is wrong.
+        dump:             Print the records, one per line, with their index and the journal position they end at. Filtered with
+                          '--op', '--user', '--id', and '--limit'.
+        state:            Rebuild the server state as of '--position' or '--before-id' (see point_in_time.hpp) and print a summary
+                          of it. With '--id', print that message; with '--user' (and '--with'), list the messages of that user.
+        compact <output>: Write a new journal to <output> without deleted messages, DELETE_MESSAGE records, or all but the
+                          last ID lease. The server takes the output as a journal written as a single file; if '--snapshot'
+                          was given, the output holds the whole state and must be used without a snapshot.
+
+    Options:
+        --snapshot PATH: Replay this snapshot first, then the journal from the position it was taken at, like the server does.
+                         Without it, every live segment of the journal is read.
+                         With 'state', the snapshot is only used if it was taken before the point asked for.
+        --op NAME:       Only dump records of this operation (eg. NEW_MESSAGE).
+        --user NAME:     Only dump records that mention this user or group. With 'state', list the messages of this user.
+        --with NAME:     With 'state' and '--user', only list the messages between the user and this user or group.
+        --id N:          Only dump records about the message with this ID. With 'state', print the message with this ID.
+        --limit N:       Dump (or list) at most N records.
+        --position N:    Rebuild the state from the records that end at or before this journal position.
+        --before-id N:   Rebuild the state from the records before the one that created the message with this ID.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "../common.hpp"
+#include "journal.hpp"
+#include "point_in_time.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// The most problems 'verify' prints. The rest are only counted.
+#define MAX_REPORTED_PROBLEMS 32
+
+static const char *OPERATION_NAMES[] = { "NEW_USER", "NEW_MESSAGE", "DELETE_MESSAGE", "UPDATE_ID", "NEW_GROUP", "RESTORE_MESSAGE" };
+static constexpr u32 OPERATION_COUNT = ARRAY_LEN(OPERATION_NAMES);
+
+struct Options {
+    std::string journal;
+    std::string snapshot;
+    std::string output;
+    i32 operation = -1;
+    std::string user;
+    std::string with;
+    i64 id        = -1;
+    u64 limit     = UINT64_MAX;
+    PointInTime::Bound bound;
+};
+
+/*
+    The state needed to resolve what a record refers to, rebuilt as records are read the same way the server does.
+    Only names and IDs are kept, not message contents.
+*/
+struct ReplayState {
+    std::unordered_set<std::string> users;
+    std::unordered_map<std::string, Util::IchigoVector<std::string>> groups;
+    std::unordered_set<i32> live_messages;
+    i32 next_id        = 0;
+    u32 id_lease_limit = 0;
+    i32 highest_id     = 0;
+};
+
+static const char *operation_name(Journal::Operation operation) {
+    const u32 index = static_cast<u32>(operation);
+    return index < OPERATION_COUNT ? OPERATION_NAMES[index] : "UNKNOWN";
+}
+
+/*
+    Get the IDs a NEW_MESSAGE record creates: one per recipient, consecutive. Messages journaled before IDs were leased
+    in blocks take their ID from the state instead, like the server does on replay.
+    Parameter 'state': The state before the record.
+    Parameter 'transaction': The record.
+    Parameter 'first_id': Set to the first ID.
+    Returns the number of IDs (0 if the recipient does not exist).
+*/
+static u32 message_ids(const ReplayState &state, const Journal::NewMessageTransaction *transaction, i32 *first_id) {
+    *first_id = transaction->id() == -1 ? state.next_id : transaction->id();
+    if (transaction->recipient_type() == RECIPIENT_TYPE_USER)
+        return state.users.count(transaction->recipient()) > 0 ? 1 : 0;
+
+    auto group = state.groups.find(transaction->recipient());
+    if (transaction->recipient_type() != RECIPIENT_TYPE_GROUP || group == state.groups.end())
+        return 0;
+
+    return group->second.size();
+}
+
+/*
+    Apply a record to the state.
+    Parameter 'state': The state to update.
+    Parameter 'transaction': The record.
+*/
+static void apply(ReplayState &state, const Journal::Transaction *transaction) {
+    switch (transaction->operation()) {
+        case Journal::Operation::NEW_USER: {
+            state.users.insert(static_cast<const Journal::NewUserTransaction *>(transaction)->username());
+        } break;
+        case Journal::Operation::NEW_GROUP: {
+            const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+            state.groups[new_group_transaction->name()] = new_group_transaction->users();
+        } break;
+        case Journal::Operation::NEW_MESSAGE: {
+            const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+            i32 first_id;
+            u32 count = message_ids(state, new_message_transaction, &first_id);
+            for (u32 i = 0; i < count; ++i)
+                state.live_messages.insert(first_id + i);
+
+            // Legacy group messages move the next ID past their copies.
+            if (new_message_transaction->id() == -1 && new_message_transaction->recipient_type() == RECIPIENT_TYPE_GROUP)
+                state.next_id = first_id + count;
+
+            if (count > 0 && first_id + static_cast<i32>(count) - 1 > state.highest_id)
+                state.highest_id = first_id + count - 1;
+        } break;
+        case Journal::Operation::RESTORE_MESSAGE: {
+            i32 id = static_cast<const Journal::RestoreMessageTransaction *>(transaction)->id();
+            state.live_messages.insert(id);
+            if (id > state.highest_id)
+                state.highest_id = id;
+        } break;
+        case Journal::Operation::DELETE_MESSAGE: {
+            state.live_messages.erase(static_cast<const Journal::DeleteMessageTransaction *>(transaction)->id());
+        } break;
+        case Journal::Operation::UPDATE_ID: {
+            state.next_id        = static_cast<const Journal::UpdateIdTransaction *>(transaction)->id();
+            state.id_lease_limit = static_cast<const Journal::UpdateIdTransaction *>(transaction)->id();
+        } break;
+    }
+}
+
+/*
+    Read every record of the journal in order.
+    Parameter 'options': Which journal and snapshot to read.
+    Parameter 'visit': Called with the index and the transaction of each record.
+    Returns whether or not every record could be read. A torn tail is reported by 'Journal::torn_tail_size()' instead.
+*/
+template<typename F>
+static bool read_journal(const Options &options, F visit) {
+    if (!Journal::open_read_only(options.journal, options.snapshot)) {
+        Journal::deinit();
+        return false;
+    }
+
+    bool ret = true;
+    for (u64 index = 0; Journal::has_more_transactions(); ++index) {
+        Journal::Transaction *transaction = Journal::next_transaction();
+        if (!transaction) {
+            ICHIGO_ERROR("Failed to read record %llu", static_cast<unsigned long long>(index));
+            ret = false;
+            break;
+        }
+
+        visit(index, transaction);
+        Journal::return_transaction(transaction);
+    }
+
+    Journal::deinit();
+    return ret;
+}
+
+static f64 seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+}
+
+static i32 run_stats(const Options &options) {
+    u64 counts[OPERATION_COUNT]{};
+    u64 bytes[OPERATION_COUNT]{};
+    u64 messages = 0;
+    u64 deleted  = 0;
+    ReplayState state;
+    std::string record;
+
+    const auto start = std::chrono::steady_clock::now();
+    bool ok = read_journal(options, [&](u64, const Journal::Transaction *transaction) {
+        const u32 operation = static_cast<u32>(transaction->operation());
+        record.clear();
+        Journal::encode_record(transaction, record);
+        ++counts[operation];
+        bytes[operation] += record.size();
+
+        if (transaction->operation() == Journal::Operation::NEW_MESSAGE) {
+            i32 first_id;
+            messages += message_ids(state, static_cast<const Journal::NewMessageTransaction *>(transaction), &first_id);
+        } else if (transaction->operation() == Journal::Operation::RESTORE_MESSAGE) {
+            ++messages;
+        } else if (transaction->operation() == Journal::Operation::DELETE_MESSAGE) {
+            ++deleted;
+        }
+
+        apply(state, transaction);
+    });
+
+    const f64 elapsed = seconds_since(start);
+    u64 total_records = 0;
+    u64 total_bytes   = 0;
+    std::printf("%-16s %12s %14s\n", "operation", "records", "bytes");
+    for (u32 i = 0; i < OPERATION_COUNT; ++i) {
+        std::printf("%-16s %12llu %14llu\n", OPERATION_NAMES[i], static_cast<unsigned long long>(counts[i]), static_cast<unsigned long long>(bytes[i]));
+        total_records += counts[i];
+        total_bytes   += bytes[i];
+    }
+
+    std::printf("%-16s %12llu %14llu\n\n", "total", static_cast<unsigned long long>(total_records), static_cast<unsigned long long>(total_bytes));
+    std::printf("users:            %llu\n", static_cast<unsigned long long>(state.users.size()));
+    std::printf("groups:           %llu\n", static_cast<unsigned long long>(state.groups.size()));
+    std::printf("messages:         %llu (%llu live)\n", static_cast<unsigned long long>(messages), static_cast<unsigned long long>(state.live_messages.size()));
+    std::printf("deleted:          %llu (%.1f%%)\n", static_cast<unsigned long long>(deleted), messages > 0 ? 100.0 * deleted / messages : 0.0);
+    std::printf("torn tail:        %llu bytes\n", static_cast<unsigned long long>(Journal::torn_tail_size()));
+    std::printf("read in %.3f s (%.1f MB/s)\n", elapsed, elapsed > 0 ? total_bytes / elapsed / (1024 * 1024) : 0.0);
+    return ok ? 0 : 1;
+}
+
+static i32 run_verify(const Options &options) {
+    ReplayState state;
+    std::unordered_set<i32> used_ids;
+    u64 problems = 0;
+    u64 records  = 0;
+
+    auto report = [&](u64 index, const char *fmt, const std::string &detail) {
+        if (++problems <= MAX_REPORTED_PROBLEMS) {
+            std::printf("record %llu: ", static_cast<unsigned long long>(index));
+            std::printf(fmt, detail.c_str());
+            std::printf("\n");
+        }
+    };
+
+    auto check_id = [&](u64 index, i32 id) {
+        if (!used_ids.insert(id).second)
+            report(index, "message ID %s is used twice", std::to_string(id));
+        if (static_cast<u32>(id) > state.id_lease_limit)
+            report(index, "message ID %s is beyond the last ID lease, so it could be handed out again", std::to_string(id));
+    };
+
+    bool ok = read_journal(options, [&](u64 index, const Journal::Transaction *transaction) {
+        ++records;
+        switch (transaction->operation()) {
+            case Journal::Operation::NEW_USER: {
+                const std::string &username = static_cast<const Journal::NewUserTransaction *>(transaction)->username();
+                if (state.users.count(username) > 0)
+                    report(index, "user \"%s\" is created twice", username);
+            } break;
+            case Journal::Operation::NEW_GROUP: {
+                const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+                if (state.groups.count(new_group_transaction->name()) > 0)
+                    report(index, "group \"%s\" is created twice", new_group_transaction->name());
+
+                for (u32 i = 0; i < new_group_transaction->users().size(); ++i) {
+                    if (state.users.count(new_group_transaction->users().at(i)) == 0)
+                        report(index, "group member \"%s\" does not exist", new_group_transaction->users().at(i));
+                }
+            } break;
+            case Journal::Operation::NEW_MESSAGE: {
+                const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+                if (state.users.count(new_message_transaction->sender()) == 0)
+                    report(index, "sender \"%s\" does not exist", new_message_transaction->sender());
+
+                i32 first_id;
+                u32 count = message_ids(state, new_message_transaction, &first_id);
+                if (count == 0)
+                    report(index, "recipient \"%s\" does not exist", new_message_transaction->recipient());
+
+                for (u32 i = 0; i < count; ++i)
+                    check_id(index, first_id + i);
+            } break;
+            case Journal::Operation::RESTORE_MESSAGE: {
+                const Journal::RestoreMessageTransaction *restore_message_transaction = static_cast<const Journal::RestoreMessageTransaction *>(transaction);
+                if (state.users.count(restore_message_transaction->sender()) == 0)
+                    report(index, "sender \"%s\" does not exist", restore_message_transaction->sender());
+                if (state.users.count(restore_message_transaction->recipient()) == 0)
+                    report(index, "recipient \"%s\" does not exist", restore_message_transaction->recipient());
+
+                check_id(index, restore_message_transaction->id());
+            } break;
+            case Journal::Operation::DELETE_MESSAGE: {
+                u32 id = static_cast<const Journal::DeleteMessageTransaction *>(transaction)->id();
+                if (state.live_messages.count(id) == 0)
+                    report(index, "deleted message %s does not exist (or was already deleted)", std::to_string(id));
+            } break;
+            case Journal::Operation::UPDATE_ID: {
+                u32 id = static_cast<const Journal::UpdateIdTransaction *>(transaction)->id();
+                if (id < state.id_lease_limit)
+                    report(index, "the ID lease moves backwards to %s", std::to_string(id));
+            } break;
+        }
+
+        apply(state, transaction);
+    });
+
+    if (!ok) {
+        ++problems;
+        std::printf("the journal has a record that cannot be read (see above)\n");
+    }
+
+    if (Journal::torn_tail_size() > 0) {
+        ++problems;
+        std::printf("the journal ends with %llu bytes of torn or corrupt records\n", static_cast<unsigned long long>(Journal::torn_tail_size()));
+    }
+
+    if (problems > MAX_REPORTED_PROBLEMS)
+        std::printf("... and %llu more\n", static_cast<unsigned long long>(problems - MAX_REPORTED_PROBLEMS));
+
+    std::printf("%llu records, %llu problems\n", static_cast<unsigned long long>(records), static_cast<unsigned long long>(problems));
+    return problems == 0 ? 0 : 1;
+}
+
+/*
+    Print a string in quotes, escaping anything that would break the line.
+*/
+static void print_quoted(const std::string &string) {
+    std::putchar('"');
+    for (char c : string) {
+        if (c == '"' || c == '\\')
+            std::printf("\\%c", c);
+        else if (c == '\n')
+            std::printf("\\n");
+        else if (static_cast<u8>(c) < 0x20)
+            std::printf("\\x%02x", static_cast<u8>(c));
+        else
+            std::putchar(c);
+    }
+
+    std::putchar('"');
+}
+
+static void print_attachment(const std::string &digest, const std::string &name) {
+    if (digest.empty())
+        return;
+
+    std::printf(" attachment=");
+    print_quoted(digest);
+    std::putchar(' ');
+    print_quoted(name);
+}
+
+/*
+    Check if a record matches the filters of 'dump'.
+*/
+static bool matches(const Options &options, const Journal::Transaction *transaction) {
+    if (options.operation != -1 && static_cast<i32>(transaction->operation()) != options.operation)
+        return false;
+
+    bool user_matches = options.user.empty();
+    bool id_matches   = options.id == -1;
+    switch (transaction->operation()) {
+        case Journal::Operation::NEW_USER: {
+            user_matches |= static_cast<const Journal::NewUserTransaction *>(transaction)->username() == options.user;
+        } break;
+        case Journal::Operation::NEW_GROUP: {
+            const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+            user_matches |= new_group_transaction->name() == options.user || new_group_transaction->users().index_of(options.user) != -1;
+        } break;
+        case Journal::Operation::NEW_MESSAGE: {
+            const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+            user_matches |= new_message_transaction->sender() == options.user || new_message_transaction->recipient() == options.user;
+            id_matches   |= new_message_transaction->id() == options.id;
+        } break;
+        case Journal::Operation::RESTORE_MESSAGE: {
+            const Journal::RestoreMessageTransaction *restore_message_transaction = static_cast<const Journal::RestoreMessageTransaction *>(transaction);
+            user_matches |= restore_message_transaction->sender() == options.user || restore_message_transaction->recipient() == options.user;
+            id_matches   |= restore_message_transaction->id() == options.id;
+        } break;
+        case Journal::Operation::DELETE_MESSAGE: {
+            id_matches |= static_cast<const Journal::DeleteMessageTransaction *>(transaction)->id() == options.id;
+        } break;
+        case Journal::Operation::UPDATE_ID: {
+        } break;
+    }
+
+    return user_matches && id_matches;
+}
+
+static i32 run_dump(const Options &options) {
+    u64 printed = 0;
+    bool ok = read_journal(options, [&](u64 index, const Journal::Transaction *transaction) {
+        if (printed >= options.limit || !matches(options, transaction))
+            return;
+
+        ++printed;
+        std::printf("%llu @%llu %s ", static_cast<unsigned long long>(index), static_cast<unsigned long long>(Journal::replay_position()),
+                    operation_name(transaction->operation()));
+        switch (transaction->operation()) {
+            case Journal::Operation::NEW_USER: {
+                print_quoted(static_cast<const Journal::NewUserTransaction *>(transaction)->username());
+            } break;
+            case Journal::Operation::NEW_GROUP: {
+                const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+                print_quoted(new_group_transaction->name());
+                for (u32 i = 0; i < new_group_transaction->users().size(); ++i) {
+                    std::putchar(' ');
+                    print_quoted(new_group_transaction->users().at(i));
+                }
+            } break;
+            case Journal::Operation::NEW_MESSAGE: {
+                const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+                if (new_message_transaction->id() == -1)
+                    std::printf("id=legacy ");
+                else
+                    std::printf("id=%d ", new_message_transaction->id());
+
+                print_quoted(new_message_transaction->sender());
+                std::printf(" -> %s ", new_message_transaction->recipient_type() == RECIPIENT_TYPE_GROUP ? "group" : "user");
+                print_quoted(new_message_transaction->recipient());
+                std::putchar(' ');
+                print_quoted(new_message_transaction->content());
+                print_attachment(new_message_transaction->attachment_digest(), new_message_transaction->attachment_name());
+            } break;
+            case Journal::Operation::RESTORE_MESSAGE: {
+                const Journal::RestoreMessageTransaction *restore_message_transaction = static_cast<const Journal::RestoreMessageTransaction *>(transaction);
+                std::printf("id=%u ", restore_message_transaction->id());
+                print_quoted(restore_message_transaction->sender());
+                std::printf(" -> ");
+                print_quoted(restore_message_transaction->recipient());
+                std::putchar(' ');
+                print_quoted(restore_message_transaction->content());
+                print_attachment(restore_message_transaction->attachment_digest(), restore_message_transaction->attachment_name());
+            } break;
+            case Journal::Operation::DELETE_MESSAGE: {
+                std::printf("id=%u", static_cast<const Journal::DeleteMessageTransaction *>(transaction)->id());
+            } break;
+            case Journal::Operation::UPDATE_ID: {
+                std::printf("%u", static_cast<const Journal::UpdateIdTransaction *>(transaction)->id());
+            } break;
+        }
+
+        std::putchar('\n');
+    });
+
+    return ok ? 0 : 1;
+}
+
+static void print_message(const PointInTime::Message &message) {
+    std::printf("id=%d @%llu ", message.id, static_cast<unsigned long long>(message.position));
+    print_quoted(message.sender);
+    std::printf(" -> ");
+    print_quoted(message.recipient);
+    if (!message.group.empty()) {
+        std::printf(" (group ");
+        print_quoted(message.group);
+        std::putchar(')');
+    }
+
+    std::putchar(' ');
+    print_quoted(message.content);
+    print_attachment(message.attachment_digest, message.attachment_name);
+    std::putchar('\n');
+}
+
+static i32 run_state(const Options &options) {
+    PointInTime::State state;
+    const auto start = std::chrono::steady_clock::now();
+    if (!PointInTime::reconstruct(options.journal, options.snapshot, options.bound, &state)) {
+        ICHIGO_ERROR("Failed to rebuild the state");
+        return 1;
+    }
+
+    std::printf("state as of journal position %llu (%llu records, rebuilt in %.3f s)\n", static_cast<unsigned long long>(state.position),
+                static_cast<unsigned long long>(state.records), seconds_since(start));
+    std::printf("users:            %llu\n", static_cast<unsigned long long>(state.users.size()));
+    std::printf("groups:           %llu\n", static_cast<unsigned long long>(state.group_names.size()));
+    std::printf("live messages:    %llu\n", static_cast<unsigned long long>(state.messages.size()));
+    std::printf("deleted messages: %llu\n", static_cast<unsigned long long>(state.deleted));
+    std::printf("next id:          %d (leased up to %u)\n", state.next_id, state.id_lease_limit);
+
+    if (options.id != -1) {
+        const PointInTime::Message *message = PointInTime::find_message(state, options.id);
+        if (!message) {
+            std::printf("message %lld does not exist at this point\n", static_cast<long long>(options.id));
+            return 1;
+        }
+
+        print_message(*message);
+    }
+
+    if (!options.user.empty()) {
+        if (state.users.index_of(options.user) == -1) {
+            std::printf("user \"%s\" does not exist at this point\n", options.user.c_str());
+            return 1;
+        }
+
+        const Util::IchigoVector<const PointInTime::Message *> messages = PointInTime::messages_of(state, options.user, options.with);
+        std::printf("%llu messages\n", static_cast<unsigned long long>(messages.size()));
+        for (u64 i = 0; i < messages.size() && i < options.limit; ++i)
+            print_message(*messages.at(i));
+    }
+
+    return 0;
+}
+
+static i32 run_compact(const Options &options) {
+    // The first pass finds out which messages are deleted by the end of the journal.
+    ReplayState state;
+    if (!read_journal(options, [&](u64, const Journal::Transaction *transaction) { apply(state, transaction); })) {
+        ICHIGO_ERROR("Not compacting a journal that cannot be read in full");
+        return 1;
+    }
+
+    const std::unordered_set<i32> live_messages = std::move(state.live_messages);
+    const u32 id_lease_limit = static_cast<u32>(state.highest_id) > state.id_lease_limit ? state.highest_id : state.id_lease_limit;
+
+    std::FILE *output = Journal::create_journal_file(options.output);
+    if (!output) {
+        ICHIGO_ERROR("Failed to create %s (it must not exist)", options.output.c_str());
+        return 1;
+    }
+
+    // The second pass writes everything that is still live. Message IDs are always written out, so ID leases are not needed to resolve them.
+    u64 records_in  = 0;
+    u64 records_out = 0;
+    std::string record;
+    auto write = [&](const Journal::Transaction *transaction) {
+        record.clear();
+        Journal::encode_record(transaction, record);
+        std::fwrite(record.data(), 1, record.size(), output);
+        ++records_out;
+    };
+
+    // One lease covering every ID ever handed out comes first, so none of them are handed out again.
+    const Journal::UpdateIdTransaction lease(id_lease_limit);
+    write(&lease);
+
+    state = {};
+    bool ok = read_journal(options, [&](u64, const Journal::Transaction *transaction) {
+        ++records_in;
+
+        switch (transaction->operation()) {
+            case Journal::Operation::NEW_USER:
+            case Journal::Operation::NEW_GROUP: {
+                write(transaction);
+            } break;
+            case Journal::Operation::NEW_MESSAGE: {
+                const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+                i32 first_id;
+                u32 count = message_ids(state, new_message_transaction, &first_id);
+
+                u32 live = 0;
+                for (u32 i = 0; i < count; ++i)
+                    live += live_messages.count(first_id + i);
+
+                if (live == count && count > 0) {
+                    const Journal::NewMessageTransaction rewritten(new_message_transaction->sender(), new_message_transaction->recipient(), new_message_transaction->recipient_type(),
+                                                                   new_message_transaction->content(), new_message_transaction->attachment_digest(),
+                                                                   new_message_transaction->attachment_name(), first_id);
+                    write(&rewritten);
+                } else if (live > 0) {
+                    // Some copies of a group message were deleted. The rest are written out one by one.
+                    const Util::IchigoVector<std::string> &members = state.groups[new_message_transaction->recipient()];
+                    for (u32 i = 0; i < count; ++i) {
+                        if (live_messages.count(first_id + i) == 0)
+                            continue;
+
+                        const Journal::RestoreMessageTransaction restored(first_id + i, new_message_transaction->sender(), members.at(i), new_message_transaction->content(),
+                                                                          new_message_transaction->attachment_digest(), new_message_transaction->attachment_name());
+                        write(&restored);
+                    }
+                }
+            } break;
+            case Journal::Operation::RESTORE_MESSAGE: {
+                if (live_messages.count(static_cast<const Journal::RestoreMessageTransaction *>(transaction)->id()) > 0)
+                    write(transaction);
+            } break;
+            case Journal::Operation::DELETE_MESSAGE:
+            case Journal::Operation::UPDATE_ID: {
+            } break;
+        }
+
+        apply(state, transaction);
+    });
+
+    ok = std::fflush(output) == 0 && ok;
+    std::fclose(output);
+    if (!ok) {
+        ICHIGO_ERROR("Failed to write %s", options.output.c_str());
+        std::remove(options.output.c_str());
+        return 1;
+    }
+
+    std::printf("%llu records in, %llu records out (%llu bytes)\n", static_cast<unsigned long long>(records_in), static_cast<unsigned long long>(records_out),
+                static_cast<unsigned long long>(ChatServer::platform_file_size(options.output)));
+    return 0;
+}
+
+static void print_usage() {
+    std::printf("usage: chatjournal stats|verify|dump|state <journal> [options]\n"
+                "       chatjournal compact <journal> <output> [options]\n"
+                "options: --snapshot PATH\n"
+                "  dump:  --op NAME, --user NAME, --id N, --limit N\n"
+                "  state: --position N, --before-id N, --id N, --user NAME, --with NAME, --limit N\n");
+}
+
+i32 main(i32 argc, char **argv) {
+    if (argc < 3) {
+        print_usage();
+        return 2;
+    }
+
+    const char *command = argv[1];
+    Options options;
+    options.journal = argv[2];
+
+    i32 i = 3;
+    if (std::strcmp(command, "compact") == 0) {
+        if (argc < 4) {
+            print_usage();
+            return 2;
+        }
+
+        options.output = argv[i++];
+    }
+
+    for (; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+
+        if (std::strcmp(argv[i], "--snapshot") == 0 && has_value) {
+            options.snapshot = argv[++i];
+        } else if (std::strcmp(argv[i], "--op") == 0 && has_value) {
+            const char *name = argv[++i];
+            for (u32 j = 0; j < OPERATION_COUNT; ++j) {
+                if (std::strcmp(name, OPERATION_NAMES[j]) == 0)
+                    options.operation = j;
+            }
+
+            if (options.operation == -1) {
+                ICHIGO_ERROR("Unknown operation: %s", name);
+                return 2;
+            }
+        } else if (std::strcmp(argv[i], "--user") == 0 && has_value) {
+            options.user = argv[++i];
+        } else if (std::strcmp(argv[i], "--id") == 0 && has_value) {
+            options.id = std::strtoll(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--with") == 0 && has_value) {
+            options.with = argv[++i];
+        } else if (std::strcmp(argv[i], "--limit") == 0 && has_value) {
+            options.limit = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--position") == 0 && has_value) {
+            options.bound.end_position = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--before-id") == 0 && has_value) {
+            options.bound.before_id = std::strtoll(argv[++i], nullptr, 10);
+        } else {
+            ICHIGO_ERROR("Unknown option: %s", argv[i]);
+            return 2;
+        }
+    }
+
+    if (std::strcmp(command, "stats") == 0)
+        return run_stats(options);
+    if (std::strcmp(command, "verify") == 0)
+        return run_verify(options);
+    if (std::strcmp(command, "dump") == 0)
+        return run_dump(options);
+    if (std::strcmp(command, "state") == 0)
+        return run_state(options);
+    if (std::strcmp(command, "compact") == 0)
+        return run_compact(options);
+
+    print_usage();
+    return 2;
+}
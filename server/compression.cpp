@@ -0,0 +1,275 @@
+/*
+    Block compression module implementation. See header (compression.hpp) for the block format and public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "compression.hpp"
+#include <algorithm>
+#include <queue>
+
+// The shortest match worth encoding. Anything shorter is cheaper as literals.
+#define MIN_MATCH 4
+// Offsets are encoded in 16 bits.
+#define MAX_OFFSET 65535
+// The part of the dictionary (its end) that matches may refer into, leaving room in the window for the block itself.
+#define DICTIONARY_WINDOW (32 * 1024)
+#define HASH_BITS 15
+// Dictionary training counts substrings of this length, over pieces of the samples of this size.
+#define TRAINING_SUBSTRING_SIZE 8
+#define TRAINING_PIECE_SIZE 64
+#define TRAINING_HASH_BITS 20
+
+static inline u32 read_u32(const char *data) {
+    u32 value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline u32 hash_u32(u32 value, u32 bits) {
+    return (value * 2654435761u) >> (32 - bits);
+}
+
+static inline u32 hash_substring(const char *data) {
+    u64 value;
+    std::memcpy(&value, data, sizeof(value));
+    return (value * 0x9E3779B97F4A7C15ull) >> (64 - TRAINING_HASH_BITS);
+}
+
+/*
+    Append the bytes that continue a literal count or match length past the 15 that fit in the token.
+*/
+static void put_length(std::string &out, u32 length) {
+    for (length -= 15; length >= 255; length -= 255)
+        out.push_back(static_cast<char>(255));
+
+    out.push_back(static_cast<char>(length));
+}
+
+/*
+    Append a sequence to a compressed block.
+    Parameter 'literals', 'literal_count': The bytes to store as is before the match.
+    Parameter 'offset', 'match_length': The match. A match length of 0 ends the block: only the literals are written.
+*/
+static void put_sequence(std::string &out, const char *literals, u32 literal_count, u32 offset, u32 match_length) {
+    const u32 match_code = match_length > 0 ? match_length - MIN_MATCH : 0;
+    out.push_back(static_cast<char>((std::min(literal_count, 15u) << 4) | std::min(match_code, 15u)));
+    if (literal_count >= 15)
+        put_length(out, literal_count);
+
+    out.append(literals, literal_count);
+    if (match_length == 0)
+        return;
+
+    out.push_back(static_cast<char>(offset & 0xFF));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (match_code >= 15)
+        put_length(out, match_code);
+}
+
+/*
+    Read the bytes that continue a literal count or match length.
+    Returns whether or not the input held all of them (and the length is sane).
+*/
+static bool read_length(const u8 *data, u32 size, u32 *position, u32 *length) {
+    for (;;) {
+        if (*position >= size || *length > 0x7FFFFFFF)
+            return false;
+
+        const u8 byte = data[(*position)++];
+        *length += byte;
+        if (byte != 255)
+            return true;
+    }
+}
+
+u64 Compression::compress_bound(u64 size) {
+    return size + size / 255 + 16;
+}
+
+void Compression::compress(std::string_view dictionary, const char *data, u32 size, std::string &out) {
+    // The block is compressed as if it came right after the dictionary, so that matches are found in both the same way.
+    const u32 dictionary_size = std::min<u64>(dictionary.size(), DICTIONARY_WINDOW);
+    std::string window;
+    window.reserve(dictionary_size + size);
+    window.append(dictionary.data() + dictionary.size() - dictionary_size, dictionary_size);
+    window.append(data, size);
+
+    const char *base = window.data();
+    const u32 end    = window.size();
+    u32 *table       = new u32[1 << HASH_BITS];
+    std::memset(table, 0xFF, sizeof(u32) << HASH_BITS);
+    for (u32 i = 0; i + MIN_MATCH <= dictionary_size; ++i)
+        table[hash_u32(read_u32(base + i), HASH_BITS)] = i;
+
+    u32 position      = dictionary_size;
+    u32 literal_start = dictionary_size;
+    while (position + MIN_MATCH <= end) {
+        const u32 value     = read_u32(base + position);
+        const u32 slot      = hash_u32(value, HASH_BITS);
+        const u32 candidate = table[slot];
+        table[slot] = position;
+
+        if (candidate == 0xFFFFFFFF || position - candidate > MAX_OFFSET || read_u32(base + candidate) != value) {
+            ++position;
+            continue;
+        }
+
+        u32 length = MIN_MATCH;
+        while (position + length < end && base[candidate + length] == base[position + length])
+            ++length;
+
+        put_sequence(out, base + literal_start, position - literal_start, position - candidate, length);
+        position     += length;
+        literal_start = position;
+
+        // Repeated records tend to continue matching right after a match ends.
+        if (position + MIN_MATCH <= end && position >= 2)
+            table[hash_u32(read_u32(base + position - 2), HASH_BITS)] = position - 2;
+    }
+
+    put_sequence(out, base + literal_start, end - literal_start, 0, 0);
+    delete[] table;
+}
+
+bool Compression::decompress(std::string_view dictionary, const char *data, u32 size, char *out, u32 out_size) {
+    const u32 dictionary_size  = std::min<u64>(dictionary.size(), DICTIONARY_WINDOW);
+    const char *dictionary_end = dictionary.data() + dictionary.size();
+    const u8 *input            = reinterpret_cast<const u8 *>(data);
+    u32 in_position            = 0;
+    u32 out_position           = 0;
+
+    for (;;) {
+        if (in_position >= size)
+            return false;
+
+        const u8 token    = input[in_position++];
+        u32 literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(input, size, &in_position, &literal_count))
+            return false;
+
+        if (size - in_position < literal_count || out_size - out_position < literal_count)
+            return false;
+
+        std::memcpy(out + out_position, data + in_position, literal_count);
+        in_position  += literal_count;
+        out_position += literal_count;
+        if (in_position == size)
+            return out_position == out_size;
+
+        if (size - in_position < 2)
+            return false;
+
+        const u32 offset = input[in_position] | (input[in_position + 1] << 8);
+        in_position     += 2;
+        u32 match_length = token & 0xF;
+        if (match_length == 15 && !read_length(input, size, &in_position, &match_length))
+            return false;
+
+        match_length += MIN_MATCH;
+        if (offset == 0 || offset > out_position + dictionary_size || out_size - out_position < match_length)
+            return false;
+
+        // The start of the match may be in the dictionary, and the rest of it in the block.
+        if (offset > out_position) {
+            const u32 from_dictionary = std::min(offset - out_position, match_length);
+            std::memcpy(out + out_position, dictionary_end - (offset - out_position), from_dictionary);
+            out_position += from_dictionary;
+            match_length -= from_dictionary;
+        }
+
+        // A match can overlap the bytes it produces (eg. a run), in which case it has to be copied forward a byte at a time.
+        if (offset >= match_length) {
+            std::memcpy(out + out_position, out + out_position - offset, match_length);
+            out_position += match_length;
+        } else {
+            for (; match_length > 0; --match_length, ++out_position)
+                out[out_position] = out[out_position - offset];
+        }
+    }
+}
+
+/*
+    A piece of a sample that could go in the dictionary, and its score: the sum of the counts of its substrings.
+*/
+struct Piece {
+    const char *data;
+    u32 length;
+    u64 score;
+
+    bool operator<(const Piece &other) const { return score < other.score; }
+};
+
+/*
+    Score a piece of a sample against the current substring counts.
+*/
+static u64 score_piece(const u32 *counts, const char *data, u32 length) {
+    u64 score = 0;
+    for (u32 i = 0; i + TRAINING_SUBSTRING_SIZE <= length; ++i)
+        score += counts[hash_substring(data + i)];
+
+    return score;
+}
+
+std::string Compression::train_dictionary(const Util::IchigoVector<std::string_view> &samples, u32 max_size) {
+    u64 total_size = 0;
+    for (u32 i = 0; i < samples.size(); ++i)
+        total_size += samples.at(i).size();
+
+    if (total_size < static_cast<u64>(TRAINING_PIECE_SIZE) * 16)
+        return {};
+
+    // Count how often every substring occurs across the samples. The counts are approximate (substrings are hashed).
+    u32 *counts = new u32[1 << TRAINING_HASH_BITS]();
+    for (u32 i = 0; i < samples.size(); ++i) {
+        const std::string_view sample = samples.at(i);
+        for (u64 j = 0; j + TRAINING_SUBSTRING_SIZE <= sample.size(); ++j)
+            ++counts[hash_substring(sample.data() + j)];
+    }
+
+    std::priority_queue<Piece> candidates;
+    for (u32 i = 0; i < samples.size(); ++i) {
+        const std::string_view sample = samples.at(i);
+        for (u64 j = 0; j + TRAINING_SUBSTRING_SIZE <= sample.size(); j += TRAINING_PIECE_SIZE) {
+            const u32 length = std::min<u64>(TRAINING_PIECE_SIZE, sample.size() - j);
+            candidates.push({ sample.data() + j, length, score_piece(counts, sample.data() + j, length) });
+        }
+    }
+
+    // Greedily take the best piece, then stop counting its substrings so that the rest of the dictionary covers something else.
+    // Scores only go down as pieces are taken, so a piece whose score is still the best once it is rescored is the best piece.
+    Util::IchigoVector<Piece> chosen;
+    u64 dictionary_size = 0;
+    while (!candidates.empty() && dictionary_size < max_size) {
+        Piece piece = candidates.top();
+        candidates.pop();
+        piece.score = score_piece(counts, piece.data, piece.length);
+
+        if (!candidates.empty() && piece.score < candidates.top().score) {
+            candidates.push(piece);
+            continue;
+        }
+
+        // A piece whose substrings mostly occur once is not worth its space.
+        if (piece.score < 2ull * (piece.length - TRAINING_SUBSTRING_SIZE + 1))
+            break;
+
+        for (u32 i = 0; i + TRAINING_SUBSTRING_SIZE <= piece.length; ++i)
+            counts[hash_substring(piece.data + i)] = 0;
+
+        piece.length = std::min<u64>(piece.length, max_size - dictionary_size);
+        dictionary_size += piece.length;
+        chosen.append(piece);
+    }
+
+    delete[] counts;
+
+    // The best pieces go last, where they are closest to the data being compressed.
+    std::string ret;
+    ret.reserve(dictionary_size);
+    for (u64 i = chosen.size(); i > 0; --i)
+        ret.append(chosen.at(i - 1).data, chosen.at(i - 1).length);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+/*
+    Block compression for sealed journal segments. A small LZ77 compressor (in the spirit of LZ4: byte aligned sequences of
+    literals and back references, no entropy coding) that can refer back into a preset dictionary, so that the short,
+    repetitive records of a journal compress well even when they are split into independently decodable blocks.
+
+    Compressed block format: a sequence of
+        token (u8)        - Literal count in the high 4 bits, match length minus 4 in the low 4 bits. 15 means that the
+                            count continues in the following bytes, each added to it, until a byte that is not 255.
+        literals          - 'literal count' raw bytes.
+        offset (u16)      - How far back the match starts, counting the dictionary as if it came right before the block.
+    followed by the extra match length bytes, if any. The last sequence of a block only has literals (it has no offset).
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+#include "../common.hpp"
+#include "../util.hpp"
+#include <string>
+#include <string_view>
+
+namespace Compression {
+    /*
+        Get the largest size that compressing a buffer can produce.
+        Parameter 'size': The size of the buffer in bytes.
+    */
+    u64 compress_bound(u64 size);
+
+    /*
+        Compress a buffer as one block.
+        Parameter 'dictionary': The dictionary that matches may refer back into (at most 32KB of it is used). May be empty.
+        Parameter 'data': The data to compress.
+        Parameter 'size': The size of said data in bytes.
+        Parameter 'out': The buffer to append the compressed block to.
+    */
+    void compress(std::string_view dictionary, const char *data, u32 size, std::string &out);
+
+    /*
+        Decompress a block. Never reads or writes out of bounds, whatever the input.
+        Parameter 'dictionary': The dictionary the block was compressed with.
+        Parameter 'data': The compressed block.
+        Parameter 'size': The size of the compressed block in bytes.
+        Parameter 'out': The buffer to decompress into.
+        Parameter 'out_size': The size of the data before it was compressed. 'out' must have room for this many bytes.
+        Returns whether or not the block is well formed and decompresses to exactly 'out_size' bytes.
+    */
+    bool decompress(std::string_view dictionary, const char *data, u32 size, char *out, u32 out_size);
+
+    /*
+        Train a dictionary for data similar to a set of samples. The dictionary is made of the pieces of the samples whose
+        substrings are the most common across all of them, each substring only counted once, with the most useful pieces last.
+        Parameter 'samples': The samples (eg. journal records).
+        Parameter 'max_size': The maximum size of the dictionary in bytes.
+        Returns the dictionary. Empty if the samples are too small to be worth it.
+    */
+    std::string train_dictionary(const Util::IchigoVector<std::string_view> &samples, u32 max_size);
+}
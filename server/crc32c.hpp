@@ -0,0 +1,61 @@
+/*
+    CRC32C (Castagnoli) checksum. Used to detect corrupt or torn records in the journal.
+    Table driven, processing 8 bytes per step (slicing-by-8).
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+#include "../common.hpp"
+
+namespace Util {
+
+namespace Detail {
+struct Crc32cTable {
+    u32 entries[8][256];
+
+    constexpr Crc32cTable() : entries() {
+        for (u32 i = 0; i < 256; ++i) {
+            u32 crc = i;
+            for (u32 j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+
+            entries[0][i] = crc;
+        }
+
+        for (u32 i = 0; i < 256; ++i) {
+            for (u32 j = 1; j < 8; ++j)
+                entries[j][i] = (entries[j - 1][i] >> 8) ^ entries[0][entries[j - 1][i] & 0xFF];
+        }
+    }
+};
+
+inline constexpr Crc32cTable CRC32C_TABLE{};
+}
+
+/*
+    Compute (or continue computing) the CRC32C of a buffer.
+    Parameter 'data': The data to checksum.
+    Parameter 'length': The length of said data in bytes.
+    Parameter 'crc': The CRC of the data preceding this buffer, if this is a continuation (default 0).
+    Returns the CRC32C of all data checksummed so far.
+*/
+inline u32 crc32c(const void *data, u64 length, u32 crc = 0) {
+    const u8 *bytes = reinterpret_cast<const u8 *>(data);
+    const auto &table = Detail::CRC32C_TABLE.entries;
+    crc = ~crc;
+
+    for (; length >= 8; length -= 8, bytes += 8) {
+        u32 low  = (u32(bytes[0]) | (u32(bytes[1]) << 8) | (u32(bytes[2]) << 16) | (u32(bytes[3]) << 24)) ^ crc;
+        u32 high =  u32(bytes[4]) | (u32(bytes[5]) << 8) | (u32(bytes[6]) << 16) | (u32(bytes[7]) << 24);
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    }
+
+    for (; length > 0; --length, ++bytes)
+        crc = (crc >> 8) ^ table[0][(crc ^ *bytes) & 0xFF];
+
+    return ~crc;
+}
+}
@@ -1,272 +1,2583 @@
 /*
     Server chat journal module implementation. See header (journal.hpp) for public function documentation.
 
+    File format (all integers are little endian):
+    The file begins with a header: the magic bytes "CHATJRNL" followed by the format version (u32), a reserved u32,
+    and (since version 2) the start position (u64). Positions count record bytes from the very first record ever
+    written to the journal, so they stay valid when the front of the journal is compacted away. The start position
+    is the position of the first record in the file. Version 1 files have no start position (it is 0).
+    The header is followed by records. Each record has a fixed header:
+        operation (u32) - The Journal::Operation of the record.
+        length (u32)    - The length of the payload in bytes.
+        checksum (u32)  - The CRC32C of the operation, length, and payload.
+    followed by 'length' bytes of payload. Payload strings are encoded as their length (u32) followed by their raw bytes,
+    so they may contain any character.
+
+    Payloads:
+        NEW_USER:       username
+        NEW_MESSAGE:    sender, recipient_type (u32), recipient, content, attachment digest, attachment name, id (u32, absent in
+                        records written before ids were leased in blocks)
+        DELETE_MESSAGE: message id (u32)
+        UPDATE_ID:      next id (u32)
+        NEW_GROUP:      group name, user count (u32), usernames...
+        RESTORE_MESSAGE: message id (u32), sender, recipient, content, attachment digest, attachment name
+
+    The journal is split into numbered segment files ("<journal>.000001", "<journal>.000002", ...) of about the same
+    size. Each segment is a file in the format above; its start position is where the previous segment ended.
+    The manifest ("<journal>.manifest") lists the live segments, oldest first. It starts with a file header with the
+    magic "CHATMNFT" (start position unused), followed by the segment count (u32), the segment numbers (u32 each),
+    and the CRC32C of everything before it. It is always replaced as a whole.
+
+    Once the journal has moved on from a segment, the segment is sealed: it is compressed in the background and the compressed
+    file replaces it (under the same name, so the manifest does not change). A compressed segment starts with a file header with
+    the magic "CHATJRNZ", followed by the number of record bytes in the segment (u64), the size of the dictionary (u32), the
+    CRC32C of the dictionary (u32), and the dictionary, trained on the records of the segment. Then come blocks, each holding
+    whole records: the number of record bytes in the block (u32), the size of the compressed block (u32), and the block compressed
+    with the dictionary (see compression.hpp). Blocks decompress independently, so replay streams through a compressed segment
+    a block at a time (and decodes blocks in parallel). The segment being appended to is never compressed.
+
+    Records are committed into a ring buffer on the server thread and written out by a dedicated writer thread, which also
+    rotates and compacts segments. The ring has a single producer and a single consumer and is lock-free: each side only
+    moves its own end, and the writer thread sleeps on an atomic counter until it is woken. Completed batches are reported
+    back through a second, smaller ring the same way.
+
+    Snapshots are written as snapshot images (see snapshot_image.hpp), which replay reads in place. Snapshots written before
+    that use the same format as the journal with the magic "CHATSNAP", and are still read. The start position of a snapshot is
+    the position in the journal that it was taken at: replay reads the snapshot, then the journal from that position.
+    Snapshots are written to a temporary file and moved into place, so a snapshot file is always complete.
+
+    A backup is a journal (and snapshot) of its own, in the same format: a copy of the latest snapshot and of the live segments, cut at
+    the position the backup was taken at. The files are copied by a backup thread while the server keeps running. Segments are
+    neither compacted nor compressed while it copies them, and no snapshot is taken, so the files it copies stay put.
+
     Author: Braeden Hong
-      Date: November 11, 2023 - November 12, 2023
+      Date: November 11, 2023 - October 17, 2026
 */
 
 #include "journal.hpp"
+#include "legacy_journal.hpp"
+#include "crc32c.hpp"
+#include "compression.hpp"
+#include "snapshot_image.hpp"
 #include "../util.hpp"
-#include <optional>
+#include <algorithm>
+#include <cstddef>
+#include <chrono>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <deque>
+#include <memory>
+
+#define JOURNAL_MAGIC "CHATJRNL"
+#define SNAPSHOT_MAGIC "CHATSNAP"
+#define MANIFEST_MAGIC "CHATMNFT"
+#define COMPRESSED_SEGMENT_MAGIC "CHATJRNZ"
+#define JOURNAL_VERSION 2
+// Sanity limit on the payload of a single record. Anything larger is treated as corruption.
+#define JOURNAL_MAX_RECORD_LENGTH (16 * 1024 * 1024)
+// Once this much of a batch is waiting in the ring, the writer thread is woken to write it early instead of at the next flush.
+#define JOURNAL_MAX_BATCH_SIZE (4 * 1024 * 1024)
+// The size of the ring that committed records wait in until the writer thread writes them. A power of two that fits the largest record.
+#define JOURNAL_RING_SIZE (32 * 1024 * 1024)
+// The number of completed batches that can wait to be picked up by the server thread.
+#define JOURNAL_COMPLETED_BATCH_COUNT 64
+// Replay splits the journal into chunks of about this size (at record boundaries) that are decoded in parallel.
+#define JOURNAL_REPLAY_CHUNK_SIZE (1024 * 1024)
+// The default size at which the journal moves on to a new segment.
+#define JOURNAL_DEFAULT_SEGMENT_SIZE (64ull * 1024 * 1024)
+// Sealed segments are compressed in blocks of about this many record bytes (at record boundaries).
+#define JOURNAL_COMPRESSED_BLOCK_SIZE (256 * 1024)
+// The maximum size of the dictionary of a compressed segment, and how many bytes of records (spread over the segment) it is trained on.
+#define JOURNAL_DICTIONARY_SIZE (32 * 1024)
+#define JOURNAL_DICTIONARY_SAMPLE_SIZE (1024 * 1024)
+// Records read from the snapshot have no journal position (replay reports the snapshot position for them).
+#define NO_JOURNAL_POSITION UINT64_MAX
+
+struct FileHeader {
+    char magic[8];
+    u32 version;
+    u32 reserved;
+    u64 start_position;
+};
+
+struct RecordHeader {
+    u32 operation;
+    u32 length;
+    u32 checksum;
+};
+
+struct CompressedSegmentHeader {
+    u64 record_size;
+    u32 dictionary_size;
+    u32 dictionary_checksum;
+};
+
+struct BlockHeader {
+    u32 record_size;
+    u32 compressed_size;
+};
+
+static_assert(sizeof(FileHeader) == 24 && sizeof(RecordHeader) == 12 && sizeof(CompressedSegmentHeader) == 16 && sizeof(BlockHeader) == 8);
+static_assert((JOURNAL_RING_SIZE & (JOURNAL_RING_SIZE - 1)) == 0 && JOURNAL_RING_SIZE >= JOURNAL_MAX_RECORD_LENGTH + sizeof(RecordHeader));
+// Version 1 headers end before the start position.
+#define JOURNAL_V1_HEADER_SIZE offsetof(FileHeader, start_position)
+
+/*
+    A journal or snapshot file mapped into memory for replay, and how far into it replay has read.
+    For a compressed segment, 'position' is at a block boundary, and 'skip' is the number of record bytes at the start of the
+    next block that replay does not need (when replay starts partway into the segment).
+    'base_position' is the journal position of the byte at offset 0, so a record that ends at 'position' ends at journal position
+    'base_position + position' (unsigned arithmetic wraps around for the header of the first segment). For a compressed segment,
+    it is the journal position of the first record of the next block instead.
+*/
+struct MappedFile {
+    const char *data  = nullptr;
+    u64 size          = 0;
+    u64 position      = 0;
+    u64 base_position = 0;
+    bool compressed   = false;
+    std::string_view dictionary;
+    u64 skip          = 0;
+};
+
+/*
+    Make a view of records in memory (eg. a decompressed block), to be read the same way as a mapped file.
+*/
+static MappedFile records_view(const char *data, u64 size, u64 position, u64 base_position) {
+    MappedFile ret;
+    ret.data          = data;
+    ret.size          = size;
+    ret.position      = position;
+    ret.base_position = base_position;
+    return ret;
+}
+
+/*
+    A block of a compressed segment, still compressed, and the journal position of its first record.
+*/
+struct CompressedBlock {
+    const char *data;
+    u32 compressed_size;
+    u32 record_size;
+    u64 start_position;
+};
+
+/*
+    The records decoded from one chunk of a mapped file during replay.
+    If a record in the chunk could not be decoded, 'failed' is set, 'failed_record' points to the start of it,
+    and 'records' holds the records before it. 'record_lengths' holds the length of every record decoded, so that
+    replay can keep track of the journal position from the position of the first record ('start_position').
+    The records are views into the mapped file, or into 'buffer' for a decompressed block.
+*/
+struct DecodedChunk {
+    Util::IchigoVector<Journal::Record> records;
+    Util::IchigoVector<u32> record_lengths;
+    std::unique_ptr<char[]> buffer;
+    u64 start_position        = NO_JOURNAL_POSITION;
+    bool failed               = false;
+    const char *failed_record = nullptr;
+};
+
+/*
+    A live journal segment: its number (which names the file) and the journal position of its first record.
+*/
+struct Segment {
+    u32 number;
+    u64 start_position;
+};
+
+/*
+    Where a backup is at. See 'backup_state'.
+*/
+enum class BackupState : u32 {
+    IDLE,
+    REQUESTED,
+    COPYING,
+    COPIED,
+    DONE,
+};
 
-// The journal file that is in use
+// Called with every record committed, if set. See 'Journal::set_commit_observer()'.
+static void (*commit_observer)(const char *record, u64 length) = nullptr;
+// The journal segment that is being appended to
 static std::FILE *journal_file   = nullptr;
-// The size of said file
-static i32 journal_file_size     = 0;
+// The size of said segment, including its header and everything written to it so far
+static u64 segment_size          = 0;
+// The size of the header of said segment (it depends on the version of the file).
+static u32 segment_header_size   = 0;
+// The size at which the journal moves on to a new segment.
+static u64 segment_size_limit    = JOURNAL_DEFAULT_SEGMENT_SIZE;
+// All live segments, oldest first. The last one is being appended to.
+static Util::IchigoVector<Segment> segments;
+// The next segment, created and preallocated in the background ahead of time so that rotating is just switching files.
+static std::FILE *spare_segment_file = nullptr;
+static std::thread spare_segment_thread;
+// Whether or not sealed segments are compressed. The seal thread compresses them in the background. It is only started and joined
+// by the writer thread (and by 'Journal::deinit()' after the writer thread has stopped). Setting 'seal_stop' makes it give up early.
+static bool segment_compression  = true;
+static std::thread seal_thread;
+static std::atomic<bool> seal_stop{false};
+// Set by the server thread once replay is over, for the writer thread to seal the segments that were left uncompressed.
+static std::atomic<bool> seal_request{false};
 // If this is set, no transactions can be read back from the file or committed to the file
 static bool invalid_file         = false;
-
-#define INVALID_U32 static_cast<u32>(~0)
+// Set when the journal was opened with 'Journal::open_read_only()'. Nothing is written to disk.
+static bool read_only            = false;
+// The number of bytes of torn tail found by replay
+static u64 torn_tail_bytes       = 0;
+// The journal segments mapped for replay (the ones before the snapshot are not mapped). Unmapped once replay is done.
+static Util::IchigoVector<MappedFile> replay_segments;
+static u32 replay_segment_index  = 0;
+// When records are decoded one at a time, the decompressed block of a compressed segment they are read from.
+static MappedFile replay_block;
+static std::string replay_block_buffer;
+// Set once replay is over.
+static bool replay_finished      = false;
+// Reusable buffer for encoding the record being committed, and for converting journals.
+static std::string record_buffer;
+// Set if records have been written since the journal was last synced to stable storage.
+static bool unsynced             = false;
+// Set once a batch could not be written in full. The segment then ends in a partial record, so nothing more is written after it.
+static bool write_failed         = false;
+// How (and if) committed transactions are made durable. See 'Journal::Durability'.
+static std::atomic<Journal::Durability> durability_mode{Journal::Durability::SYNC};
+// The maximum time between syncs in Durability::INTERVAL mode.
+static std::atomic<u32> sync_interval_ms{100};
+// Committed records are copied into this ring on the server thread and written to the journal by the writer thread, so the
+// server thread never waits on the disk. Ring offsets are journal positions modulo the ring size.
+static char *ring                = nullptr;
+// The journal position just past the last record committed (only the server thread moves it), and just past the last
+// record the writer thread has written to the journal (only the writer thread moves it). Everything in between is in the ring.
+static std::atomic<u64> ring_head{0};
+static std::atomic<u64> ring_tail{0};
+// Requests from the server thread: the end of the latest batch handed over with 'flush()', the position up to which a snapshot
+// needs the journal synced whatever the durability mode, and the position up to which segments can be compacted away.
+static std::atomic<u64> flush_request{0};
+static std::atomic<u64> sync_request{0};
+static std::atomic<u64> compact_request{0};
+// The journal position that the writer thread starts a new segment at (that of the latest snapshot), so that the segment the snapshot
+// was taken in can be deleted along with every older one once the snapshot is durable.
+static std::atomic<u64> rotate_request{0};
+// The position up to which the journal has been synced, and whether a sync (or a write) has ever failed. 'sync_attempts' is bumped
+// (and notified) after every sync so that the snapshot thread can wait on both.
+static std::atomic<u64> synced_position{0};
+static std::atomic<bool> sync_failed{false};
+static std::atomic<u32> sync_attempts{0};
+// Bumped (and notified) whenever the writer thread has something new to do.
+static std::atomic<u32> writer_signal{0};
+static std::atomic<bool> writer_stop{false};
+static std::thread writer_thread;
+// The head of the ring when the writer thread was last woken, so that a large batch only wakes it every JOURNAL_MAX_BATCH_SIZE bytes.
+static u64 writer_woken_position = 0;
+// Batches the writer thread is done with, waiting to be picked up by 'Journal::next_completed_batch()'. The writer thread
+// holds on to a batch (merging later ones into it) while there is no room.
+static Journal::CompletedBatch completed_batches[JOURNAL_COMPLETED_BATCH_COUNT];
+static std::atomic<u64> completed_head{0};
+static std::atomic<u64> completed_tail{0};
+static Journal::CompletedBatch unreported_batch;
+static bool has_unreported_batch = false;
+// The last time the journal was synced to stable storage.
+static std::chrono::steady_clock::time_point last_sync_time;
+// Large stdio buffer for the journal file so that appending does not pay for a syscall per record.
+static char file_buffer[1024 * 1024];
+// The base path of the journal (segments and manifest are named after it), and the path of the snapshot.
+static std::string journal_path;
+static std::string snapshot_path;
+// The snapshot mapped for replay. Unmapped once all of its transactions have been read. If it is a snapshot image, its records
+// are read through 'replay_image' instead (and the mapped file is left as if it was all read).
+static MappedFile replay_snapshot;
+static SnapshotImage::Reader replay_image;
+// Chunks being decoded on worker threads, in file order (snapshot first, then the journal segments).
+static std::deque<std::future<DecodedChunk>> replay_chunks;
+// The chunk whose records are being handed out by 'next_record()', and the index of the next one.
+static DecodedChunk replay_chunk;
+static u32 replay_chunk_index    = 0;
+// When records are decoded one at a time, the record decoded by 'has_more_transactions()' for 'next_record()' to hand out.
+static Journal::Record replay_record;
+static bool has_replay_record    = false;
+static u64 replay_record_position = 0;
+// The journal position just past the last record handed out by 'next_record()'. See 'Journal::replay_position()'.
+static u64 replayed_position     = 0;
+// The journal segments as they were before replay started decoding them, for 'Journal::read_ahead()'.
+static Util::IchigoVector<MappedFile> read_ahead_segments;
+// The maximum number of chunks decoded at once. With a single core, records are decoded one at a time on the server thread instead.
+static u32 replay_thread_count   = 1;
+// The journal position covered by the latest durable snapshot. Everything before it can be compacted away.
+static u64 snapshot_durable_position = 0;
+// The journal position that the latest snapshot was attempted at. Used to decide when to take the next one.
+static u64 snapshot_attempt_position = 0;
+// The snapshot being built from the state, and the image written from it in the background. Not touched by the main thread while
+// the snapshot thread runs.
+static SnapshotImage::Builder snapshot_builder;
+static std::string snapshot_buffer;
+static std::thread snapshot_thread;
+static std::atomic<bool> snapshot_done{false};
+// Set from 'begin_snapshot()' until 'finish_snapshot()', while the server adds the state to the snapshot.
+static bool snapshot_begun = false;
+static bool snapshot_succeeded   = false;
+// The backup being taken, if any (see 'Journal::begin_backup()'). Each state is only left by one thread: the server thread requests a
+// backup, the writer thread starts copying it once the journal is synced up to its position, the backup thread copies it, the writer
+// thread joins the backup thread, and the server thread picks up the result.
+static std::atomic<BackupState> backup_state{BackupState::IDLE};
+static u64 backup_position       = 0;
+static std::string backup_journal_path;
+static std::string backup_snapshot_path;
+static std::thread backup_thread;
+static bool backup_succeeded     = false;
 
 /*
-    Get the next non-whitespace character from the file.
-    Returns the next non-whitespace character of 'journal_file'.
+    Append an unsigned 32-bit integer to an encoding buffer.
 */
-static inline char next_non_whitespace() {
-    char c;
-    while (std::isspace(c = std::fgetc(journal_file)));
-    return c;
+static inline void put_u32(std::string &out, u32 value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
 }
 
 /*
-    Read an unsigned 32-bit integer from the current position in the journal file.
-    Returns an unsigned 32-bit integer parsed (base 10) from the current position in the file, or INVALID_U32 if no number could be parsed.
+    A cursor over the payload of a record that was read back from the journal.
+    If any read runs past the end of the payload, 'failed' is set and all further reads return empty values.
+    Strings are returned as views into the payload, so nothing is copied until the transaction is built.
 */
-static u32 read_u32() {
-    static char buffer[1024];
-    buffer[0] = next_non_whitespace();
+struct PayloadReader {
+    const char *data;
+    u32 length;
+    u32 position = 0;
+    bool failed  = false;
 
-    for (u32 i = 1; i < 1023; ++i) {
-        buffer[i] = std::fgetc(journal_file);
-        if (std::isspace(buffer[i]) || buffer[i] == EOF) {
-            buffer[i] = 0;
-            char *end;
-            u32 number = std::strtol(buffer, &end, 10);
-            if (buffer == end) {
-                ICHIGO_ERROR("Failed to parse u32 due to invalid number format");
-                return INVALID_U32;
-            }
+    u32 read_u32() {
+        if (failed || length - position < sizeof(u32)) {
+            failed = true;
+            return 0;
+        }
+
+        u32 value;
+        std::memcpy(&value, data + position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    }
 
-            return number;
+    std::string_view read_string() {
+        u32 string_length = read_u32();
+        if (failed || length - position < string_length) {
+            failed = true;
+            return {};
         }
+
+        std::string_view ret(data + position, string_length);
+        position += string_length;
+        return ret;
+    }
+};
+
+/*
+    Outputs that records are encoded to. Encoding is written once against their common interface ('put_u32()' and 'put_string()'):
+    'SizeOutput' only adds up the size of the payload, so that space for a record is reserved once and never grown;
+    'BufferOutput' appends to a buffer; 'RingOutput' writes straight into the commit ring.
+*/
+struct SizeOutput {
+    u64 size = 0;
+
+    void put_u32(u32) { size += sizeof(u32); }
+    void put_string(std::string_view string) { size += sizeof(u32) + string.length(); }
+};
+
+struct BufferOutput {
+    std::string &out;
+
+    void put_u32(u32 value) { ::put_u32(out, value); }
+    void put_string(std::string_view string) {
+        ::put_u32(out, string.length());
+        out.append(string);
     }
+};
 
-    ICHIGO_ERROR("Failed to parse u32");
-    return INVALID_U32;
+/*
+    Copy bytes into the commit ring, wrapping around its end.
+    Parameter 'position': The ring position (see 'ring_head') to copy to.
+*/
+static void ring_copy(u64 position, const void *data, u64 length) {
+    const u64 offset = position & (JOURNAL_RING_SIZE - 1);
+    const u64 first  = length < JOURNAL_RING_SIZE - offset ? length : JOURNAL_RING_SIZE - offset;
+    std::memcpy(ring + offset, data, first);
+    std::memcpy(ring, static_cast<const char *>(data) + first, length - first);
 }
 
 /*
-    Read a string surrounded by quotes from the current position in the journal file.
-    Returns an optional that contains either the string parsed (without the quotes) or no value if a string could not be parsed.
+    Writes encoded fields into space reserved in the commit ring. Strings are copied straight from the transaction.
 */
-static std::optional<std::string> read_quoted_string() {
-    static char buffer[1024];
+struct RingOutput {
+    u64 position;
 
-    if (next_non_whitespace() != '"') {
-        ICHIGO_ERROR("Expected \" to begin string");
-        return {};
+    void put_u32(u32 value) {
+        ring_copy(position, &value, sizeof(value));
+        position += sizeof(value);
     }
 
-    for (u32 i = 0; i < 1023; ++i) {
-        buffer[i] = std::fgetc(journal_file);
-        if (buffer[i] == '"') {
-            buffer[i] = 0;
-            return buffer;
-        }
+    void put_string(std::string_view string) {
+        put_u32(string.length());
+        ring_copy(position, string.data(), string.length());
+        position += string.length();
     }
+};
 
-    ICHIGO_ERROR("String too long");
-    return {};
+/*
+    Encode the payload of a transaction.
+    Parameter 'transaction': The transaction to encode.
+    Parameter 'out': The output to encode to.
+*/
+template <typename Output>
+static void encode_payload(const Journal::Transaction *transaction, Output &out) {
+    switch (transaction->operation()) {
+        case Journal::Operation::NEW_USER: {
+            const Journal::NewUserTransaction *new_user_transaction = static_cast<const Journal::NewUserTransaction *>(transaction);
+            out.put_string(new_user_transaction->username());
+        } break;
+        case Journal::Operation::NEW_MESSAGE: {
+            const Journal::NewMessageTransaction *new_message_transaction = static_cast<const Journal::NewMessageTransaction *>(transaction);
+            out.put_string(new_message_transaction->sender());
+            out.put_u32(new_message_transaction->recipient_type());
+            out.put_string(new_message_transaction->recipient());
+            out.put_string(new_message_transaction->content());
+            out.put_string(new_message_transaction->attachment_digest());
+            out.put_string(new_message_transaction->attachment_name());
+            if (new_message_transaction->id() != -1)
+                out.put_u32(new_message_transaction->id());
+        } break;
+        case Journal::Operation::DELETE_MESSAGE: {
+            const Journal::DeleteMessageTransaction *delete_message_transaction = static_cast<const Journal::DeleteMessageTransaction *>(transaction);
+            out.put_u32(delete_message_transaction->id());
+        } break;
+        case Journal::Operation::UPDATE_ID: {
+            const Journal::UpdateIdTransaction *update_id_transaction = static_cast<const Journal::UpdateIdTransaction *>(transaction);
+            out.put_u32(update_id_transaction->id());
+        } break;
+        case Journal::Operation::NEW_GROUP: {
+            const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+            out.put_string(new_group_transaction->name());
+            out.put_u32(new_group_transaction->user_count());
+
+            const auto &users = new_group_transaction->users();
+            for (u32 i = 0; i < users.size(); ++i)
+                out.put_string(users.at(i));
+        } break;
+        case Journal::Operation::RESTORE_MESSAGE: {
+            const Journal::RestoreMessageTransaction *restore_message_transaction = static_cast<const Journal::RestoreMessageTransaction *>(transaction);
+            out.put_u32(restore_message_transaction->id());
+            out.put_string(restore_message_transaction->sender());
+            out.put_string(restore_message_transaction->recipient());
+            out.put_string(restore_message_transaction->content());
+            out.put_string(restore_message_transaction->attachment_digest());
+            out.put_string(restore_message_transaction->attachment_name());
+        } break;
+    }
 }
 
-void Journal::init(const std::string &journal_filename) {
-    journal_file = ChatServer::platform_open_file(journal_filename, ChatServer::platform_file_exists(journal_filename.c_str()) ? "r+b" : "w+b");
-    std::fseek(journal_file, 0, SEEK_END);
-    journal_file_size = std::ftell(journal_file);
-    std::fseek(journal_file, 0, SEEK_SET);
-    ICHIGO_INFO("Journal file loaded: size is %u\n", journal_file_size);
+/*
+    Get the size of the payload of a transaction once encoded.
+*/
+static u64 payload_size(const Journal::Transaction *transaction) {
+    SizeOutput size;
+    encode_payload(transaction, size);
+    return size.size;
 }
 
-void Journal::deinit() {
-    std::fclose(journal_file);
+/*
+    Make the header of a record. The checksum only covers the header so far: it must be continued over the payload.
+*/
+static RecordHeader make_record_header(Journal::Operation operation, u32 payload_length) {
+    RecordHeader header;
+    header.operation = static_cast<u32>(operation);
+    header.length    = payload_length;
+    header.checksum  = Util::crc32c(&header, offsetof(RecordHeader, checksum));
+    return header;
 }
 
-void Journal::commit_transaction(const Transaction *transaction) {
-    static char buffer[1024];
+/*
+    Encode a transaction (header and payload) and append it to a buffer. The buffer grows at most once.
+    Parameter 'transaction': The transaction to encode.
+    Parameter 'out': The buffer to append the record to.
+*/
+static void encode_transaction(const Journal::Transaction *transaction, std::string &out) {
+    const u64 length       = payload_size(transaction);
+    const u64 record_start = out.length();
+    out.reserve(record_start + sizeof(RecordHeader) + length);
+    out.resize(record_start + sizeof(RecordHeader));
 
-    if (invalid_file) {
-        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
-        return;
-    }
+    BufferOutput buffer{out};
+    encode_payload(transaction, buffer);
 
-    assert(!Journal::has_more_transactions());
+    RecordHeader header = make_record_header(transaction->operation(), length);
+    header.checksum     = Util::crc32c(out.data() + record_start + sizeof(RecordHeader), length, header.checksum);
+    std::memcpy(out.data() + record_start, &header, sizeof(header));
+}
 
-    std::fputc('\n', journal_file);
-    switch (transaction->operation()) {
+/*
+    Parse the payload of a record. Nothing is copied: the strings of the record are views into the payload.
+    Parameter 'header': The header of the record.
+    Parameter 'payload': The payload of the record ('header.length' bytes).
+    Parameter 'record': Set to the record.
+    Returns whether or not the payload is well formed.
+*/
+static bool parse_record(const RecordHeader &header, const char *payload, Journal::Record *record) {
+    PayloadReader reader{payload, header.length};
+
+    switch (static_cast<Journal::Operation>(header.operation)) {
         case Journal::Operation::NEW_USER: {
-            const NewUserTransaction *new_user_transaction = static_cast<const NewUserTransaction *>(transaction);
-            std::snprintf(buffer, sizeof(buffer), "NEW_USER \"%s\"", new_user_transaction->username().c_str());
-            std::fwrite(buffer, sizeof(char), std::strlen(buffer), journal_file);
+            *record = Journal::NewUserRecord{ reader.read_string() };
         } break;
         case Journal::Operation::NEW_MESSAGE: {
-            // Format: NEW_MESSAGE "sender username" recipient_type "recipient name" "message content"
-            const NewMessageTransaction *new_message_transaction = static_cast<const NewMessageTransaction *>(transaction);
-            std::snprintf(
-                buffer,
-                sizeof(buffer),
-                "NEW_MESSAGE \"%s\" %u \"%s\" \"%s\"",
-                new_message_transaction->sender().c_str(),
-                new_message_transaction->recipient_type(),
-                new_message_transaction->recipient().c_str(),
-                new_message_transaction->content().c_str()
-            );
-            std::fwrite(buffer, sizeof(char), std::strlen(buffer), journal_file);
+            Journal::NewMessageRecord new_message;
+            new_message.sender            = reader.read_string();
+            new_message.recipient_type    = reader.read_u32();
+            new_message.recipient         = reader.read_string();
+            new_message.content           = reader.read_string();
+            new_message.attachment_digest = reader.read_string();
+            new_message.attachment_name   = reader.read_string();
+            new_message.id                = reader.position < reader.length ? reader.read_u32() : -1;
+            *record = new_message;
         } break;
         case Journal::Operation::DELETE_MESSAGE: {
-            // Format: DELETE_MESSAGE message_id
-            const DeleteMessageTransaction *delete_message_transaction = static_cast<const DeleteMessageTransaction *>(transaction);
-            std::snprintf(buffer, sizeof(buffer), "DELETE_MESSAGE %u", delete_message_transaction->id());
-            std::fwrite(buffer, sizeof(char), std::strlen(buffer), journal_file);
+            *record = Journal::DeleteMessageRecord{ reader.read_u32() };
         } break;
         case Journal::Operation::UPDATE_ID: {
-            // Format: UPDATE_ID new_id
-            const UpdateIdTransaction *update_id_transaction = static_cast<const UpdateIdTransaction *>(transaction);
-            std::snprintf(buffer, sizeof(buffer), "UPDATE_ID %u", update_id_transaction->id());
-            std::fwrite(buffer, sizeof(char), std::strlen(buffer), journal_file);
+            *record = Journal::UpdateIdRecord{ reader.read_u32() };
         } break;
         case Journal::Operation::NEW_GROUP: {
-            // Format: NEW_GROUP "group name" member_count "username" "username" ...(member_count times)
-            const NewGroupTransaction *new_group_transaction = static_cast<const NewGroupTransaction *>(transaction);
-            std::snprintf(buffer, sizeof(buffer), "NEW_GROUP \"%s\" %u ", new_group_transaction->name().c_str(), new_group_transaction->user_count());
+            Journal::NewGroupRecord new_group;
+            new_group.name       = reader.read_string();
+            new_group.user_count = reader.read_u32();
 
-            const auto &users = new_group_transaction->users();
-            for (u32 i = 0; i < users.size(); ++i) {
-                std::strncat(buffer, "\"", 1);
-                std::strncat(buffer, users.at(i).c_str(), users.at(i).length());
-                std::strncat(buffer, "\" ", 2);
-            }
+            // The usernames are checked here, so that 'next_user()' never has to.
+            const u32 users_start = reader.position;
+            for (u32 i = 0; i < new_group.user_count && !reader.failed; ++i)
+                reader.read_string();
 
-            ICHIGO_INFO("New group string: %s", buffer);
-            std::fwrite(buffer, sizeof(char), std::strlen(buffer), journal_file);
+            new_group.encoded_users = std::string_view(payload + users_start, reader.position - users_start);
+            *record = new_group;
         } break;
+        case Journal::Operation::RESTORE_MESSAGE: {
+            Journal::RestoreMessageRecord restore_message;
+            restore_message.id                = reader.read_u32();
+            restore_message.sender            = reader.read_string();
+            restore_message.recipient         = reader.read_string();
+            restore_message.content           = reader.read_string();
+            restore_message.attachment_digest = reader.read_string();
+            restore_message.attachment_name   = reader.read_string();
+            *record = restore_message;
+        } break;
+        default: {
+            ICHIGO_ERROR("Unknown journal operation: %u", header.operation);
+            return false;
+        }
     }
 
-    std::fflush(journal_file);
+    if (reader.failed)
+        return false;
+
+    if (reader.position != header.length) {
+        ICHIGO_ERROR("Journal record has %u trailing bytes", header.length - reader.position);
+        return false;
+    }
+
+    return true;
 }
 
-Journal::Transaction *Journal::next_transaction() {
-    if (invalid_file) {
-        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
-        return nullptr;
+std::string_view Journal::NewGroupRecord::next_user(u32 *offset) const {
+    PayloadReader reader{encoded_users.data(), static_cast<u32>(encoded_users.length()), *offset};
+    std::string_view ret = reader.read_string();
+    *offset = reader.position;
+    return ret;
+}
+
+/*
+    Make a transaction that owns copies of the strings of a record.
+*/
+static Journal::Transaction *make_transaction(const Journal::NewUserRecord &record) {
+    return new Journal::NewUserTransaction(record.username);
+}
+
+static Journal::Transaction *make_transaction(const Journal::NewMessageRecord &record) {
+    return new Journal::NewMessageTransaction(record.sender, record.recipient, record.recipient_type, record.content, record.attachment_digest, record.attachment_name, record.id);
+}
+
+static Journal::Transaction *make_transaction(const Journal::DeleteMessageRecord &record) {
+    return new Journal::DeleteMessageTransaction(record.id);
+}
+
+static Journal::Transaction *make_transaction(const Journal::UpdateIdRecord &record) {
+    return new Journal::UpdateIdTransaction(record.id);
+}
+
+static Journal::Transaction *make_transaction(const Journal::NewGroupRecord &record) {
+    Util::IchigoVector<std::string> users;
+    u32 offset = 0;
+    for (u32 i = 0; i < record.user_count; ++i)
+        users.append(std::string(record.next_user(&offset)));
+
+    return new Journal::NewGroupTransaction(record.name, std::move(users));
+}
+
+static Journal::Transaction *make_transaction(const Journal::RestoreMessageRecord &record) {
+    return new Journal::RestoreMessageTransaction(record.id, record.sender, record.recipient, record.content, record.attachment_digest, record.attachment_name);
+}
+
+/*
+    Make a file header.
+    Parameter 'magic': The magic bytes of the file (JOURNAL_MAGIC or SNAPSHOT_MAGIC).
+    Parameter 'start_position': The journal position of the first record (journal) or the position the snapshot was taken at (snapshot).
+*/
+static FileHeader make_file_header(const char *magic, u64 start_position) {
+    FileHeader header{};
+    std::memcpy(header.magic, magic, sizeof(header.magic));
+    header.version        = JOURNAL_VERSION;
+    header.start_position = start_position;
+    return header;
+}
+
+/*
+    Write a file header to an empty file.
+    Parameter 'file': The file to write the header to.
+    Parameter 'magic', 'start_position': See 'make_file_header()'.
+*/
+static void write_file_header(std::FILE *file, const char *magic, u64 start_position) {
+    FileHeader header = make_file_header(magic, start_position);
+    std::fwrite(&header, sizeof(header), 1, file);
+    std::fflush(file);
+}
+
+/*
+    Read and validate the file header of a mapped file, and position replay right after it.
+    Parameter 'file': The mapped file to read the header from.
+    Parameter 'magic': The expected magic bytes.
+    Parameter 'start_position': Set to the start position in the header.
+    Returns the size of the header, or 0 if it is invalid or has an unsupported version.
+*/
+static u32 read_file_header(MappedFile &file, const char *magic, u64 *start_position) {
+    FileHeader header{};
+    if (file.size < JOURNAL_V1_HEADER_SIZE)
+        return 0;
+
+    std::memcpy(&header, file.data, JOURNAL_V1_HEADER_SIZE);
+    if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0)
+        return 0;
+
+    if (header.version == 1) {
+        *start_position = 0;
+        file.position   = JOURNAL_V1_HEADER_SIZE;
+        return JOURNAL_V1_HEADER_SIZE;
     }
 
-    static char buffer[1024];
-    buffer[0] = next_non_whitespace();
-    // Get the transaction operation
-    for (u32 i = 1; i < 1023; ++i) {
-        buffer[i] = std::fgetc(journal_file);
-        if (std::isspace(buffer[i])) {
-            buffer[i] = 0;
-            break;
-        }
+    if (header.version != JOURNAL_VERSION || file.size < sizeof(FileHeader))
+        return 0;
+
+    std::memcpy(&header, file.data, sizeof(FileHeader));
+    *start_position = header.start_position;
+    file.position   = sizeof(FileHeader);
+    return sizeof(FileHeader);
+}
+
+/*
+    Read and validate the headers and dictionary of a mapped compressed segment, and position replay at its first block.
+    Parameter 'file': The mapped segment.
+    Parameter 'start_position': Set to the start position in the header.
+    Parameter 'record_size': Set to the number of record bytes in the segment.
+    Returns the size of the headers and dictionary, or 0 if they are invalid.
+*/
+static u32 read_compressed_header(MappedFile &file, u64 *start_position, u64 *record_size) {
+    if (read_file_header(file, COMPRESSED_SEGMENT_MAGIC, start_position) != sizeof(FileHeader) || file.size - file.position < sizeof(CompressedSegmentHeader))
+        return 0;
+
+    CompressedSegmentHeader header;
+    std::memcpy(&header, file.data + file.position, sizeof(header));
+    const u64 dictionary_start = file.position + sizeof(header);
+    if (header.dictionary_size > file.size - dictionary_start
+     || Util::crc32c(file.data + dictionary_start, header.dictionary_size) != header.dictionary_checksum)
+        return 0;
+
+    file.compressed = true;
+    file.dictionary = std::string_view(file.data + dictionary_start, header.dictionary_size);
+    file.position   = dictionary_start + header.dictionary_size;
+    *record_size    = header.record_size;
+    return file.position;
+}
+
+/*
+    Map a file for replay.
+    Parameter 'path': The path to the file.
+    Returns the mapped file. Its data is nullptr if the file could not be mapped.
+*/
+static MappedFile map_file(const std::string &path) {
+    MappedFile file;
+    file.data = ChatServer::platform_map_file(path, &file.size);
+    return file;
+}
+
+/*
+    Unmap a file mapped for replay.
+*/
+static void unmap_file(MappedFile &file) {
+    if (file.data)
+        ChatServer::platform_unmap_file(file.data, file.size);
+
+    file = {};
+}
+
+/*
+    Get the path of a journal segment.
+    Parameter 'base_path': The base path of the journal.
+    Parameter 'number': The number of the segment.
+*/
+static std::string segment_path(const std::string &base_path, u32 number) {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), ".%06u", number);
+    return base_path + suffix;
+}
+
+/*
+    Get the path of the manifest of a journal.
+    Parameter 'base_path': The base path of the journal.
+*/
+static std::string manifest_path(const std::string &base_path) {
+    return base_path + ".manifest";
+}
+
+/*
+    Atomically replace the manifest of a journal with a new list of live segments.
+    Parameter 'base_path': The base path of the journal.
+    Parameter 'live_segments': The live segments, oldest first.
+    Returns whether or not the new manifest is durable.
+*/
+static bool write_manifest(const std::string &base_path, const Util::IchigoVector<Segment> &live_segments) {
+    std::string manifest;
+    FileHeader header = make_file_header(MANIFEST_MAGIC, 0);
+    manifest.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    put_u32(manifest, live_segments.size());
+    for (u32 i = 0; i < live_segments.size(); ++i)
+        put_u32(manifest, live_segments.at(i).number);
+
+    put_u32(manifest, Util::crc32c(manifest.data(), manifest.length()));
+
+    const std::string path           = manifest_path(base_path);
+    const std::string temporary_path = path + ".tmp";
+    std::FILE *file = ChatServer::platform_open_file(temporary_path, "wb");
+    if (!file)
+        return false;
+
+    bool ret = std::fwrite(manifest.data(), sizeof(char), manifest.length(), file) == manifest.length()
+            && std::fflush(file) == 0 && ChatServer::platform_sync_file(file);
+    std::fclose(file);
+    return ret && ChatServer::platform_replace_file(temporary_path, path);
+}
+
+/*
+    Read the list of live segments from a manifest.
+    Parameter 'base_path': The base path of the journal.
+    Parameter 'numbers': Filled with the numbers of the live segments, oldest first.
+    Returns whether or not the manifest is valid.
+*/
+static bool read_manifest(const std::string &base_path, Util::IchigoVector<u32> &numbers) {
+    MappedFile file = map_file(manifest_path(base_path));
+    u64 unused;
+    bool ret = read_file_header(file, MANIFEST_MAGIC, &unused) == sizeof(FileHeader);
+
+    if (ret) {
+        PayloadReader reader{file.data + file.position, static_cast<u32>(file.size - file.position)};
+        u32 count = reader.read_u32();
+        for (u32 i = 0; i < count && !reader.failed; ++i)
+            numbers.append(reader.read_u32());
+
+        u32 checksum_position = file.position + reader.position;
+        u32 checksum          = reader.read_u32();
+        ret = !reader.failed && reader.position == reader.length && count > 0 && checksum == Util::crc32c(file.data, checksum_position);
+    }
+
+    unmap_file(file);
+    return ret;
+}
+
+/*
+    Create the next segment file and preallocate it to the segment size, so that appending to it later does not
+    have to allocate space (and update file system metadata) as it goes. Runs on the spare segment thread.
+    Parameter 'number': The number of the segment to create.
+*/
+static void create_spare_segment(u32 number) {
+    std::FILE *file = ChatServer::platform_open_file(segment_path(journal_path, number), "wb");
+    if (file)
+        ChatServer::platform_preallocate_file(file, segment_size_limit);
+
+    spare_segment_file = file;
+}
+
+/*
+    Close and delete the spare segment, if there is one. It is not in the manifest yet.
+*/
+static void discard_spare_segment() {
+    if (spare_segment_thread.joinable())
+        spare_segment_thread.join();
+
+    if (spare_segment_file) {
+        std::fclose(spare_segment_file);
+        std::remove(segment_path(journal_path, segments.at(segments.size() - 1).number + 1).c_str());
+        spare_segment_file = nullptr;
+    }
+}
+
+/*
+    Compress a sealed segment, replacing it with the compressed file once that is durable. Every block is decompressed again
+    and compared with the records before it is written, so a compressed segment always holds exactly what was journaled.
+    Runs on the seal thread.
+    Parameter 'number': The number of the segment. Nothing is done if it is already compressed.
+    Returns whether or not the segment is compressed.
+*/
+static bool compress_segment(u32 number) {
+    const std::string path = segment_path(journal_path, number);
+    std::FILE *plain = ChatServer::platform_open_file(path, "rb");
+    if (!plain)
+        return false;
+
+    char magic[8]{};
+    std::fread(magic, 1, sizeof(magic), plain);
+    std::fclose(plain);
+    if (std::memcmp(magic, COMPRESSED_SEGMENT_MAGIC, sizeof(magic)) == 0)
+        return true;
+
+    MappedFile file = map_file(path);
+    u64 start_position;
+    const u32 header_size = read_file_header(file, JOURNAL_MAGIC, &start_position);
+    if (header_size == 0) {
+        unmap_file(file);
+        ICHIGO_ERROR("Journal segment %u has an invalid header. It was not compressed.", number);
+        return false;
     }
 
-    if (std::strcmp(buffer, "NEW_USER") == 0) {
-        auto username = read_quoted_string();
-        if (!username.has_value())
-            goto fail;
+    // Walk the records to cut the blocks at record boundaries, and to sample records (spread over the segment) for the dictionary.
+    Util::IchigoVector<u64> block_ends;
+    Util::IchigoVector<std::string_view> samples;
+    const u64 record_size = file.size - header_size;
+    const u64 sample_stride = record_size / JOURNAL_DICTIONARY_SAMPLE_SIZE + 1;
+    u64 block_start = header_size;
+    u64 record_count = 0;
+    for (u64 position = header_size; position < file.size; ++record_count) {
+        RecordHeader header;
+        if (file.size - position < sizeof(header)) {
+            unmap_file(file);
+            ICHIGO_ERROR("Journal segment %u ends with a partial record. It was not compressed.", number);
+            return false;
+        }
+
+        std::memcpy(&header, file.data + position, sizeof(header));
+        if (header.length > JOURNAL_MAX_RECORD_LENGTH || file.size - position - sizeof(header) < header.length) {
+            unmap_file(file);
+            ICHIGO_ERROR("Journal segment %u has a truncated record. It was not compressed.", number);
+            return false;
+        }
 
-        return new NewUserTransaction(username.value());
-    } else if (std::strcmp(buffer, "UPDATE_ID") == 0) {
-        u32 id = read_u32();
+        if (record_count % sample_stride == 0)
+            samples.append(std::string_view(file.data + position, sizeof(header) + header.length));
 
-        if (id == INVALID_U32) {
-            ICHIGO_ERROR("Invalid u32");
-            goto fail;
+        position += sizeof(header) + header.length;
+        if (position - block_start >= JOURNAL_COMPRESSED_BLOCK_SIZE || position == file.size) {
+            block_ends.append(position);
+            block_start = position;
         }
+    }
+
+    const std::string dictionary = Compression::train_dictionary(samples, JOURNAL_DICTIONARY_SIZE);
+    const std::string temporary_path = path + ".tmp";
+    std::FILE *compressed = ChatServer::platform_open_file(temporary_path, "wb");
+    if (!compressed) {
+        unmap_file(file);
+        return false;
+    }
 
-        return new UpdateIdTransaction(id);
-    } else if (std::strcmp(buffer, "NEW_MESSAGE") == 0) {
-        auto sender = read_quoted_string();
+    std::string out;
+    FileHeader file_header = make_file_header(COMPRESSED_SEGMENT_MAGIC, start_position);
+    CompressedSegmentHeader segment_header{ record_size, static_cast<u32>(dictionary.length()), Util::crc32c(dictionary.data(), dictionary.length()) };
+    out.append(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+    out.append(reinterpret_cast<const char *>(&segment_header), sizeof(segment_header));
+    out.append(dictionary);
+    u64 compressed_size = out.length();
+    bool ret = std::fwrite(out.data(), sizeof(char), out.length(), compressed) == out.length();
 
-        if (!sender.has_value())
-            goto fail;
+    std::string check;
+    block_start = header_size;
+    for (u32 i = 0; i < block_ends.size() && ret; ++i) {
+        if (seal_stop.load(std::memory_order_relaxed)) {
+            ret = false;
+            break;
+        }
 
-        u32 recipient_type = read_u32();
+        BlockHeader block_header{ static_cast<u32>(block_ends.at(i) - block_start), 0 };
+        out.assign(sizeof(block_header), '\0');
+        Compression::compress(dictionary, file.data + block_start, block_header.record_size, out);
+        block_header.compressed_size = out.length() - sizeof(block_header);
+        std::memcpy(out.data(), &block_header, sizeof(block_header));
 
-        if (recipient_type == INVALID_U32) {
-            goto fail;
+        check.resize(block_header.record_size);
+        if (!Compression::decompress(dictionary, out.data() + sizeof(block_header), block_header.compressed_size, check.data(), block_header.record_size)
+         || std::memcmp(check.data(), file.data + block_start, block_header.record_size) != 0) {
+            ICHIGO_ERROR("Journal segment %u did not decompress back to the same records. It was not compressed.", number);
+            ret = false;
+            break;
         }
 
-        auto recipient = read_quoted_string();
+        ret = std::fwrite(out.data(), sizeof(char), out.length(), compressed) == out.length();
+        compressed_size += out.length();
+        block_start = block_ends.at(i);
+    }
 
-        if (!recipient.has_value())
-            goto fail;
+    ret = ret && std::fflush(compressed) == 0 && ChatServer::platform_sync_file(compressed);
+    std::fclose(compressed);
 
-        auto content = read_quoted_string();
+    // The segment cannot be replaced while it is mapped.
+    const u64 plain_size = file.size;
+    unmap_file(file);
+    ret = ret && ChatServer::platform_replace_file(temporary_path, path);
+    if (!ret) {
+        std::remove(temporary_path.c_str());
+        return false;
+    }
 
-        if (!content.has_value())
-            goto fail;
+    ICHIGO_INFO("Compressed journal segment %u: %llu bytes to %llu bytes (%llu blocks, %llu byte dictionary)", number, static_cast<unsigned long long>(plain_size),
+                static_cast<unsigned long long>(compressed_size), static_cast<unsigned long long>(block_ends.size()), static_cast<unsigned long long>(dictionary.length()));
+    return true;
+}
 
-        return new NewMessageTransaction(sender.value(), recipient.value(), recipient_type, content.value());
-    } else if (std::strcmp(buffer, "DELETE_MESSAGE") == 0) {
-        u32 id = read_u32();
+/*
+    Compress every sealed segment that is not compressed yet. Runs on the seal thread.
+    Parameter 'numbers': The numbers of the sealed segments.
+*/
+static void compress_sealed_segments(Util::IchigoVector<u32> numbers) {
+    for (u32 i = 0; i < numbers.size() && !seal_stop.load(std::memory_order_relaxed); ++i) {
+        if (!compress_segment(numbers.at(i)))
+            ICHIGO_ERROR("Failed to compress journal segment %u. It stays uncompressed until the next attempt.", numbers.at(i));
+    }
+}
 
-        if (id == INVALID_U32)
-            goto fail;
+/*
+    Start compressing the sealed segments on the seal thread, after the previous run is done. Runs on the writer thread.
+*/
+static void seal_segments() {
+    if (!segment_compression)
+        return;
 
-        return new DeleteMessageTransaction(id);
-    } else if (std::strcmp(buffer, "NEW_GROUP") == 0) {
-        auto name = read_quoted_string();
+    if (seal_thread.joinable())
+        seal_thread.join();
 
-        if (!name.has_value())
-            goto fail;
+    Util::IchigoVector<u32> numbers;
+    for (u32 i = 0; i + 1 < segments.size(); ++i)
+        numbers.append(segments.at(i).number);
 
-        // ICHIGO_INFO("Read group name: %s", )
+    if (numbers.size() > 0)
+        seal_thread = std::thread(compress_sealed_segments, std::move(numbers));
+}
 
-        u32 user_count = read_u32();
+/*
+    Get the journal position just past the last record written to the current segment. Only used by the writer thread
+    (and by 'Journal::init()' before it starts).
+*/
+static u64 journal_end_position() {
+    return segments.at(segments.size() - 1).start_position + segment_size - segment_header_size;
+}
 
-        if (user_count == INVALID_U32)
-            goto fail;
+/*
+    Wake the writer thread up to look at its requests.
+*/
+static void wake_writer() {
+    writer_signal.fetch_add(1, std::memory_order_release);
+    writer_signal.notify_one();
+}
 
-        Util::IchigoVector<std::string> users;
-        for (u32 i = 0; i < user_count; ++i) {
-            auto username = read_quoted_string();
-            if (!username.has_value())
-                goto fail;
+/*
+    Write the records waiting in the ring to the current segment and hand them to the OS. They are not durable until the
+    segment is synced. Runs on the writer thread.
+    If a write fails, part of the batch may have reached the segment, ending it in a partial record. Anything appended after
+    that would be cut off with the torn tail on the next start, so from then on the records are dropped instead (and their
+    batches fail), and the snapshot thread is told that the journal cannot be synced any further.
+    Parameter 'end_position': The position to write up to. Must be at a record boundary.
+    Returns whether or not the records were written.
+*/
+static bool write_ring(u64 end_position) {
+    const u64 position = ring_tail.load(std::memory_order_relaxed);
+    if (position == end_position)
+        return true;
 
-            users.append(username.value());
-        }
+    // The records may wrap around the end of the ring, in which case they are written in two pieces.
+    const u64 offset = position & (JOURNAL_RING_SIZE - 1);
+    const u64 length = end_position - position;
+    const u64 first  = length < JOURNAL_RING_SIZE - offset ? length : JOURNAL_RING_SIZE - offset;
+    bool ret = !write_failed
+            && std::fwrite(ring + offset, sizeof(char), first, journal_file) == first
+            && std::fwrite(ring, sizeof(char), length - first, journal_file) == length - first
+            && std::fflush(journal_file) == 0;
 
-        return new NewGroupTransaction(name.value(), users);
+    if (ret) {
+        segment_size += length;
+        unsynced      = true;
+    } else if (!write_failed) {
+        ICHIGO_ERROR("Failed to write the journal batch! No more batches are written until the server is restarted.");
+        write_failed = true;
+        sync_failed.store(true, std::memory_order_release);
+        sync_attempts.fetch_add(1, std::memory_order_release);
+        sync_attempts.notify_all();
     }
 
-fail:
-        invalid_file = true;
-        return nullptr;
+    // The space is free for the server thread to commit into again.
+    ring_tail.store(end_position, std::memory_order_release);
+    ring_tail.notify_one();
+    return ret;
 }
 
-void Journal::return_transaction(Transaction *transaction) {
-    delete transaction;
+/*
+    Record that everything written so far is durable, and let the snapshot thread know. Runs on the writer thread.
+*/
+static void mark_synced(std::chrono::steady_clock::time_point now) {
+    unsynced       = false;
+    last_sync_time = now;
+    synced_position.store(ring_tail.load(std::memory_order_relaxed), std::memory_order_release);
+    sync_attempts.fetch_add(1, std::memory_order_release);
+    sync_attempts.notify_all();
 }
 
-bool Journal::has_more_transactions() {
-    if (invalid_file) {
-        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
+/*
+    Make the records written since the last sync durable according to the durability mode. Runs on the writer thread.
+    Parameter 'force': Sync whatever the durability mode.
+    Returns whether or not the guarantee of the durability mode was met.
+*/
+static bool sync_batches(bool force) {
+    // Syncing would mark everything up to the tail of the ring durable, past the partial record.
+    if (write_failed)
         return false;
+
+    if (!unsynced)
+        return true;
+
+    auto now = std::chrono::steady_clock::now();
+    if (!force) {
+        switch (durability_mode.load(std::memory_order_relaxed)) {
+            case Journal::Durability::NONE: {
+                // Left to the OS to write back whenever it likes.
+                return true;
+            }
+            case Journal::Durability::INTERVAL: {
+                if (now - last_sync_time < std::chrono::milliseconds(sync_interval_ms.load(std::memory_order_relaxed)))
+                    return true;
+            } break;
+            case Journal::Durability::SYNC: break;
+        }
     }
 
-    // Consume whitespace at beginning of line
-    u32 pos = std::ftell(journal_file);
+    if (!ChatServer::platform_sync_file(journal_file)) {
+        ICHIGO_ERROR("Failed to make the journal durable!");
+        sync_failed.store(true, std::memory_order_release);
+        sync_attempts.fetch_add(1, std::memory_order_release);
+        sync_attempts.notify_all();
+        return false;
+    }
 
-    for (char c = std::fgetc(journal_file);; c = std::fgetc(journal_file)) {
-        if (c == EOF)
-            return false;
+    mark_synced(now);
+    return true;
+}
 
-        if (!std::isspace(c))
-            break;
+/*
+    Report the completed batches that the server thread has not been told about yet, as far as there is room. Runs on the writer thread
+    (or on the server thread when the journal is invalid and there is no writer thread).
+*/
+static void report_completed_batches() {
+    if (!has_unreported_batch)
+        return;
+
+    const u64 head = completed_head.load(std::memory_order_relaxed);
+    if (head - completed_tail.load(std::memory_order_acquire) == JOURNAL_COMPLETED_BATCH_COUNT)
+        return;
+
+    completed_batches[head % JOURNAL_COMPLETED_BATCH_COUNT] = unreported_batch;
+    completed_head.store(head + 1, std::memory_order_release);
+    has_unreported_batch = false;
+}
+
+/*
+    Report a batch as complete. If the server thread has fallen behind on picking up completed batches, it is merged into the
+    batch still waiting to be reported: one report then covers both. Runs on the writer thread (see 'report_completed_batches()').
+    Parameter 'end_position': The position the batch ends at.
+    Parameter 'durable': Whether or not the batch met the guarantee of the durability mode.
+*/
+static void complete_batch(u64 end_position, bool durable) {
+    if (has_unreported_batch)
+        durable = durable && unreported_batch.durable;
+
+    unreported_batch     = { end_position, durable };
+    has_unreported_batch = true;
+    report_completed_batches();
+}
+
+/*
+    Move on to a new segment. Called by the writer thread between writes, so a record never spans two segments. The current segment is synced
+    and closed, the spare segment becomes the current one, and a new spare is prepared in the background.
+*/
+static void rotate_segment() {
+    // The records dropped after a failed write are not in the segment, so a new one would start at the wrong position.
+    if (write_failed)
+        return;
+
+    const u32 number        = segments.at(segments.size() - 1).number + 1;
+    const u64 start_position = journal_end_position();
+
+    spare_segment_thread.join();
+    std::FILE *file = spare_segment_file;
+    spare_segment_file = nullptr;
+    if (!file) {
+        ICHIGO_ERROR("The spare journal segment could not be created. Continuing in the current segment.");
+        spare_segment_thread = std::thread(create_spare_segment, number);
+        return;
+    }
+
+    // The new segment has to be durable (header included) before the manifest refers to it.
+    std::setvbuf(file, file_buffer, _IOFBF, sizeof(file_buffer));
+    write_file_header(file, JOURNAL_MAGIC, start_position);
+    Util::IchigoVector<Segment> new_segments = segments;
+    new_segments.append({ number, start_position });
+
+    if (!ChatServer::platform_sync_file(file) || !write_manifest(journal_path, new_segments)) {
+        ICHIGO_ERROR("Failed to add journal segment %u. Continuing in the current segment.", number);
+        std::fclose(file);
+        std::remove(segment_path(journal_path, number).c_str());
+        spare_segment_thread = std::thread(create_spare_segment, number);
+        return;
+    }
+
+    // Whatever the durability mode, nothing is left unsynced in a segment that is no longer written to.
+    ChatServer::platform_sync_file(journal_file);
+    std::fclose(journal_file);
+
+    journal_file        = file;
+    segments            = new_segments;
+    segment_size        = sizeof(FileHeader);
+    segment_header_size = sizeof(FileHeader);
+    mark_synced(std::chrono::steady_clock::now());
+    spare_segment_thread = std::thread(create_spare_segment, number + 1);
+    ICHIGO_INFO("Journal rotated to segment %u at position %llu", number, static_cast<unsigned long long>(start_position));
+}
+
+/*
+    Delete every segment that only holds records before a journal position. The segment being appended to is never deleted.
+    Parameter 'position': The journal position to compact up to. Must be covered by a durable snapshot.
+*/
+static void compact_journal(u64 position);
+
+/*
+    Copy the snapshot and the journal up to the backup position to the backup. Runs on the backup thread, which the writer thread
+    starts once the journal is synced up to the backup position.
+    Parameter 'live_segments': The live segments when the backup thread was started.
+*/
+static void copy_backup(Util::IchigoVector<Segment> live_segments);
+
+/*
+    The writer thread. Writes the records committed into the ring, syncs them according to the durability mode when a batch is
+    handed over with 'flush()', and reports the batch as complete. Also rotates, seals, and compacts segments, and starts backups,
+    so that the server thread never touches the journal files after 'Journal::init()'.
+    Parameter 'completed_position': The end of the last batch already complete (where the journal ended when it was opened).
+    Parameter 'rotated_position': The last rotation request already handled.
+*/
+static void run_writer(u64 completed_position, u64 rotated_position) {
+    u64 compacted_position = 0;
+    bool batch_written     = true;
+    bool compact_pending   = false;
+    bool seal_pending      = false;
+
+    for (;;) {
+        // The requests are read before the head of the ring, so every batch requested is already in the ring.
+        const u32 signal            = writer_signal.load(std::memory_order_acquire);
+        const bool stopping         = writer_stop.load(std::memory_order_acquire);
+        const u64 flush_position    = flush_request.load(std::memory_order_acquire);
+        const u64 sync_position     = sync_request.load(std::memory_order_acquire);
+        const u64 compact_position  = compact_request.load(std::memory_order_acquire);
+        const u64 rotate_position   = rotate_request.load(std::memory_order_acquire);
+        const u64 head              = ring_head.load(std::memory_order_acquire);
+
+        // The segment is only cut at the snapshot position if nothing after it has been written yet. If it has, the snapshot is
+        // still good; the records before it are just deleted with a later snapshot instead.
+        bool rotated = false;
+        if (rotate_position != rotated_position && rotate_position >= ring_tail.load(std::memory_order_relaxed) && rotate_position <= head) {
+            batch_written = write_ring(rotate_position) && batch_written;
+            if (segment_size > segment_header_size) {
+                rotate_segment();
+                rotated = true;
+            }
+        }
+
+        rotated_position = rotate_position;
+        batch_written    = write_ring(head) && batch_written;
+
+        // A snapshot waiting on the journal, and a clean shutdown, sync everything whatever the durability mode.
+        const bool force = stopping || sync_position > synced_position.load(std::memory_order_relaxed);
+        if (flush_position > completed_position || force) {
+            bool durable = sync_batches(force) && batch_written;
+            if (flush_position > completed_position) {
+                complete_batch(flush_position, durable);
+                completed_position = flush_position;
+                batch_written      = true;
+            }
+        }
+
+        report_completed_batches();
+
+        // A backup is copied once everything it covers is durable, and fails if the journal could not be synced that far.
+        const BackupState backup = backup_state.load(std::memory_order_acquire);
+        if (backup == BackupState::REQUESTED && synced_position.load(std::memory_order_relaxed) >= backup_position) {
+            backup_state.store(BackupState::COPYING, std::memory_order_relaxed);
+            backup_thread = std::thread(copy_backup, segments);
+        } else if (backup == BackupState::REQUESTED && sync_failed.load(std::memory_order_relaxed)) {
+            backup_succeeded = false;
+            backup_state.store(BackupState::DONE, std::memory_order_release);
+        } else if (backup == BackupState::COPIED) {
+            backup_thread.join();
+            backup_state.store(BackupState::DONE, std::memory_order_release);
+        }
+
+        if (segment_size >= segment_size_limit) {
+            rotate_segment();
+            rotated = true;
+        }
+
+        // Segments are neither deleted nor compressed while a backup is copying them. Both catch up once it is done.
+        compact_pending = compact_pending || rotated || compact_position != compacted_position;
+        seal_pending    = seal_request.exchange(false, std::memory_order_acquire) || seal_pending || rotated;
+        if (compact_pending && !backup_thread.joinable()) {
+            compact_journal(compact_position);
+            compacted_position = compact_position;
+            compact_pending    = false;
+        }
+
+        if (seal_pending && !backup_thread.joinable()) {
+            seal_segments();
+            seal_pending = false;
+        }
+
+        if (stopping) {
+            if (backup_thread.joinable())
+                backup_thread.join();
+
+            return;
+        }
+
+        writer_signal.wait(signal, std::memory_order_acquire);
+    }
+}
+
+/*
+    Start the writer thread, appending after everything already in the journal (which is taken to be durable).
+*/
+static void start_writer() {
+    const u64 end_position = journal_end_position();
+    ring_head.store(end_position, std::memory_order_relaxed);
+    ring_tail.store(end_position, std::memory_order_relaxed);
+    flush_request.store(end_position, std::memory_order_relaxed);
+    sync_request.store(end_position, std::memory_order_relaxed);
+    synced_position.store(end_position, std::memory_order_relaxed);
+    writer_stop.store(false, std::memory_order_relaxed);
+    writer_woken_position = end_position;
+    last_sync_time        = std::chrono::steady_clock::now();
+    // The requests the writer starts from are read here: the server thread may commit (and flush) before the writer thread runs.
+    writer_thread         = std::thread(run_writer, end_position, rotate_request.load(std::memory_order_relaxed));
+}
+
+/*
+    Stop the writer thread, if it is running. Everything committed before is written and synced first, whatever the durability mode.
+*/
+static void stop_writer() {
+    if (!writer_thread.joinable())
+        return;
+
+    writer_stop.store(true, std::memory_order_release);
+    wake_writer();
+    writer_thread.join();
+}
+
+/*
+    Write the snapshot image to a temporary file, sync it, and move it into place. Runs on the snapshot thread.
+*/
+static void write_snapshot() {
+    const std::string temporary_path = snapshot_path + ".tmp";
+    bool ret = false;
+
+    snapshot_builder.write(snapshot_attempt_position, snapshot_buffer);
+
+    std::FILE *file = ChatServer::platform_open_file(temporary_path, "wb");
+    if (file) {
+        ret = std::fwrite(snapshot_buffer.data(), sizeof(char), snapshot_buffer.length(), file) == snapshot_buffer.length()
+           && std::fflush(file) == 0 && ChatServer::platform_sync_file(file);
+        std::fclose(file);
+
+        // If the snapshot became durable before the journal records it includes, a crash could leave a snapshot that is ahead of
+        // the journal. The writer thread was asked to sync up to the snapshot position in 'Journal::begin_snapshot()'.
+        for (;;) {
+            const u32 attempts = sync_attempts.load(std::memory_order_acquire);
+            if (synced_position.load(std::memory_order_acquire) >= snapshot_attempt_position)
+                break;
+
+            if (sync_failed.load(std::memory_order_acquire)) {
+                ret = false;
+                break;
+            }
+
+            sync_attempts.wait(attempts, std::memory_order_acquire);
+        }
+
+        ret = ret && ChatServer::platform_replace_file(temporary_path, snapshot_path);
+    }
+
+    snapshot_succeeded = ret;
+    snapshot_done.store(true, std::memory_order_release);
+}
+
+/*
+    Delete every segment that only holds records before a journal position. Runs on the writer thread (see the declaration above).
+*/
+static void compact_journal(u64 position) {
+    u32 removable = 0;
+    while (removable + 1 < segments.size() && segments.at(removable + 1).start_position <= position)
+        ++removable;
+
+    if (removable == 0)
+        return;
+
+    // A segment being compressed must not be deleted from under the seal thread (which would then move the compressed file into its place).
+    if (seal_thread.joinable())
+        seal_thread.join();
+
+    // The manifest stops referring to the segments before they are deleted, so a crash in between only leaves stray files.
+    Util::IchigoVector<Segment> new_segments;
+    for (u32 i = removable; i < segments.size(); ++i)
+        new_segments.append(segments.at(i));
+
+    if (!write_manifest(journal_path, new_segments)) {
+        ICHIGO_ERROR("Failed to write the journal manifest. The journal was not compacted.");
+        return;
+    }
+
+    for (u32 i = 0; i < removable; ++i)
+        std::remove(segment_path(journal_path, segments.at(i).number).c_str());
+
+    ICHIGO_INFO("Compacted journal up to position %llu: deleted segments %u to %u", static_cast<unsigned long long>(position),
+                segments.at(0).number, segments.at(removable - 1).number);
+    segments = new_segments;
+}
+
+/*
+    Get the next mapped file that replay has not finished reading, in replay order.
+    Returns the file, or nullptr if everything has been read.
+*/
+static MappedFile *next_replay_file() {
+    if (replay_snapshot.position < replay_snapshot.size)
+        return &replay_snapshot;
+
+    for (; replay_segment_index < replay_segments.size(); ++replay_segment_index) {
+        MappedFile &file = replay_segments.at(replay_segment_index);
+        if (file.position < file.size)
+            return &file;
+    }
+
+    return nullptr;
+}
+
+/*
+    Unmap the snapshot and every journal segment mapped for replay.
+*/
+static void unmap_replay_files() {
+    replay_image.close();
+    unmap_file(replay_snapshot);
+    for (u32 i = 0; i < replay_segments.size(); ++i)
+        unmap_file(replay_segments.at(i));
+
+    replay_segments.clear();
+    read_ahead_segments.clear();
+    replay_segment_index = 0;
+    replay_block         = {};
+    replay_block_buffer.clear();
+    replay_block_buffer.shrink_to_fit();
+}
+
+/*
+    Get the next block of a mapped compressed segment, and move past it. If the block header is implausible, the rest of the file
+    is returned as a block that fails to decompress, so that the error is reported in order.
+    Parameter 'file': The compressed segment. Must have blocks left.
+*/
+static CompressedBlock next_compressed_block(MappedFile &file) {
+    BlockHeader header;
+    CompressedBlock ret{ file.data + file.position, 0, 0, file.base_position };
+    if (file.size - file.position >= sizeof(header)) {
+        std::memcpy(&header, file.data + file.position, sizeof(header));
+        if (header.compressed_size <= file.size - file.position - sizeof(header)) {
+            ret = { file.data + file.position + sizeof(header), header.compressed_size, header.record_size, file.base_position };
+            file.position      += sizeof(header) + header.compressed_size;
+            file.base_position += header.record_size;
+            return ret;
+        }
+    }
+
+    file.position = file.size;
+    return ret;
+}
+
+/*
+    Move replay forward in a mapped compressed segment by a number of record bytes. Whole blocks are skipped without being
+    decompressed; the rest is left in 'skip' for the block replay starts in.
+    Parameter 'file': The compressed segment.
+    Parameter 'record_bytes': The number of record bytes to skip. Must be at a record boundary.
+*/
+static void skip_compressed_records(MappedFile &file, u64 record_bytes) {
+    while (file.position < file.size) {
+        BlockHeader header;
+        if (file.size - file.position < sizeof(header))
+            break;
+
+        std::memcpy(&header, file.data + file.position, sizeof(header));
+        if (header.record_size > record_bytes || header.compressed_size > file.size - file.position - sizeof(header))
+            break;
+
+        file.position      += sizeof(header) + header.compressed_size;
+        file.base_position += header.record_size;
+        record_bytes       -= header.record_size;
+    }
+
+    file.skip = record_bytes;
+}
+
+/*
+    Write a file of a backup and sync it.
+    Parameter 'path': The path to the file. It is replaced if it exists.
+    Parameter 'data', 'size': What to write to the file.
+    Returns whether or not the file is durable.
+*/
+static bool write_backup_file(const std::string &path, const char *data, u64 size) {
+    std::FILE *file = ChatServer::platform_open_file(path, "wb");
+    if (!file)
+        return false;
+
+    bool ret = std::fwrite(data, sizeof(char), size, file) == size && std::fflush(file) == 0 && ChatServer::platform_sync_file(file);
+    std::fclose(file);
+    return ret;
+}
+
+/*
+    Copy a segment to a backup, up to a journal position. A plain segment is cut there. A compressed segment is copied as is, unless it
+    goes on past the position (it was sealed just as the backup began): then the records before the position are decompressed and
+    written out as a plain segment, since the last segment of a journal is never compressed anyway. Runs on the backup thread.
+    Parameter 'number': The number of the segment.
+    Parameter 'end_position': The journal position to copy up to.
+    Returns whether or not the copy is durable.
+*/
+static bool copy_segment(u32 number, u64 end_position) {
+    MappedFile file = map_file(segment_path(journal_path, number));
+    const char *data = file.data;
+    u64 size         = file.size;
+    std::string plain;
+    u64 start_position;
+    u64 record_size;
+
+    if (const u32 header_size = read_file_header(file, JOURNAL_MAGIC, &start_position)) {
+        size = std::min(file.size, header_size + end_position - start_position);
+    } else if (read_compressed_header(file, &start_position, &record_size) > 0 && start_position + record_size > end_position) {
+        FileHeader header = make_file_header(JOURNAL_MAGIC, start_position);
+        plain.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        file.base_position = start_position;
+        while (data && file.base_position < end_position && file.position < file.size) {
+            const CompressedBlock block = next_compressed_block(file);
+            const u64 offset = plain.length();
+            plain.resize(offset + block.record_size);
+            if (!Compression::decompress(file.dictionary, block.data, block.compressed_size, plain.data() + offset, block.record_size))
+                data = nullptr;
+
+            plain.resize(offset + std::min<u64>(block.record_size, end_position - block.start_position));
+        }
+
+        if (data && file.base_position < end_position)
+            data = nullptr;
+
+        size = plain.length();
+        data = data ? plain.data() : nullptr;
+    }
+
+    const bool ret = data && write_backup_file(segment_path(backup_journal_path, number), data, size);
+    unmap_file(file);
+    return ret;
+}
+
+static void copy_backup(Util::IchigoVector<Segment> live_segments) {
+    // The snapshot is left alone while a backup is taken (see 'Journal::begin_backup()'), so it is the latest durable one, taken at or
+    // before the backup position. The live segments go back at least as far as it.
+    MappedFile snapshot       = map_file(snapshot_path);
+    const bool has_snapshot   = snapshot.data != nullptr;
+    bool ret                  = true;
+    std::remove(backup_snapshot_path.c_str());
+    if (has_snapshot)
+        ret = write_backup_file(backup_snapshot_path, snapshot.data, snapshot.size);
+
+    unmap_file(snapshot);
+
+    // Segments that start after the backup position hold nothing it covers. The manifest goes last, so a backup without one is incomplete.
+    Util::IchigoVector<Segment> backup_segments;
+    for (u32 i = 0; i < live_segments.size() && ret && (i == 0 || live_segments.at(i).start_position < backup_position); ++i) {
+        const u64 end_position = i + 1 < live_segments.size() && live_segments.at(i + 1).start_position < backup_position
+                               ? live_segments.at(i + 1).start_position : backup_position;
+        ret = copy_segment(live_segments.at(i).number, end_position);
+        backup_segments.append(live_segments.at(i));
+    }
+
+    ret = ret && write_manifest(backup_journal_path, backup_segments);
+    if (ret)
+        ICHIGO_INFO("Backed up the journal up to position %llu to %s (%u segments%s)", static_cast<unsigned long long>(backup_position),
+                    backup_journal_path.c_str(), static_cast<u32>(backup_segments.size()), has_snapshot ? " and the snapshot" : "");
+
+    backup_succeeded = ret;
+    backup_state.store(BackupState::COPIED, std::memory_order_release);
+    wake_writer();
+}
+
+/*
+    Read the next record from a mapped journal or snapshot file. The record is parsed in place.
+    Parameter 'file': The file to read from.
+    Parameter 'record': Set to the record. Its strings are views into the file.
+    Returns whether or not the record is well formed. If not, the file is left at the start of the record.
+*/
+static bool read_record(MappedFile &file, Journal::Record *record) {
+    RecordHeader header;
+    if (file.size - file.position < sizeof(header)) {
+        ICHIGO_ERROR("Failed to read journal record header");
+        return false;
+    }
+
+    std::memcpy(&header, file.data + file.position, sizeof(header));
+    if (header.length > JOURNAL_MAX_RECORD_LENGTH || file.size - file.position - sizeof(header) < header.length) {
+        ICHIGO_ERROR("Journal record is truncated");
+        return false;
+    }
+
+    const char *payload = file.data + file.position + sizeof(header);
+    u32 checksum = Util::crc32c(&header, offsetof(RecordHeader, checksum));
+    checksum = Util::crc32c(payload, header.length, checksum);
+    if (checksum != header.checksum) {
+        ICHIGO_ERROR("Journal record checksum mismatch");
+        return false;
+    }
+
+    if (!parse_record(header, payload, record))
+        return false;
+
+    file.position += sizeof(header) + header.length;
+    return true;
+}
+
+/*
+    Hand the NEW_USER and NEW_GROUP records of a mapped journal segment (or a decompressed block of one) to 'Journal::read_ahead()'.
+    Every other record is only checksummed and skipped, so that reading ahead stops at the same record replay would.
+    Parameter 'file': The records to read. Read up to the end, or to the first record that cannot be read back.
+    Parameter 'apply': See 'Journal::read_ahead()'.
+    Returns whether or not every record could be read back.
+*/
+static bool read_ahead_records(MappedFile &file, void (*apply)(const Journal::Record &record)) {
+    while (file.position < file.size) {
+        RecordHeader header;
+        if (file.size - file.position < sizeof(header))
+            return false;
+
+        std::memcpy(&header, file.data + file.position, sizeof(header));
+        if (header.length > JOURNAL_MAX_RECORD_LENGTH || file.size - file.position - sizeof(header) < header.length)
+            return false;
+
+        const char *payload = file.data + file.position + sizeof(header);
+        u32 checksum = Util::crc32c(&header, offsetof(RecordHeader, checksum));
+        checksum = Util::crc32c(payload, header.length, checksum);
+        if (checksum != header.checksum)
+            return false;
+
+        const Journal::Operation operation = static_cast<Journal::Operation>(header.operation);
+        if (operation == Journal::Operation::NEW_USER || operation == Journal::Operation::NEW_GROUP) {
+            Journal::Record record;
+            if (!parse_record(header, payload, &record))
+                return false;
+
+            apply(record);
+        }
+
+        file.position += sizeof(header) + header.length;
+    }
+
+    return true;
+}
+
+/*
+    Decode every record in a chunk of a mapped file. Runs on a replay worker thread.
+    Parameter 'data': The start of the chunk. Must be at a record boundary.
+    Parameter 'size': The size of the chunk in bytes.
+    Parameter 'start_position': The journal position of the first record, or NO_JOURNAL_POSITION for the snapshot.
+*/
+static DecodedChunk decode_chunk(const char *data, u64 size, u64 start_position) {
+    MappedFile chunk = records_view(data, size, 0, 0);
+    DecodedChunk ret;
+    ret.start_position = start_position;
+
+    while (chunk.position < chunk.size) {
+        const u64 record_start = chunk.position;
+        Journal::Record record;
+        if (!read_record(chunk, &record)) {
+            ret.failed        = true;
+            ret.failed_record = data + chunk.position;
+            break;
+        }
+
+        ret.records.append(record);
+        ret.record_lengths.append(chunk.position - record_start);
+    }
+
+    return ret;
+}
+
+/*
+    Decompress a block of a compressed segment and decode every record in it. Runs on a replay worker thread.
+    Parameter 'dictionary': The dictionary of the segment.
+    Parameter 'block': The block.
+    Parameter 'skip': The number of record bytes at the start of the block that replay does not need.
+    If the block is corrupt, the chunk fails at the start of the block (which is never in the segment being appended to).
+*/
+static DecodedChunk decode_compressed_chunk(std::string_view dictionary, CompressedBlock block, u64 skip) {
+    std::unique_ptr<char[]> records(new char[block.record_size]);
+    if (skip > block.record_size || !Compression::decompress(dictionary, block.data, block.compressed_size, records.get(), block.record_size)) {
+        ICHIGO_ERROR("Compressed journal block is corrupt");
+        DecodedChunk ret;
+        ret.failed        = true;
+        ret.failed_record = block.data;
+        return ret;
+    }
+
+    DecodedChunk ret = decode_chunk(records.get() + skip, block.record_size - skip, block.start_position + skip);
+    ret.buffer       = std::move(records);
+    if (ret.failed)
+        ret.failed_record = block.data;
+
+    return ret;
+}
+
+/*
+    Start decoding chunks of the mapped files until 'replay_thread_count' chunks are in flight or everything has been scheduled.
+    Chunks are cut at record boundaries by walking the record headers, which is cheap compared to checksumming and decoding
+    the payloads. If a record header is implausible, the rest of the file becomes one chunk and the error is reported
+    when that chunk is decoded, in order. In a compressed segment, every block is a chunk.
+*/
+static void schedule_replay_chunks() {
+    if (replay_thread_count == 1)
+        return;
+
+    while (replay_chunks.size() < replay_thread_count) {
+        MappedFile *next_file = next_replay_file();
+        if (!next_file)
+            return;
+
+        MappedFile &file = *next_file;
+        if (file.compressed) {
+            replay_chunks.push_back(std::async(std::launch::async, decode_compressed_chunk, file.dictionary, next_compressed_block(file), file.skip));
+            file.skip = 0;
+            continue;
+        }
+
+        u64 start = file.position;
+        u64 end   = start;
+        while (end < file.size && end - start < JOURNAL_REPLAY_CHUNK_SIZE) {
+            RecordHeader header;
+            if (file.size - end < sizeof(header)) {
+                end = file.size;
+                break;
+            }
+
+            std::memcpy(&header, file.data + end, sizeof(header));
+            if (header.length > JOURNAL_MAX_RECORD_LENGTH || file.size - end - sizeof(header) < header.length) {
+                end = file.size;
+                break;
+            }
+
+            end += sizeof(header) + header.length;
+        }
+
+        file.position = end;
+        const u64 start_position = &file == &replay_snapshot ? NO_JOURNAL_POSITION : file.base_position + start;
+        replay_chunks.push_back(std::async(std::launch::async, decode_chunk, file.data + start, end - start, start_position));
+    }
+}
+
+/*
+    Drop every decoded record that has not been handed out, waiting for any chunks still being decoded.
+*/
+static void discard_replay_chunks() {
+    has_replay_record = false;
+    for (auto &future : replay_chunks)
+        future.wait();
+
+    replay_chunks.clear();
+    replay_chunk       = {};
+    replay_chunk_index = 0;
+}
+
+/*
+    Get the records to read next when records are decoded one at a time: the rest of the decompressed block of a compressed
+    segment, or else the next mapped file that replay has not finished reading (decompressing its next block if it is compressed).
+    Returns the records, or nullptr if everything has been read. If a block is corrupt, reading from the records fails at the block.
+*/
+static MappedFile *next_replay_records() {
+    if (replay_block.position < replay_block.size)
+        return &replay_block;
+
+    MappedFile *file = next_replay_file();
+    if (!file || !file->compressed)
+        return file;
+
+    const CompressedBlock block = next_compressed_block(*file);
+    replay_block_buffer.resize(block.record_size);
+    if (file->skip > block.record_size
+     || !Compression::decompress(file->dictionary, block.data, block.compressed_size, replay_block_buffer.data(), block.record_size)) {
+        ICHIGO_ERROR("Compressed journal block is corrupt");
+        replay_block = records_view(block.data, 0, 0, 0);
+        return &replay_block;
+    }
+
+    replay_block = records_view(replay_block_buffer.data(), replay_block_buffer.length(), file->skip, block.start_position);
+    file->skip   = 0;
+    return &replay_block;
+}
+
+/*
+    Release everything replay used once it is over, and have the writer thread seal the segments that were left uncompressed
+    (eg. by a crash while one was being compressed). They could not be replaced while they were mapped for replay.
+*/
+static void finish_replay() {
+    unmap_replay_files();
+    if (replay_finished)
+        return;
+
+    replay_finished = true;
+    if (!read_only) {
+        seal_request.store(true, std::memory_order_release);
+        wake_writer();
+    }
+}
+
+/*
+    Check if a well formed record (a known operation with a good checksum) starts anywhere after a bad record in a segment.
+    Parameter 'record': The start of the bad record.
+    Parameter 'end': The end of the segment.
+*/
+static bool has_record_after(const char *record, const char *end) {
+    RecordHeader header;
+    for (const char *candidate = record + 1; static_cast<u64>(end - candidate) >= sizeof(header); ++candidate) {
+        std::memcpy(&header, candidate, sizeof(header));
+        if (header.operation > static_cast<u32>(Journal::Operation::RESTORE_MESSAGE) || header.length > JOURNAL_MAX_RECORD_LENGTH
+         || static_cast<u64>(end - candidate) - sizeof(header) < header.length)
+            continue;
+
+        if (Util::crc32c(candidate + sizeof(header), header.length, Util::crc32c(&header, offsetof(RecordHeader, checksum))) == header.checksum)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+    Recover from a record that could not be read back during replay. If it is in the segment being appended to, and nothing
+    readable follows it, it is the tail of a write torn by a crash (or corrupted after it): the segment is truncated to the last
+    good record before it, and appending continues from there. Anywhere else (an older segment, the snapshot, or the middle of the
+    newest segment) it is corruption that truncating cannot fix, and would throw acknowledged records away.
+    Parameter 'record': The start of the bad record in its mapped file.
+    Returns whether or not the journal was recovered. If so, replay is over.
+*/
+static bool recover_torn_tail(const char *record) {
+    const MappedFile &tail = replay_segments.at(replay_segments.size() - 1);
+    if (!tail.data || record < tail.data || record >= tail.data + tail.size)
+        return false;
+
+    // A complete record with a good checksum that still fails to decode was written that way (eg. by a newer version of the server).
+    // Truncating it would throw away good data.
+    RecordHeader header;
+    const u64 remaining = tail.data + tail.size - record;
+    if (remaining >= sizeof(header)) {
+        std::memcpy(&header, record, sizeof(header));
+        if (header.length <= remaining - sizeof(header)
+         && Util::crc32c(record + sizeof(header), header.length, Util::crc32c(&header, offsetof(RecordHeader, checksum))) == header.checksum)
+            return false;
+    }
+
+    const u64 good_size    = record - tail.data;
+    if (has_record_after(record, tail.data + tail.size)) {
+        ICHIGO_ERROR("Journal segment %llu has a corrupt record at offset %llu, followed by records that are still good. It is not a torn tail, so nothing was discarded.",
+                     static_cast<unsigned long long>(segments.at(segments.size() - 1).number), static_cast<unsigned long long>(good_size));
+        return false;
+    }
+
+    const u64 discarded    = tail.size - good_size;
+    const u64 tail_number  = segments.at(segments.size() - 1).number;
+    const u64 tail_position = segments.at(segments.size() - 1).start_position + good_size - segment_header_size;
+    torn_tail_bytes        = discarded;
+
+    if (read_only) {
+        discard_replay_chunks();
+        unmap_replay_files();
+        ICHIGO_ERROR("Journal segment %llu ends with a torn or corrupt record: the last %llu bytes from position %llu would be discarded by the server.",
+                     static_cast<unsigned long long>(tail_number), static_cast<unsigned long long>(discarded), static_cast<unsigned long long>(tail_position));
+        return true;
+    }
+
+    // The segment cannot be truncated while it is mapped, and the writer thread has to start over from the new end.
+    discard_replay_chunks();
+    unmap_replay_files();
+    stop_writer();
+    if (!ChatServer::platform_truncate_file(journal_file, good_size) || !ChatServer::platform_sync_file(journal_file)) {
+        ICHIGO_ERROR("Failed to truncate the torn tail of journal segment %llu", static_cast<unsigned long long>(tail_number));
+        return false;
+    }
+
+    segment_size = good_size;
+    start_writer();
+    ICHIGO_ERROR("Journal segment %llu ends with a torn or corrupt record (probably from a crash). Discarded the last %llu bytes from position %llu and continuing from there.",
+                 static_cast<unsigned long long>(tail_number), static_cast<unsigned long long>(discarded), static_cast<unsigned long long>(tail_position));
+    return true;
+}
+
+/*
+    Convert a journal in the old text format to the binary format. The text journal is kept next to the
+    new journal with a ".text" suffix. This only ever has to be done once per journal.
+    Parameter 'journal_filename': The path to the text journal. The binary journal is written in its place.
+    Returns whether or not the conversion succeeded.
+*/
+static bool convert_text_journal(const std::string &journal_filename) {
+    const std::string text_filename = journal_filename + ".text";
+    ICHIGO_INFO("Converting text journal %s to the binary format. The original is kept as %s", journal_filename.c_str(), text_filename.c_str());
+
+    if (ChatServer::platform_file_exists(text_filename.c_str())) {
+        ICHIGO_ERROR("%s already exists. Refusing to overwrite it.", text_filename.c_str());
+        return false;
+    }
+
+    if (std::rename(journal_filename.c_str(), text_filename.c_str()) != 0 || !LegacyJournal::open(text_filename)) {
+        ICHIGO_ERROR("Failed to move the text journal out of the way");
+        return false;
+    }
+
+    journal_file = ChatServer::platform_open_file(journal_filename, "w+b");
+    std::setvbuf(journal_file, file_buffer, _IOFBF, sizeof(file_buffer));
+    write_file_header(journal_file, JOURNAL_MAGIC, 0);
+
+    u32 converted = 0;
+    bool ret = true;
+    while (LegacyJournal::has_more_transactions()) {
+        Journal::Transaction *transaction = LegacyJournal::next_transaction();
+        if (!transaction) {
+            ICHIGO_ERROR("Failed to parse text journal record %u. The rest of the text journal was not converted.", converted);
+            ret = false;
+            break;
+        }
+
+        record_buffer.clear();
+        encode_transaction(transaction, record_buffer);
+        std::fwrite(record_buffer.data(), sizeof(char), record_buffer.length(), journal_file);
+        Journal::return_transaction(transaction);
+        ++converted;
+    }
+
+    LegacyJournal::close();
+    std::fflush(journal_file);
+    ChatServer::platform_sync_file(journal_file);
+    std::fclose(journal_file);
+    journal_file = nullptr;
+    ICHIGO_INFO("Converted %u records", converted);
+    return ret;
+}
+
+/*
+    Open the journal segments listed in the manifest, creating the manifest (and the first segment) if the journal is new
+    or was written as a single file. Every segment is mapped for replay.
+    In read-only mode nothing is created: a journal written as a single file is read in place, as segment number 0.
+    Returns whether or not the segments are valid and contiguous.
+*/
+static bool open_segments() {
+    const std::string manifest = manifest_path(journal_path);
+    Util::IchigoVector<u32> numbers;
+
+    if (read_only && !ChatServer::platform_file_exists(manifest.c_str())) {
+        if (!ChatServer::platform_file_exists(journal_path.c_str()))
+            return false;
+
+        numbers.append(0);
+    } else if (!ChatServer::platform_file_exists(manifest.c_str())) {
+        const std::string first_segment_path = segment_path(journal_path, 1);
+
+        if (ChatServer::platform_file_exists(journal_path.c_str())) {
+            // Journals written before the binary format existed do not start with the magic. Convert them before loading.
+            std::FILE *file = ChatServer::platform_open_file(journal_path, "rb");
+            char magic[8]{};
+            u64 magic_size = std::fread(magic, 1, sizeof(magic), file);
+            std::fclose(file);
+
+            if (magic_size > 0 && (magic_size < sizeof(magic) || std::memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0)) {
+                if (!convert_text_journal(journal_path))
+                    return false;
+            }
+
+            // A journal written as a single file becomes the first segment as is.
+            ICHIGO_INFO("Moving single file journal %s to %s", journal_path.c_str(), first_segment_path.c_str());
+            if (!ChatServer::platform_replace_file(journal_path, first_segment_path))
+                return false;
+        } else if (!ChatServer::platform_file_exists(first_segment_path.c_str())) {
+            std::FILE *file = ChatServer::platform_open_file(first_segment_path, "wb");
+            if (!file)
+                return false;
+
+            write_file_header(file, JOURNAL_MAGIC, 0);
+            ChatServer::platform_sync_file(file);
+            std::fclose(file);
+        }
+
+        Util::IchigoVector<Segment> first_segment;
+        first_segment.append({ 1, 0 });
+        if (!write_manifest(journal_path, first_segment))
+            return false;
+    }
+
+    if (numbers.size() == 0 && !read_manifest(journal_path, numbers)) {
+        ICHIGO_ERROR("Journal manifest is invalid");
+        return false;
+    }
+
+    u64 expected_start_position = 0;
+    for (u32 i = 0; i < numbers.size(); ++i) {
+        // Replay parses records straight out of read-only mappings of the segments instead of reading them through stdio.
+        replay_segments.append(map_file(numbers.at(i) == 0 ? journal_path : segment_path(journal_path, numbers.at(i))));
+        MappedFile &file = replay_segments.at(i);
+
+        u64 start_position;
+        u64 record_size;
+        segment_header_size = read_file_header(file, JOURNAL_MAGIC, &start_position);
+        if (segment_header_size > 0)
+            record_size = file.size - segment_header_size;
+        else
+            segment_header_size = read_compressed_header(file, &start_position, &record_size);
+
+        if (segment_header_size == 0) {
+            ICHIGO_ERROR("Journal segment %u has an invalid header or an unsupported version", numbers.at(i));
+            return false;
+        }
+
+        // Only sealed segments are compressed. The newest one is appended to (and its torn tail truncated) as is.
+        if (file.compressed && i + 1 == numbers.size()) {
+            ICHIGO_ERROR("The newest journal segment (%u) is compressed", numbers.at(i));
+            return false;
+        }
+
+        if (i > 0 && start_position != expected_start_position) {
+            ICHIGO_ERROR("Journal segment %u starts at position %llu, but the previous segment ends at %llu", numbers.at(i),
+                         static_cast<unsigned long long>(start_position), static_cast<unsigned long long>(expected_start_position));
+            return false;
+        }
+
+        file.base_position      = file.compressed ? start_position : start_position - segment_header_size;
+        segments.append({ numbers.at(i), start_position });
+        segment_size            = file.size;
+        expected_start_position = start_position + record_size;
+    }
+
+    if (read_only)
+        return true;
+
+    // Appends go to the last segment. Its remaining space is preallocated like a fresh segment's.
+    journal_file = ChatServer::platform_open_file(segment_path(journal_path, numbers.at(numbers.size() - 1)), "ab");
+    if (!journal_file)
+        return false;
+
+    std::setvbuf(journal_file, file_buffer, _IOFBF, sizeof(file_buffer));
+    ChatServer::platform_preallocate_file(journal_file, segment_size_limit);
+    return true;
+}
+
+/*
+    Open the journal segments and the snapshot, and start decoding them for replay. Shared by 'Journal::init()' and 'Journal::open_read_only()'.
+    Parameter 'journal_filename', 'snapshot_filename': See 'Journal::init()'.
+    Returns whether or not the journal and snapshot are valid.
+*/
+static bool open_for_replay(const std::string &journal_filename, const std::string &snapshot_filename) {
+    journal_path    = journal_filename;
+    snapshot_path   = snapshot_filename;
+    torn_tail_bytes = 0;
+
+    if (!open_segments()) {
+        ICHIGO_ERROR("Failed to open the journal");
+        return false;
+    }
+
+    // Without a snapshot, replay covers every live segment.
+    const u64 start_position  = segments.at(0).start_position;
+    snapshot_durable_position = start_position;
+    if (!snapshot_filename.empty() && ChatServer::platform_file_exists(snapshot_filename.c_str())) {
+        replay_snapshot = map_file(snapshot_filename);
+        if (SnapshotImage::is_image(replay_snapshot.data, replay_snapshot.size)) {
+            if (!replay_image.open(replay_snapshot.data, replay_snapshot.size, &snapshot_durable_position)) {
+                ICHIGO_ERROR("Snapshot image has an invalid header or an unsupported version");
+                return false;
+            }
+
+            replay_snapshot.position = replay_snapshot.size;
+        } else if (read_file_header(replay_snapshot, SNAPSHOT_MAGIC, &snapshot_durable_position) == 0) {
+            ICHIGO_ERROR("Snapshot file has an invalid header or an unsupported version");
+            return false;
+        }
+    }
+
+    // The snapshot must have been taken somewhere within the journal, otherwise there is a gap in the history.
+    if (snapshot_durable_position < start_position || snapshot_durable_position > journal_end_position()) {
+        ICHIGO_ERROR("Snapshot position %llu is outside of the journal (%llu to %llu)", static_cast<unsigned long long>(snapshot_durable_position),
+                     static_cast<unsigned long long>(start_position), static_cast<unsigned long long>(journal_end_position()));
+        return false;
+    }
+
+    // Replay continues from the snapshot position in the last segment that starts at or before it. Earlier segments are not needed.
+    u32 first_replay_segment = 0;
+    while (first_replay_segment + 1 < segments.size() && segments.at(first_replay_segment + 1).start_position <= snapshot_durable_position)
+        ++first_replay_segment;
+
+    for (u32 i = 0; i < first_replay_segment; ++i)
+        unmap_file(replay_segments.at(i));
+
+    MappedFile &first_replay_file = replay_segments.at(first_replay_segment);
+    if (first_replay_file.compressed)
+        skip_compressed_records(first_replay_file, snapshot_durable_position - segments.at(first_replay_segment).start_position);
+    else
+        first_replay_file.position += snapshot_durable_position - segments.at(first_replay_segment).start_position;
+
+    // Replay starts decoding right away, so reading ahead works from a copy of where each segment starts.
+    for (u32 i = first_replay_segment; i < replay_segments.size(); ++i)
+        read_ahead_segments.append(replay_segments.at(i));
+
+    snapshot_attempt_position = snapshot_durable_position;
+    replayed_position         = snapshot_durable_position;
+    replay_thread_count       = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+    schedule_replay_chunks();
+    return true;
+}
+
+void Journal::init(const std::string &journal_filename, const std::string &snapshot_filename) {
+    if (!open_for_replay(journal_filename, snapshot_filename)) {
+        invalid_file = true;
+        return;
+    }
+
+    const u64 start_position = segments.at(0).start_position;
+    ring = new char[JOURNAL_RING_SIZE];
+    spare_segment_thread = std::thread(create_spare_segment, segments.at(segments.size() - 1).number + 1);
+    start_writer();
+    ICHIGO_INFO("Journal loaded: %u segments (positions %llu to %llu), replaying %s from position %llu\n", static_cast<u32>(segments.size()),
+                static_cast<unsigned long long>(start_position), static_cast<unsigned long long>(journal_end_position()),
+                replay_snapshot.data ? "snapshot" : "journal", static_cast<unsigned long long>(snapshot_durable_position));
+}
+
+bool Journal::open_read_only(const std::string &journal_filename, const std::string &snapshot_filename) {
+    read_only = true;
+    if (!open_for_replay(journal_filename, snapshot_filename)) {
+        invalid_file = true;
+        return false;
+    }
+
+    return true;
+}
+
+u64 Journal::torn_tail_size() {
+    return torn_tail_bytes;
+}
+
+std::FILE *Journal::create_journal_file(const std::string &path) {
+    if (ChatServer::platform_file_exists(path.c_str()))
+        return nullptr;
+
+    std::FILE *file = ChatServer::platform_open_file(path, "wb");
+    if (file)
+        write_file_header(file, JOURNAL_MAGIC, 0);
+
+    return file;
+}
+
+void Journal::deinit() {
+    if (snapshot_thread.joinable())
+        snapshot_thread.join();
+
+    discard_replay_chunks();
+    unmap_replay_files();
+
+    // Whatever the durability mode, a clean shutdown syncs everything that was committed. A segment still being compressed is
+    // left as it is, to be compressed after the next start.
+    seal_stop.store(true, std::memory_order_relaxed);
+    stop_writer();
+    if (seal_thread.joinable())
+        seal_thread.join();
+
+    if (journal_file) {
+        discard_spare_segment();
+        std::fclose(journal_file);
+    }
+
+    delete[] ring;
+    ring          = nullptr;
+    journal_file  = nullptr;
+    invalid_file  = false;
+    read_only     = false;
+    replay_finished = false;
+    segments.clear();
+    snapshot_builder.clear();
+    snapshot_buffer.clear();
+    snapshot_begun = false;
+    unsynced      = false;
+    write_failed  = false;
+    writer_stop.store(false, std::memory_order_relaxed);
+    seal_stop.store(false, std::memory_order_relaxed);
+    seal_request.store(false, std::memory_order_relaxed);
+    backup_state.store(BackupState::IDLE, std::memory_order_relaxed);
+    sync_failed.store(false, std::memory_order_relaxed);
+    compact_request.store(0, std::memory_order_relaxed);
+    completed_head.store(0, std::memory_order_relaxed);
+    completed_tail.store(0, std::memory_order_relaxed);
+    has_unreported_batch = false;
+}
+
+void Journal::destroy(const std::string &journal_filename, const std::string &snapshot_filename) {
+    Util::IchigoVector<u32> numbers;
+    if (read_manifest(journal_filename, numbers)) {
+        for (u32 i = 0; i < numbers.size(); ++i) {
+            std::remove(segment_path(journal_filename, numbers.at(i)).c_str());
+            std::remove((segment_path(journal_filename, numbers.at(i)) + ".tmp").c_str());
+        }
+    }
+
+    std::remove(manifest_path(journal_filename).c_str());
+    std::remove(journal_filename.c_str());
+    std::remove(snapshot_filename.c_str());
+}
+
+bool Journal::rename(const std::string &journal_filename, const std::string &snapshot_filename, const std::string &new_journal_filename,
+                     const std::string &new_snapshot_filename) {
+    Util::IchigoVector<u32> numbers;
+    if (!read_manifest(journal_filename, numbers))
+        return false;
+
+    Journal::destroy(new_journal_filename, new_snapshot_filename);
+    for (u32 i = 0; i < numbers.size(); ++i) {
+        if (std::rename(segment_path(journal_filename, numbers.at(i)).c_str(), segment_path(new_journal_filename, numbers.at(i)).c_str()) != 0)
+            return false;
+    }
+
+    if (ChatServer::platform_file_exists(snapshot_filename.c_str()) && std::rename(snapshot_filename.c_str(), new_snapshot_filename.c_str()) != 0)
+        return false;
+
+    return std::rename(manifest_path(journal_filename).c_str(), manifest_path(new_journal_filename).c_str()) == 0;
+}
+
+/*
+    Reserve space for a record in the commit ring, waiting only if the writer thread has fallen behind by the size of the whole ring.
+    Parameter 'length': The length of the record.
+    Returns the ring position to write the record to. It is committed with 'publish_ring_record()'.
+*/
+static u64 reserve_ring(u64 length) {
+    const u64 head = ring_head.load(std::memory_order_relaxed);
+    for (u64 tail = ring_tail.load(std::memory_order_acquire); head + length - tail > JOURNAL_RING_SIZE; tail = ring_tail.load(std::memory_order_acquire)) {
+        wake_writer();
+        ring_tail.wait(tail, std::memory_order_acquire);
+    }
+
+    return head;
+}
+
+/*
+    Hand a record written to the space reserved by 'reserve_ring()' to the commit observer and the writer thread.
+    Parameter 'head': The ring position the record was written to.
+    Parameter 'length': The length of the record.
+*/
+static void publish_ring_record(u64 head, u64 length) {
+    if (commit_observer) {
+        // The observer gets the record in one piece, so a record that wraps around the end of the ring is put back together first.
+        const u64 offset = head & (JOURNAL_RING_SIZE - 1);
+        if (length <= JOURNAL_RING_SIZE - offset) {
+            commit_observer(ring + offset, length);
+        } else {
+            record_buffer.assign(ring + offset, JOURNAL_RING_SIZE - offset);
+            record_buffer.append(ring, length - (JOURNAL_RING_SIZE - offset));
+            commit_observer(record_buffer.data(), length);
+        }
+    }
+
+    ring_head.store(head + length, std::memory_order_release);
+
+    // Have a very large batch written as it grows. The records still only become durable after 'flush()'.
+    if (head + length - writer_woken_position >= JOURNAL_MAX_BATCH_SIZE) {
+        writer_woken_position = head + length;
+        wake_writer();
+    }
+}
+
+bool Journal::commit_transaction(const Transaction *transaction) {
+    if (invalid_file) {
+        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
+        return true;
+    }
+
+    assert(!Journal::has_more_transactions() && !read_only);
+
+    // Replay refuses records over the limit (it could not tell them from a corrupt length), so they must never be written.
+    const u64 length = payload_size(transaction);
+    if (length > JOURNAL_MAX_RECORD_LENGTH) {
+        ICHIGO_ERROR("Refusing to commit a %llu byte journal record, over the limit of %u bytes", static_cast<unsigned long long>(length), JOURNAL_MAX_RECORD_LENGTH);
+        return false;
+    }
+
+    // The record is encoded straight into the ring. Only the checksum needs a second look at the payload.
+    const u64 head = reserve_ring(sizeof(RecordHeader) + length);
+    RingOutput out{head + sizeof(RecordHeader)};
+    encode_payload(transaction, out);
+
+    RecordHeader header  = make_record_header(transaction->operation(), length);
+    const u64 offset     = (head + sizeof(RecordHeader)) & (JOURNAL_RING_SIZE - 1);
+    const u64 first      = length < JOURNAL_RING_SIZE - offset ? length : JOURNAL_RING_SIZE - offset;
+    header.checksum      = Util::crc32c(ring + offset, first, header.checksum);
+    header.checksum      = Util::crc32c(ring, length - first, header.checksum);
+    ring_copy(head, &header, sizeof(header));
+
+    publish_ring_record(head, sizeof(RecordHeader) + length);
+    return true;
+}
+
+void Journal::commit_record(const char *record, u64 length) {
+    if (invalid_file) {
+        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
+        return;
+    }
+
+    assert(!Journal::has_more_transactions() && !read_only);
+    const u64 head = reserve_ring(length);
+    ring_copy(head, record, length);
+    publish_ring_record(head, length);
+}
+
+u64 Journal::flush() {
+    const u64 head = ring_head.load(std::memory_order_relaxed);
+
+    // Without a journal there is nothing to wait for. The batch completes right away.
+    if (invalid_file) {
+        complete_batch(head, true);
+        return head;
+    }
+
+    if (head == flush_request.load(std::memory_order_relaxed))
+        return head;
+
+    writer_woken_position = head;
+    flush_request.store(head, std::memory_order_release);
+    wake_writer();
+    return head;
+}
+
+bool Journal::next_completed_batch(CompletedBatch *batch) {
+    const u64 tail = completed_tail.load(std::memory_order_relaxed);
+    const u64 head = completed_head.load(std::memory_order_acquire);
+    if (tail == head)
+        return false;
+
+    *batch = completed_batches[tail % JOURNAL_COMPLETED_BATCH_COUNT];
+    completed_tail.store(tail + 1, std::memory_order_release);
+
+    // The writer thread holds on to completed batches while there is no room. Let it report them now.
+    if (head - tail == JOURNAL_COMPLETED_BATCH_COUNT)
+        wake_writer();
+
+    return true;
+}
+
+void Journal::set_commit_observer(void (*observer)(const char *record, u64 length)) {
+    commit_observer = observer;
+}
+
+void Journal::encode_record(const Transaction *transaction, std::string &out) {
+    encode_transaction(transaction, out);
+}
+
+bool Journal::decode_record(const char *data, u64 length, u64 *record_length, Record *record) {
+    RecordHeader header;
+    *record_length = 0;
+    if (length < sizeof(header))
+        return false;
+
+    std::memcpy(&header, data, sizeof(header));
+    if (header.length <= JOURNAL_MAX_RECORD_LENGTH && length - sizeof(header) < header.length)
+        return false;
+
+    // The record is all there (or its length is implausible, which 'read_record()' reports).
+    MappedFile buffer = records_view(data, length, 0, 0);
+    const bool ret    = read_record(buffer, record);
+    *record_length    = sizeof(header) + header.length;
+    return ret;
+}
+
+void Journal::set_durability(Durability mode, u32 interval_ms) {
+    durability_mode.store(mode, std::memory_order_relaxed);
+    sync_interval_ms.store(interval_ms, std::memory_order_relaxed);
+}
+
+void Journal::set_segment_size(u64 size) {
+    segment_size_limit = size;
+}
+
+void Journal::set_segment_compression(bool enabled) {
+    segment_compression = enabled;
+}
+
+u64 Journal::bytes_since_snapshot() {
+    if (invalid_file)
+        return 0;
+
+    return ring_head.load(std::memory_order_relaxed) - snapshot_attempt_position;
+}
+
+bool Journal::snapshot_in_progress() {
+    return snapshot_begun || snapshot_thread.joinable();
+}
+
+void Journal::begin_snapshot() {
+    assert(!Journal::has_more_transactions() && !Journal::snapshot_in_progress() && !Journal::backup_in_progress());
+
+    if (invalid_file)
+        return;
+
+    // The snapshot is not moved into place until the journal is synced up to the snapshot position (see 'write_snapshot()').
+    snapshot_attempt_position = ring_head.load(std::memory_order_relaxed);
+    sync_request.store(snapshot_attempt_position, std::memory_order_release);
+    rotate_request.store(snapshot_attempt_position, std::memory_order_release);
+    Journal::flush();
+    wake_writer();
+    snapshot_builder.clear();
+    snapshot_begun = true;
+}
+
+void Journal::snapshot_transaction(const Transaction *transaction) {
+    snapshot_builder.add(transaction);
+}
+
+void Journal::finish_snapshot() {
+    snapshot_begun = false;
+    if (invalid_file)
+        return;
+
+    ICHIGO_INFO("Writing snapshot at journal position %llu (%u users, %u groups, %u messages)", static_cast<unsigned long long>(snapshot_attempt_position),
+                snapshot_builder.user_count(), snapshot_builder.group_count(), snapshot_builder.message_count());
+    snapshot_done.store(false, std::memory_order_relaxed);
+    snapshot_thread = std::thread(write_snapshot);
+}
+
+void Journal::poll_snapshot() {
+    if (invalid_file)
+        return;
+
+    if (snapshot_thread.joinable()) {
+        if (!snapshot_done.load(std::memory_order_acquire))
+            return;
+
+        snapshot_thread.join();
+        if (snapshot_succeeded) {
+            ICHIGO_INFO("Snapshot at journal position %llu is durable", static_cast<unsigned long long>(snapshot_attempt_position));
+            snapshot_durable_position = snapshot_attempt_position;
+        } else {
+            ICHIGO_ERROR("Failed to write snapshot. The journal will not be compacted until the next snapshot succeeds.");
+        }
+
+        snapshot_builder.clear();
+        snapshot_buffer.clear();
+        snapshot_buffer.shrink_to_fit();
+    }
+
+    // Also picks up a snapshot that became durable right before a crash, before the journal could be compacted.
+    if (!Journal::has_more_transactions() && compact_request.load(std::memory_order_relaxed) != snapshot_durable_position) {
+        compact_request.store(snapshot_durable_position, std::memory_order_release);
+        wake_writer();
+    }
+}
+
+bool Journal::backup_in_progress() {
+    return backup_state.load(std::memory_order_acquire) != BackupState::IDLE;
+}
+
+bool Journal::begin_backup(const std::string &journal_filename, const std::string &snapshot_filename, u64 *position) {
+    assert(!Journal::snapshot_in_progress());
+
+    if (invalid_file || read_only || Journal::backup_in_progress() || journal_filename == journal_path || snapshot_filename == snapshot_path)
+        return false;
+
+    // Like a snapshot, the backup waits for the journal to be synced up to its position, whatever the durability mode.
+    backup_journal_path  = journal_filename;
+    backup_snapshot_path = snapshot_filename;
+    backup_position      = ring_head.load(std::memory_order_relaxed);
+    *position            = backup_position;
+    sync_request.store(backup_position, std::memory_order_release);
+    backup_state.store(BackupState::REQUESTED, std::memory_order_release);
+    Journal::flush();
+    wake_writer();
+    ICHIGO_INFO("Backing up the journal up to position %llu to %s", static_cast<unsigned long long>(backup_position), journal_filename.c_str());
+    return true;
+}
+
+bool Journal::poll_backup(bool *succeeded) {
+    if (backup_state.load(std::memory_order_acquire) != BackupState::DONE)
+        return false;
+
+    *succeeded = backup_succeeded;
+    if (!backup_succeeded)
+        ICHIGO_ERROR("Failed to back up the journal to %s", backup_journal_path.c_str());
+
+    backup_state.store(BackupState::IDLE, std::memory_order_relaxed);
+    return true;
+}
+
+bool Journal::next_record(Record *record) {
+    if (invalid_file) {
+        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
+        return false;
+    }
+
+    // Otherwise 'has_more_transactions()' only returned true because a record failed to decode and the journal could not be recovered.
+    bool ret = false;
+    if (replay_image.has_more()) {
+        ret = replay_image.next(record);
+    } else if (replay_thread_count == 1) {
+        if (has_replay_record) {
+            *record           = replay_record;
+            has_replay_record = false;
+            replayed_position = replay_record_position;
+            ret               = true;
+        }
+    } else if (replay_chunk_index < replay_chunk.records.size()) {
+        if (replay_chunk.start_position != NO_JOURNAL_POSITION)
+            replayed_position += replay_chunk.record_lengths.at(replay_chunk_index);
+
+        *record = replay_chunk.records.at(replay_chunk_index++);
+        ret     = true;
+    }
+
+    if (!ret) {
+        invalid_file = true;
+        discard_replay_chunks();
+        stop_writer();
+    }
+
+    return ret;
+}
+
+Journal::Transaction *Journal::next_transaction() {
+    Record record;
+    if (!next_record(&record))
+        return nullptr;
+
+    return std::visit([](const auto &record) { return make_transaction(record); }, record);
+}
+
+void Journal::return_transaction(Transaction *transaction) {
+    delete transaction;
+}
+
+void Journal::snapshot_counts(u32 *user_count, u32 *group_count, u32 *message_count) {
+    *user_count    = replay_image.image_layout().user_count;
+    *group_count   = replay_image.image_layout().group_count;
+    *message_count = replay_image.image_layout().message_count;
+}
+
+void Journal::read_ahead(void (*apply)(const Record &record)) {
+    std::string block_buffer;
+    for (u32 i = 0; i < read_ahead_segments.size(); ++i) {
+        MappedFile file = read_ahead_segments.at(i);
+        if (!file.compressed) {
+            if (!read_ahead_records(file, apply))
+                break;
+
+            continue;
+        }
+
+        while (file.position < file.size) {
+            const CompressedBlock block = next_compressed_block(file);
+            block_buffer.resize(block.record_size);
+            if (file.skip > block.record_size
+             || !Compression::decompress(file.dictionary, block.data, block.compressed_size, block_buffer.data(), block.record_size))
+                return;
+
+            MappedFile records = records_view(block_buffer.data(), block_buffer.length(), file.skip, block.start_position);
+            file.skip = 0;
+            if (!read_ahead_records(records, apply))
+                return;
+        }
+    }
+
+    read_ahead_segments.clear();
+}
+
+u64 Journal::replay_position() {
+    return replayed_position;
+}
+
+bool Journal::has_more_transactions() {
+    if (invalid_file) {
+        ICHIGO_ERROR("Invalid journal file provided: the server is operating without a journal!");
+        return false;
+    }
+
+    // The snapshot is replayed first, then the journal from the position the snapshot was taken at.
+    // Records are decoded ahead of 'next_record()', so that a torn tail is found (and recovered from) here. Records of a snapshot
+    // image are read in place, as they are handed out.
+    if (replay_image.has_more())
+        return true;
+
+    if (replay_thread_count == 1) {
+        if (has_replay_record)
+            return true;
+
+        MappedFile *file = next_replay_records();
+        if (!file) {
+            finish_replay();
+            return false;
+        }
+
+        has_replay_record = read_record(*file, &replay_record);
+        if (has_replay_record) {
+            replay_record_position = file == &replay_snapshot ? snapshot_durable_position : file->base_position + file->position;
+            return true;
+        }
+
+        if (!recover_torn_tail(file->data + file->position))
+            return true;
+
+        finish_replay();
+        return false;
+    }
+
+    // Chunks are decoded in parallel but handed out strictly in order.
+    while (replay_chunk_index == replay_chunk.records.size() && !replay_chunk.failed) {
+        if (replay_chunks.empty()) {
+            finish_replay();
+            return false;
+        }
+
+        replay_chunk       = replay_chunks.front().get();
+        replay_chunk_index = 0;
+        replay_chunks.pop_front();
+        if (replay_chunk.start_position != NO_JOURNAL_POSITION)
+            replayed_position = replay_chunk.start_position;
+
+        schedule_replay_chunks();
+    }
+
+    if (replay_chunk_index == replay_chunk.records.size() && recover_torn_tail(replay_chunk.failed_record)) {
+        finish_replay();
+        return false;
     }
 
-    std::fseek(journal_file, pos, SEEK_SET);
     return true;
 }
@@ -3,14 +3,32 @@
     Provides functions to read transactions to rebuild the state of the server, and functions to commit
     new transactions to the journal file.
 
+    The journal is stored as a series of size-bounded segment files listed in a manifest. Appends go to the
+    newest segment; once it is full the journal moves on to a new one.
+
+    Committed transactions are written to disk by a dedicated writer thread, so committing and flushing never wait on
+    the disk. The server finds out that a batch is durable by polling 'next_completed_batch()'.
+
+    The server state is periodically written out as a snapshot: the set of transactions that rebuild the state
+    as of some position in the journal, laid out as an image that replay reads in place (see snapshot_image.hpp).
+    Replay reads the latest snapshot followed by the journal from that position,
+    and segments that only hold records before that position are deleted. The journal starts a new segment at the
+    snapshot position, so that is every record before it: deleted messages (which are not in the snapshot) and their
+    DELETE_MESSAGE records are then gone from disk, and never replayed again.
+
+    A backup of a running server is taken from the latest snapshot and the journal after it, copied in the background
+    (see 'begin_backup()'), so the server never stops to take it.
+
     Author: Braeden Hong
-      Date: November 11, 2023 - November 12, 2023
+      Date: November 11, 2023 - October 17, 2026
 */
 
 #pragma once
 
 #include "../common.hpp"
 #include "chat_server.hpp"
+#include <string_view>
+#include <variant>
 
 namespace Journal {
     /*
@@ -22,6 +40,31 @@ namespace Journal {
         DELETE_MESSAGE,
         UPDATE_ID,
         NEW_GROUP,
+        RESTORE_MESSAGE,
+    };
+
+    /*
+        Enum defining when committed transactions are made durable (synced to stable storage).
+
+        SYNC:     Every batch is synced before it is reported complete. Nothing acknowledged is ever lost.
+        INTERVAL: Batches are handed to the OS as they are flushed and synced at most every N milliseconds.
+                  A crash (of the machine, not the server) can lose up to N milliseconds of acknowledged transactions.
+        NONE:     Batches are handed to the OS as they are flushed and never explicitly synced.
+    */
+    enum class Durability {
+        SYNC,
+        INTERVAL,
+        NONE,
+    };
+
+    /*
+        A batch of transactions that the writer thread is done with (see 'flush()').
+        'end_position' is what 'flush()' returned for the batch. A report may cover several batches, in which case it has the end position of
+        the last one. 'durable' is whether or not all of them met the guarantee of the durability mode.
+    */
+    struct CompletedBatch {
+        u64 end_position;
+        bool durable;
     };
 
     /*
@@ -43,7 +86,7 @@ namespace Journal {
     */
     class NewUserTransaction : public Transaction {
     public:
-        explicit NewUserTransaction(const std::string &username) : m_username(username) {}
+        explicit NewUserTransaction(std::string_view username) : m_username(username) {}
         Operation operation() const override { return Operation::NEW_USER; }
         const std::string &username() const { return m_username; }
     private:
@@ -55,21 +98,33 @@ namespace Journal {
         Implements Transaction.
 
         Contains the username of the sender, the name of the user or group that the message is being sent to,
-        the type of recipient (user or group), and the content of the message.
+        the type of recipient (user or group), the content of the message, the digest and name of the
+        attachment (both empty if there is none), and the ID of the message. A message to a group gets consecutive IDs
+        starting at this ID, one per member. The ID is -1 for messages journaled before IDs were leased in blocks; those
+        take their ID from the preceding UPDATE_ID transaction instead.
+        Attachment contents live in the blob store, not the journal.
     */
     class NewMessageTransaction : public Transaction {
     public:
-        explicit NewMessageTransaction(const std::string &sender_username, const std::string &recipient, u32 recipient_type, const std::string &content) : m_sender(sender_username), m_recipient(recipient), m_recipient_type(recipient_type), m_content(content) {}
+        explicit NewMessageTransaction(std::string_view sender_username, std::string_view recipient, u32 recipient_type, std::string_view content,
+                                       std::string_view attachment_digest = "", std::string_view attachment_name = "", i32 id = -1)
+            : m_sender(sender_username), m_recipient(recipient), m_recipient_type(recipient_type), m_content(content), m_attachment_digest(attachment_digest), m_attachment_name(attachment_name), m_id(id) {}
         Operation operation() const override { return Operation::NEW_MESSAGE; }
         const std::string &sender() const { return m_sender; }
         const std::string &recipient() const { return m_recipient; }
         u32 recipient_type() const { return m_recipient_type; }
         const std::string &content() const { return m_content; }
+        const std::string &attachment_digest() const { return m_attachment_digest; }
+        const std::string &attachment_name() const { return m_attachment_name; }
+        i32 id() const { return m_id; }
     private:
         std::string m_sender;
         std::string m_recipient;
         u32 m_recipient_type;
         std::string m_content;
+        std::string m_attachment_digest;
+        std::string m_attachment_name;
+        i32 m_id;
     };
 
     /*
@@ -80,7 +135,9 @@ namespace Journal {
     */
     class NewGroupTransaction : public Transaction {
     public:
-        explicit NewGroupTransaction(const std::string &group_name, Util::IchigoVector<std::string> group_users) : m_group_name(group_name), m_group_users(group_users) {}
+        // Specialization for allowing the vector of usernames to be moved instead of copied to the transaction.
+        explicit NewGroupTransaction(std::string_view group_name, Util::IchigoVector<std::string> &&group_users)      : m_group_name(group_name), m_group_users(std::move(group_users)) {}
+        explicit NewGroupTransaction(std::string_view group_name, const Util::IchigoVector<std::string> &group_users) : m_group_name(group_name), m_group_users(group_users) {}
         Operation operation() const override { return Operation::NEW_GROUP; }
         const std::string &name() const { return m_group_name; }
         u32 user_count() const { return m_group_users.size(); }
@@ -109,7 +166,8 @@ namespace Journal {
         Transaction representing the altering of the ID of the next transaction.
         Implements Transaction.
 
-        Contains the ID of the next transaction.
+        Contains the ID of the next transaction. IDs are leased in blocks, so this is a high-water mark: no ID
+        greater than it has been handed out, and the server continues after it on restart.
     */
     class UpdateIdTransaction : public Transaction {
     public:
@@ -121,30 +179,314 @@ namespace Journal {
     };
 
     /*
-        Initialize the journal module. Opens the journal file for reading/writing
-        (creating if it does not exist), and calculates its filesize.
+        Transaction representing a message that already existed when a snapshot was taken. Only found in snapshots, and in
+        journals rewritten by 'chatjournal compact' (see chatjournal.cpp).
+        Implements Transaction.
 
-        Parameter 'journal_filename': The path to the journal file.
+        Unlike NewMessageTransaction, this is always addressed to a single user and carries the ID of the message.
     */
-    void init(const std::string &journal_filename);
+    class RestoreMessageTransaction : public Transaction {
+    public:
+        explicit RestoreMessageTransaction(u32 id, std::string_view sender_username, std::string_view recipient_username, std::string_view content,
+                                           std::string_view attachment_digest, std::string_view attachment_name)
+            : m_id(id), m_sender(sender_username), m_recipient(recipient_username), m_content(content), m_attachment_digest(attachment_digest), m_attachment_name(attachment_name) {}
+        Operation operation() const override { return Operation::RESTORE_MESSAGE; }
+        u32 id() const { return m_id; }
+        const std::string &sender() const { return m_sender; }
+        const std::string &recipient() const { return m_recipient; }
+        const std::string &content() const { return m_content; }
+        const std::string &attachment_digest() const { return m_attachment_digest; }
+        const std::string &attachment_name() const { return m_attachment_name; }
+    private:
+        u32 m_id;
+        std::string m_sender;
+        std::string m_recipient;
+        std::string m_content;
+        std::string m_attachment_digest;
+        std::string m_attachment_name;
+    };
+
+    /*
+        Records read back from the journal, as views of the encoded records. Replay hands these out instead of transactions, so that
+        reading a record never allocates: strings point into the journal (or a buffer holding a decompressed part of it) and are only
+        valid until the next call to 'has_more_transactions()' or 'next_record()'. Anything kept must be copied.
+        The fields are the same as those of the matching transactions above.
+    */
+    struct NewUserRecord {
+        std::string_view username;
+    };
+
+    struct NewMessageRecord {
+        std::string_view sender;
+        u32 recipient_type;
+        std::string_view recipient;
+        std::string_view content;
+        std::string_view attachment_digest;
+        std::string_view attachment_name;
+        i32 id;
+    };
+
+    struct DeleteMessageRecord {
+        u32 id;
+    };
+
+    struct UpdateIdRecord {
+        u32 id;
+    };
+
+    /*
+        The usernames of a group are left encoded (each a u32 length followed by the name), and read with 'next_user()'.
+    */
+    struct NewGroupRecord {
+        std::string_view name;
+        u32 user_count;
+        std::string_view encoded_users;
+
+        /*
+            Read the next username of the group.
+            Parameter 'offset': Where to read from in 'encoded_users'. Start at 0; it is moved past the username.
+            Returns the username. Must not be called more than 'user_count' times.
+        */
+        std::string_view next_user(u32 *offset) const;
+    };
+
+    struct RestoreMessageRecord {
+        u32 id;
+        std::string_view sender;
+        std::string_view recipient;
+        std::string_view content;
+        std::string_view attachment_digest;
+        std::string_view attachment_name;
+    };
+
+    /*
+        A record read back from the journal. The alternatives are in the same order as the operations, see 'operation()'.
+    */
+    using Record = std::variant<NewUserRecord, NewMessageRecord, DeleteMessageRecord, UpdateIdRecord, NewGroupRecord, RestoreMessageRecord>;
+
+    /*
+        Get the type of operation that a record represents.
+    */
+    inline Operation operation(const Record &record) { return static_cast<Operation>(record.index()); }
+
+    /*
+        Initialize the journal module. Opens the journal segments for reading/writing (creating the journal if it
+        does not exist). Segments are named "<journal_filename>.000001", "<journal_filename>.000002", ... and are listed
+        in "<journal_filename>.manifest". Segments the journal has moved on from are compressed in the background.
+        A journal written as a single file at 'journal_filename' becomes the first segment. If it was written in the
+        old text format, it is converted to the binary format first and the text journal is kept with a ".text" suffix.
+        If a snapshot exists, replay starts with the snapshot and continues with the journal from the position the
+        snapshot was taken at.
+        If the newest segment ends with a torn or corrupt record (eg. from a crash in the middle of a write), replay stops
+        before it, the segment is truncated to the last good record, and new transactions are appended from there.
+
+        Parameter 'journal_filename': The base path of the journal.
+        Parameter 'snapshot_filename': The path to the snapshot file.
+    */
+    void init(const std::string &journal_filename, const std::string &snapshot_filename);
 
     /*
         Closes the journal file.
     */
     void deinit();
 
+    /*
+        Open a journal for reading only (eg. by offline tools). Replay works as after 'init()', but nothing is ever written:
+        a missing journal is not created, a text journal is not converted, a journal written as a single file is read in
+        place, and a torn tail is reported (see 'torn_tail_size()') but not truncated. Transactions cannot be committed.
+        Close with 'deinit()'.
+        Parameter 'journal_filename': The base path of the journal.
+        Parameter 'snapshot_filename': The path to a snapshot to replay first, or an empty string to replay every live segment instead.
+        Returns whether or not the journal (and snapshot) could be opened.
+    */
+    bool open_read_only(const std::string &journal_filename, const std::string &snapshot_filename);
+
+    /*
+        Get the number of bytes of torn or corrupt records that replay found at the end of the journal. 'init()' truncates
+        them; 'open_read_only()' leaves them in place.
+    */
+    u64 torn_tail_size();
+
+    /*
+        Create a new journal written as a single file (eg. by offline tools rewriting a journal). The server makes it the
+        first segment when it opens the journal. Append records encoded with 'encode_record()', then close it with std::fclose().
+        Parameter 'path': The path of the journal to create. Must not exist.
+        Returns the file, or nullptr if it exists or could not be created.
+    */
+    std::FILE *create_journal_file(const std::string &path);
+
+    /*
+        Delete a journal (every segment and the manifest) and its snapshot. The journal must not be open.
+        Parameter 'journal_filename': The base path of the journal.
+        Parameter 'snapshot_filename': The path to the snapshot file.
+    */
+    void destroy(const std::string &journal_filename, const std::string &snapshot_filename);
+
+    /*
+        Move a journal (every segment and the manifest) and its snapshot to another name, replacing the journal by that name.
+        Neither journal may be open. The manifest is moved last, so a journal only exists under the new name once all of it is there.
+        Parameter 'journal_filename': The base path of the journal.
+        Parameter 'snapshot_filename': The path to the snapshot file.
+        Parameter 'new_journal_filename': The base path to move the journal to.
+        Parameter 'new_snapshot_filename': The path to move the snapshot to.
+        Returns whether or not the journal was moved.
+    */
+    bool rename(const std::string &journal_filename, const std::string &snapshot_filename, const std::string &new_journal_filename,
+                const std::string &new_snapshot_filename);
+
     /*
         Commit a new transaction to the journal file. Can only be called after 'has_more_transactions()'
         returns false.
+        The transaction is added to the current batch. It is not durable until the batch is flushed and reported complete.
+        Only waits if the writer thread has fallen a long way (32MB of records) behind.
 
         Parameter 'transaction': The transaction to commit.
+        Returns false if the transaction is too large to be journaled (its record would be over 16MB), in which case it is not committed.
     */
-    void commit_transaction(const Transaction *transaction);
+    bool commit_transaction(const Transaction *transaction);
 
     /*
-        Read back the next transaction from the journal file. Can only be called when 'has_more_transactions()'
+        Hand all transactions committed since the last flush to the writer thread as one batch, to be written with a single write and
+        made durable with a single sync (group commit) according to the durability mode. Never waits on the disk.
+        Returns the journal position the batch ends at. The batch is complete once 'next_completed_batch()' reports a batch ending at or after it.
+    */
+    u64 flush();
+
+    /*
+        Get the next report of completed batches from the writer thread. Reports come in order. Should be called regularly
+        (eg. once per iteration of the server loop).
+        Parameter 'batch': Set to the report.
+        Returns whether or not there was a report.
+    */
+    bool next_completed_batch(CompletedBatch *batch);
+
+    /*
+        Commit a record that is already encoded (eg. one streamed from a primary). Works like 'commit_transaction()'.
+        Parameter 'record': The encoded record (header and payload).
+        Parameter 'length': The length of the record in bytes.
+    */
+    void commit_record(const char *record, u64 length);
+
+    /*
+        Set a function to be called with every record committed from now on, in journal order (eg. to stream the journal to followers).
+        Parameter 'observer': The function to call with the encoded record and its length, or nullptr for none.
+    */
+    void set_commit_observer(void (*observer)(const char *record, u64 length));
+
+    /*
+        Encode a transaction as a journal record, the same way it is committed.
+        Parameter 'transaction': The transaction to encode.
+        Parameter 'out': The buffer to append the record to.
+    */
+    void encode_record(const Transaction *transaction, std::string &out);
+
+    /*
+        Decode a journal record from a buffer (eg. one received from a primary server).
+        Parameter 'data': The buffer. Must start at a record boundary.
+        Parameter 'length': The number of bytes in the buffer.
+        Parameter 'record_length': Set to the length of the record, or 0 if the buffer does not hold all of it yet.
+        Parameter 'record': Set to the record. Its strings are views into the buffer.
+        Returns whether or not the buffer holds a whole record that is well formed.
+    */
+    bool decode_record(const char *data, u64 length, u64 *record_length, Record *record);
+
+    /*
+        Set the durability mode of the journal (Durability::SYNC by default).
+        Parameter 'mode': The durability mode.
+        Parameter 'interval_ms': The maximum time between syncs in Durability::INTERVAL mode.
+    */
+    void set_durability(Durability mode, u32 interval_ms);
+
+    /*
+        Set the size at which the journal moves on to a new segment (64MB by default). New segments are preallocated to this size.
+        Parameter 'size': The segment size in bytes.
+    */
+    void set_segment_size(u64 size);
+
+    /*
+        Set whether or not segments are compressed once the journal has moved on from them (on by default). Compressed segments are
+        always readable, whatever this is set to. Must be called before 'init()'.
+        Parameter 'enabled': Whether or not to compress sealed segments.
+    */
+    void set_segment_compression(bool enabled);
+
+    /*
+        Get the number of bytes committed to the journal since the latest snapshot was taken.
+        The server uses this to decide when to take a new snapshot.
+    */
+    u64 bytes_since_snapshot();
+
+    /*
+        Check if a snapshot is in progress: begun, and not yet written to disk in the background. Only one snapshot can be in
+        progress at a time.
+    */
+    bool snapshot_in_progress();
+
+    /*
+        Begin a snapshot of the server state as of everything committed so far. Can only be called after
+        'has_more_transactions()' returns false, and when 'snapshot_in_progress()' and 'backup_in_progress()' return false.
+        The state is then added with 'snapshot_transaction()', and the snapshot is written with 'finish_snapshot()'. The state
+        may be added over any number of calls, with transactions committed in between.
+        The journal is synced up to this point (whatever the durability mode) before the snapshot is moved into place, so the snapshot
+        never gets ahead of the durable journal. The journal moves on to a new segment at this point.
+    */
+    void begin_snapshot();
+
+    /*
+        Add a transaction to the snapshot begun with 'begin_snapshot()'.
+        Parameter 'transaction': The transaction to add. Replaying all transactions added must rebuild the server state, with
+                                 the users first, then the groups and messages (see 'SnapshotImage::Builder::add()').
+    */
+    void snapshot_transaction(const Transaction *transaction);
+
+    /*
+        Write the snapshot to disk on a background thread. Transactions may continue to be committed while it is written.
+    */
+    void finish_snapshot();
+
+    /*
+        Check on the snapshot being written in the background. Once it is durable, the part of the journal it covers
+        is compacted away. Should be called regularly (eg. once per iteration of the server loop).
+    */
+    void poll_snapshot();
+
+    /*
+        Check if a backup is being taken. Only one backup can be in progress at a time, and no snapshot can be begun until it is done.
+    */
+    bool backup_in_progress();
+
+    /*
+        Begin a hot backup of everything committed so far. The latest snapshot and the journal up to this point are copied in the
+        background, while transactions continue to be committed; the backup can be opened like any other journal (and snapshot).
+        The journal is synced up to this point first, whatever the durability mode. Can only be called when 'snapshot_in_progress()'
+        returns false.
+        Parameter 'journal_filename': The base path of the journal of the backup. Must not be the journal itself.
+        Parameter 'snapshot_filename': The path of the snapshot of the backup.
+        Parameter 'position': Set to the journal position the backup is taken at.
+        Returns whether or not the backup was begun. It is not if one is already in progress, or if there is no journal to back up.
+    */
+    bool begin_backup(const std::string &journal_filename, const std::string &snapshot_filename, u64 *position);
+
+    /*
+        Check on the backup begun with 'begin_backup()'. Should be called regularly (eg. once per iteration of the server loop) while
+        'backup_in_progress()' returns true.
+        Parameter 'succeeded': Set to whether or not the backup is complete and durable, once it is done.
+        Returns whether or not the backup is done.
+    */
+    bool poll_backup(bool *succeeded);
+
+    /*
+        Read back the next record from the journal file. Can only be called when 'has_more_transactions()'
         returns true.
-        Returns a pointer to the transaction read. Will be one of the specialized transactions listed above.
+        Parameter 'record': Set to the record read. Its strings are only valid until the next call to 'has_more_transactions()'.
+        Returns whether or not the record could be read. If not, the journal is unusable and nothing more can be read or committed.
+    */
+    bool next_record(Record *record);
+
+    /*
+        Read back the next transaction from the journal file. Can only be called when 'has_more_transactions()'
+        returns true. Like 'next_record()', but the transaction owns copies of its strings (eg. for tools that hold on to them).
+        Returns a pointer to the transaction read, or nullptr if it could not be read. Will be one of the specialized transactions listed above.
         This transaction must be returned by calling 'return_transaction()' to signify that it can be freed.
     */
     Transaction *next_transaction();
@@ -155,6 +497,28 @@ namespace Journal {
     */
     void return_transaction(Transaction *transaction);
 
+    /*
+        Get the number of users, groups, and messages in the snapshot being replayed, so that the stores can be sized for them before
+        replay. They are all 0 if there is no snapshot, or it was written before snapshot images.
+    */
+    void snapshot_counts(u32 *user_count, u32 *group_count, u32 *message_count);
+
+    /*
+        Read the users and groups created in the journal after the snapshot, ahead of replay, so that they can be looked up before
+        the records around them are replayed. Every other record is skipped over without being decoded. Reading ahead stops at the
+        first record that cannot be read back, where replay stops too. Can only be called once, before replay is over; replay still
+        hands out the same records afterwards.
+        Parameter 'apply': Called with every NEW_USER and NEW_GROUP record, in journal order. Its strings are only valid during the call.
+    */
+    void read_ahead(void (*apply)(const Record &record));
+
+    /*
+        Get the journal position just past the last record handed out by 'next_record()' (or 'next_transaction()'). While the snapshot is replayed (and
+        before the first record), it is the position replay started at: the snapshot position, or the start of the oldest live segment.
+        Journal positions count record bytes from the very first record ever written to the journal.
+    */
+    u64 replay_position();
+
     /*
         Check if the file has any more transactions to read back. If not, new transactions may be committed.
         Returns whether or not the journal file has any unread transactions.
@@ -0,0 +1,89 @@
+/*
+    Journal benchmark module implementation. See header (journal_benchmark.hpp) for public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "journal_benchmark.hpp"
+#include "journal.hpp"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#define BENCHMARK_JOURNAL_FILENAME "benchmark.chatjournal"
+#define BENCHMARK_SNAPSHOT_FILENAME "benchmark.chatsnapshot"
+
+struct BenchmarkMode {
+    const char *name;
+    Journal::Durability durability;
+    u32 interval_ms;
+};
+
+static const BenchmarkMode BENCHMARK_MODES[] = {
+    { "sync",          Journal::Durability::SYNC,     0   },
+    { "interval(10)",  Journal::Durability::INTERVAL, 10  },
+    { "interval(100)", Journal::Durability::INTERVAL, 100 },
+    { "none",          Journal::Durability::NONE,     0   },
+};
+
+void JournalBenchmark::run(u32 record_count, u32 batch_size) {
+    // A message record about the size of a typical chat message.
+    const Journal::NewMessageTransaction transaction("benchmark_sender", "benchmark_recipient", RECIPIENT_TYPE_USER, std::string(CHAT_MAX_MESSAGE_LENGTH / 2, 'x'));
+    const u32 batch_count = (record_count + batch_size - 1) / batch_size;
+
+    std::printf("Journal benchmark: %u records per mode, %u records per flush\n", record_count, batch_size);
+    std::printf("%-14s %12s %10s %12s %12s %12s %12s\n", "mode", "records/s", "MB/s", "avg lat(us)", "p50 lat(us)", "p99 lat(us)", "max lat(us)");
+
+    for (u32 mode_index = 0; mode_index < ARRAY_LEN(BENCHMARK_MODES); ++mode_index) {
+        const BenchmarkMode &mode = BENCHMARK_MODES[mode_index];
+        Journal::destroy(BENCHMARK_JOURNAL_FILENAME, BENCHMARK_SNAPSHOT_FILENAME);
+        Journal::init(BENCHMARK_JOURNAL_FILENAME, BENCHMARK_SNAPSHOT_FILENAME);
+        Journal::set_durability(mode.durability, mode.interval_ms);
+
+        // The new journal is empty, but it still has to be replayed (which finishes the replay) before anything is committed.
+        Journal::Record record;
+        while (Journal::has_more_transactions())
+            Journal::next_record(&record);
+
+        // Latency of each batch from its first commit until the writer thread reports it complete, ie. how long the clients of a batch wait for their acknowledgement.
+        Util::IchigoVector<f64> latencies(batch_count);
+        auto start = std::chrono::steady_clock::now();
+
+        for (u32 committed = 0; committed < record_count;) {
+            auto batch_start = std::chrono::steady_clock::now();
+            for (u32 i = 0; i < batch_size && committed < record_count; ++i, ++committed)
+                Journal::commit_transaction(&transaction);
+
+            u64 batch_end = Journal::flush();
+            Journal::CompletedBatch batch{};
+            while (batch.end_position < batch_end) {
+                if (!Journal::next_completed_batch(&batch))
+                    std::this_thread::yield();
+            }
+
+            latencies.append(std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - batch_start).count());
+        }
+
+        f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+        u64 journal_size = Journal::bytes_since_snapshot();
+        Journal::deinit();
+        Journal::destroy(BENCHMARK_JOURNAL_FILENAME, BENCHMARK_SNAPSHOT_FILENAME);
+
+        f64 total_latency = 0;
+        for (u32 i = 0; i < latencies.size(); ++i)
+            total_latency += latencies.at(i);
+
+        std::sort(latencies.data(), latencies.data() + latencies.size());
+        std::printf(
+            "%-14s %12.0f %10.2f %12.1f %12.1f %12.1f %12.1f\n",
+            mode.name,
+            record_count / seconds,
+            journal_size / seconds / (1024 * 1024),
+            total_latency / latencies.size(),
+            latencies.at(latencies.size() / 2),
+            latencies.at(latencies.size() * 99 / 100),
+            latencies.at(latencies.size() - 1)
+        );
+    }
+}
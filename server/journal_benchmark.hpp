@@ -0,0 +1,23 @@
+/*
+    Journal benchmark module. Measures append throughput and flush (acknowledgement) latency of the journal
+    in each durability mode, so the trade-off between the modes can be judged on the hardware the server runs on.
+
+    Run with: chat.exe --journal-benchmark [--benchmark-records N] [--benchmark-batch N]
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+
+#include "../common.hpp"
+
+namespace JournalBenchmark {
+    /*
+        Run the benchmark and print a table of results. Writes to (and deletes) "benchmark.chatjournal" in the working directory.
+
+        Parameter 'record_count': The number of NEW_MESSAGE records to commit per durability mode.
+        Parameter 'batch_size': The number of records committed per flush (ie. per event loop iteration).
+    */
+    void run(u32 record_count, u32 batch_size);
+}
@@ -0,0 +1,210 @@
+/*
+    Legacy text journal reader implementation. See header (legacy_journal.hpp) for public function documentation.
+
+    Author: Braeden Hong
+      Date: November 11, 2023 - October 17, 2026
+*/
+
+#include "legacy_journal.hpp"
+#include "../util.hpp"
+#include <optional>
+
+// The text journal file being converted
+static std::FILE *journal_file = nullptr;
+
+#define INVALID_U32 static_cast<u32>(~0)
+
+/*
+    Get the next non-whitespace character from the file.
+    Returns the next non-whitespace character of 'journal_file'.
+*/
+static inline char next_non_whitespace() {
+    char c;
+    while (std::isspace(c = std::fgetc(journal_file)));
+    return c;
+}
+
+/*
+    Read an unsigned 32-bit integer from the current position in the journal file.
+    Returns an unsigned 32-bit integer parsed (base 10) from the current position in the file, or INVALID_U32 if no number could be parsed.
+*/
+static u32 read_u32() {
+    static char buffer[1024];
+    buffer[0] = next_non_whitespace();
+
+    for (u32 i = 1; i < 1023; ++i) {
+        buffer[i] = std::fgetc(journal_file);
+        if (std::isspace(buffer[i]) || buffer[i] == EOF) {
+            buffer[i] = 0;
+            char *end;
+            u32 number = std::strtol(buffer, &end, 10);
+            if (buffer == end) {
+                ICHIGO_ERROR("Failed to parse u32 due to invalid number format");
+                return INVALID_U32;
+            }
+
+            return number;
+        }
+    }
+
+    ICHIGO_ERROR("Failed to parse u32");
+    return INVALID_U32;
+}
+
+/*
+    Check if the next non-whitespace character in the journal file begins a quoted string, without consuming it.
+    Used to read optional trailing fields that older journals do not have.
+*/
+static bool next_is_quoted_string() {
+    char c = next_non_whitespace();
+    std::ungetc(c, journal_file);
+    return c == '"';
+}
+
+/*
+    Read a string surrounded by quotes from the current position in the journal file.
+    Returns an optional that contains either the string parsed (without the quotes) or no value if a string could not be parsed.
+*/
+static std::optional<std::string> read_quoted_string() {
+    static char buffer[1024];
+
+    if (next_non_whitespace() != '"') {
+        ICHIGO_ERROR("Expected \" to begin string");
+        return {};
+    }
+
+    for (u32 i = 0; i < 1023; ++i) {
+        buffer[i] = std::fgetc(journal_file);
+        if (buffer[i] == '"') {
+            buffer[i] = 0;
+            return buffer;
+        }
+    }
+
+    ICHIGO_ERROR("String too long");
+    return {};
+}
+
+bool LegacyJournal::open(const std::string &journal_filename) {
+    journal_file = ChatServer::platform_open_file(journal_filename, "rb");
+    return journal_file != nullptr;
+}
+
+void LegacyJournal::close() {
+    std::fclose(journal_file);
+    journal_file = nullptr;
+}
+
+Journal::Transaction *LegacyJournal::next_transaction() {
+    static char buffer[1024];
+    buffer[0] = next_non_whitespace();
+    // Get the transaction operation
+    for (u32 i = 1; i < 1023; ++i) {
+        buffer[i] = std::fgetc(journal_file);
+        if (std::isspace(buffer[i])) {
+            buffer[i] = 0;
+            break;
+        }
+    }
+
+    if (std::strcmp(buffer, "NEW_USER") == 0) {
+        auto username = read_quoted_string();
+        if (!username.has_value())
+            goto fail;
+
+        return new Journal::NewUserTransaction(username.value());
+    } else if (std::strcmp(buffer, "UPDATE_ID") == 0) {
+        u32 id = read_u32();
+
+        if (id == INVALID_U32) {
+            ICHIGO_ERROR("Invalid u32");
+            goto fail;
+        }
+
+        return new Journal::UpdateIdTransaction(id);
+    } else if (std::strcmp(buffer, "NEW_MESSAGE") == 0) {
+        auto sender = read_quoted_string();
+
+        if (!sender.has_value())
+            goto fail;
+
+        u32 recipient_type = read_u32();
+
+        if (recipient_type == INVALID_U32) {
+            goto fail;
+        }
+
+        auto recipient = read_quoted_string();
+
+        if (!recipient.has_value())
+            goto fail;
+
+        auto content = read_quoted_string();
+
+        if (!content.has_value())
+            goto fail;
+
+        // Journals written before attachments existed end the record here.
+        if (!next_is_quoted_string())
+            return new Journal::NewMessageTransaction(sender.value(), recipient.value(), recipient_type, content.value());
+
+        auto attachment_digest = read_quoted_string();
+
+        if (!attachment_digest.has_value())
+            goto fail;
+
+        auto attachment_name = read_quoted_string();
+
+        if (!attachment_name.has_value())
+            goto fail;
+
+        return new Journal::NewMessageTransaction(sender.value(), recipient.value(), recipient_type, content.value(), attachment_digest.value(), attachment_name.value());
+    } else if (std::strcmp(buffer, "DELETE_MESSAGE") == 0) {
+        u32 id = read_u32();
+
+        if (id == INVALID_U32)
+            goto fail;
+
+        return new Journal::DeleteMessageTransaction(id);
+    } else if (std::strcmp(buffer, "NEW_GROUP") == 0) {
+        auto name = read_quoted_string();
+
+        if (!name.has_value())
+            goto fail;
+
+        u32 user_count = read_u32();
+
+        if (user_count == INVALID_U32)
+            goto fail;
+
+        Util::IchigoVector<std::string> users;
+        for (u32 i = 0; i < user_count; ++i) {
+            auto username = read_quoted_string();
+            if (!username.has_value())
+                goto fail;
+
+            users.append(username.value());
+        }
+
+        return new Journal::NewGroupTransaction(name.value(), std::move(users));
+    }
+
+fail:
+        return nullptr;
+}
+
+bool LegacyJournal::has_more_transactions() {
+    // Consume whitespace at beginning of line
+    u32 pos = std::ftell(journal_file);
+
+    for (char c = std::fgetc(journal_file);; c = std::fgetc(journal_file)) {
+        if (c == EOF)
+            return false;
+
+        if (!std::isspace(c))
+            break;
+    }
+
+    std::fseek(journal_file, pos, SEEK_SET);
+    return true;
+}
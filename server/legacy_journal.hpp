@@ -0,0 +1,41 @@
+/*
+    Reader for journals written in the original text format, eg.
+
+        NEW_USER "name"
+        NEW_MESSAGE "sender" 0 "recipient" "content" "attachment digest" "attachment name"
+
+    Only used to convert old journals to the binary format (see 'Journal::init()'). New journals are never written in this format.
+
+    Author: Braeden Hong
+      Date: November 11, 2023 - October 17, 2026
+*/
+
+#pragma once
+
+#include "journal.hpp"
+
+namespace LegacyJournal {
+    /*
+        Open a text journal for reading.
+        Parameter 'journal_filename': The path to the text journal.
+        Returns whether or not the file could be opened.
+    */
+    bool open(const std::string &journal_filename);
+
+    /*
+        Close the text journal.
+    */
+    void close();
+
+    /*
+        Check if there are more transactions to read from the text journal.
+        Returns whether or not the file has any unread transactions.
+    */
+    bool has_more_transactions();
+
+    /*
+        Read the next transaction from the text journal. Can only be called when 'has_more_transactions()' returns true.
+        Returns the transaction read (free with 'Journal::return_transaction()'), or nullptr if the record could not be parsed.
+    */
+    Journal::Transaction *next_transaction();
+}
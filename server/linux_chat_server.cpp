@@ -0,0 +1,179 @@
+/*
+    Chat server platform layer module implementation for linux. Only the file services are implemented: the server itself
+    still runs on win32, but tools built on the journal module (eg. chatjournal.cpp) run on linux with this platform layer.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include "../common.hpp"
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include "chat_server.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::FILE *ChatServer::platform_open_file(const std::string &path, const std::string &mode) {
+    return std::fopen(path.c_str(), mode.c_str());
+}
+
+bool ChatServer::platform_file_exists(const char *path) {
+    struct stat attributes;
+    return stat(path, &attributes) == 0 && S_ISREG(attributes.st_mode);
+}
+
+static bool is_filtered_file(const char *filename, const char **extension_filter, const u16 extension_filter_count) {
+    const char *period = std::strrchr(filename, '.');
+    const char *extension = period ? period + 1 : filename;
+
+    for (u32 i = 0; i < extension_filter_count; ++i) {
+        if (std::strcmp(extension, extension_filter[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void visit_directory(const std::string &path, Util::IchigoVector<std::string> *files, const char **extension_filter, const u16 extension_filter_count) {
+    DIR *directory = opendir(path.c_str());
+    if (!directory) {
+        std::printf("linux plat: Failed to open directory! errno=%d\n", errno);
+        return;
+    }
+
+    for (dirent *entry = readdir(directory); entry; entry = readdir(directory)) {
+        if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        const std::string full_path = path + "/" + entry->d_name;
+        struct stat attributes;
+        if (stat(full_path.c_str(), &attributes) != 0)
+            continue;
+
+        if (S_ISDIR(attributes.st_mode))
+            visit_directory(full_path, files, extension_filter, extension_filter_count);
+        else if (is_filtered_file(entry->d_name, extension_filter, extension_filter_count))
+            files->append(full_path);
+    }
+
+    closedir(directory);
+}
+
+Util::IchigoVector<std::string> ChatServer::platform_recurse_directory(const std::string &path, const char **extension_filter, const u16 extension_filter_count) {
+    Util::IchigoVector<std::string> ret;
+    visit_directory(path, &ret, extension_filter, extension_filter_count);
+    return ret;
+}
+
+bool ChatServer::platform_sync_file(std::FILE *file) {
+    if (fdatasync(fileno(file)) != 0) {
+        std::printf("linux plat: Failed to sync file! errno=%d\n", errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool ChatServer::platform_preallocate_file(std::FILE *file, u64 size) {
+    if (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, size) != 0) {
+        std::printf("linux plat: Failed to preallocate file! errno=%d\n", errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool ChatServer::platform_truncate_file(std::FILE *file, u64 size) {
+    if (std::fflush(file) != 0 || ftruncate(fileno(file), size) != 0) {
+        std::printf("linux plat: Failed to truncate file! errno=%d\n", errno);
+        return false;
+    }
+
+    return true;
+}
+
+void ChatServer::platform_create_directory(const std::string &path) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+        std::printf("linux plat: Failed to create directory! errno=%d\n", errno);
+}
+
+u64 ChatServer::platform_file_size(const std::string &path) {
+    struct stat attributes;
+    return stat(path.c_str(), &attributes) == 0 ? attributes.st_size : 0;
+}
+
+bool ChatServer::platform_replace_file(const std::string &source, const std::string &destination) {
+    if (std::rename(source.c_str(), destination.c_str()) != 0) {
+        std::printf("linux plat: Failed to replace file! errno=%d\n", errno);
+        return false;
+    }
+
+    // The rename is only durable once the directory holding the destination is synced.
+    std::string directory_path = destination;
+    i32 directory = open(dirname(directory_path.data()), O_RDONLY | O_DIRECTORY);
+    bool ret = directory >= 0 && fsync(directory) == 0;
+    if (!ret)
+        std::printf("linux plat: Failed to sync directory! errno=%d\n", errno);
+
+    if (directory >= 0)
+        close(directory);
+
+    return ret;
+}
+
+const char *ChatServer::platform_map_file(const std::string &path, u64 *out_size) {
+    *out_size = 0;
+    i32 file = open(path.c_str(), O_RDONLY);
+    struct stat attributes;
+    if (file < 0 || fstat(file, &attributes) != 0 || attributes.st_size == 0) {
+        if (file >= 0)
+            close(file);
+
+        return nullptr;
+    }
+
+    // The mapping keeps the file alive, so it can be closed right away.
+    void *view = mmap(nullptr, attributes.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view == MAP_FAILED) {
+        std::printf("linux plat: Failed to map file! errno=%d\n", errno);
+        return nullptr;
+    }
+
+    madvise(view, attributes.st_size, MADV_SEQUENTIAL);
+    madvise(view, attributes.st_size, MADV_WILLNEED);
+    *out_size = attributes.st_size;
+    return static_cast<const char *>(view);
+}
+
+void ChatServer::platform_unmap_file(const char *mapping, u64 size) {
+    munmap(const_cast<char *>(mapping), size);
+}
+
+bool ChatServer::platform_send_file(u32 socket, const std::string &path, u64 offset, u32 length) {
+    i32 file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+
+    bool ret = true;
+    for (off_t position = offset, end = offset + length; position < end;) {
+        if (sendfile(socket, file, &position, end - position) <= 0) {
+            std::printf("linux plat: sendfile failed! errno=%d\n", errno);
+            ret = false;
+            break;
+        }
+    }
+
+    close(file);
+    return ret;
+}
@@ -3,27 +3,47 @@
 
     Globals:
     buffer: A general purpose 4kb buffer used for socket communication.
-    next_id: The ID that will be used next.
+    chunk_buffer: A buffer large enough to hold one attachment upload chunk.
+    next_id: The last ID that was handed out.
+    id_lease_limit: The highest ID that has been leased from the journal. IDs up to this can be handed out without touching the journal.
     poll_connection_fds: A vector of the poll structs defining how each socket should be polled for new data.
     users: A vector of all users.
     groups: A vector of all groups.
     messages: A vector of all messages.
     connection_heartbeat_times: A vector containing the last heartbeat times of each user. Kept in sync with poll_connection_fds.
+    pending_results: Results of conversations that committed to the journal, waiting for the journal writer to report their batch complete.
+    last_completed_batch: The last batch the journal writer reported complete.
+    snapshot_interval_bytes: How many bytes of journal are written between snapshots of the server state.
+    user_indices, group_indices, message_indices: Indexes into the stores, only kept while applying journal records (replay, or following a primary).
+    read_only: Set while this server is a follower. Conversations that would change the state of the server are refused.
+    replaying: Set while the message history is still being replayed from the journal, after the server started taking requests.
+    deferred_requests: Conversations that need the whole message history, held back until the replay is done.
+    attachment_users: For every attachment digest, how many messages each user sent or received with it.
+    snapshot_cursor, bootstrap_cursor: Where the encoding of the server state for a snapshot, and for a new follower, is up to.
+    admin_username: The user allowed to take backups of the journal while the server is running (see 'backup()').
 
     Author: Braeden Hong
       Date: October 30, 2023 - November 12 2023
 */
 
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
 #include "../common.hpp"
 #include "chat_server.hpp"
 #include "server_user.hpp"
 #include "../message.hpp"
 #include "../group.hpp"
+#include "../sha256.hpp"
 #include "journal.hpp"
+#include "journal_benchmark.hpp"
+#include "blob_store.hpp"
+#include "replication.hpp"
 
 // A macro for returning from all conversation functions if a poll fails (ie. the client has dropped the connection mid conversation).
 #define RETURN_IF_DROPPED(RECV_RET)                \
@@ -34,14 +54,98 @@
     }                                              \
 }                                                  \
 
+// The number of IDs leased from the journal at a time.
+#define ID_LEASE_SIZE 65536
+// The most records a follower applies per event loop iteration once bootstrapped, so its clients are still served while it catches up.
+#define FOLLOWER_MAX_APPLY 4096
+// The most journal records replayed per event loop iteration while the server serves clients during startup.
+#define STARTUP_REPLAY_MAX_APPLY 16384
+// How long a request for the messages of a user replays the journal for before answering with what is loaded so far.
+#define INBOX_WAIT_MS 100
+// The most records of the server state encoded per event loop iteration for a snapshot or a new follower, so clients are still served meanwhile.
+#define STATE_ENCODE_MAX_RECORDS 16384
+
 static char buffer[4096]{};
+static char chunk_buffer[CHAT_ATTACHMENT_CHUNK_SIZE]{};
 static i32 next_id = 0;
+static i32 id_lease_limit = 0;
 static Util::IchigoVector<pollfd> poll_connection_fds;
 static Util::IchigoVector<ServerUser> users;
 static Util::IchigoVector<Group> groups;
 static Util::IchigoVector<Message> messages;
 static Util::IchigoVector<u32> connection_heartbeat_times;
 
+/*
+    The final result of a conversation, held back until the journal records it committed are durable.
+    'batch_end' is the end position of the journal batch holding those records, or 0 until the batch is flushed.
+*/
+struct PendingResult {
+    u32 socket;
+    u8 result;
+    u64 batch_end;
+};
+
+static Util::IchigoVector<PendingResult> pending_results;
+static Journal::CompletedBatch last_completed_batch{};
+static u64 snapshot_interval_bytes = 64 * 1024 * 1024;
+// Roughly how much of the journal since the last snapshot is taken up by messages deleted since, which replay reads only to
+// throw away. A snapshot (which leaves them out) is taken early once it is a quarter of the snapshot interval.
+static u64 deleted_bytes_since_snapshot = 0;
+static std::string journal_filename  = "default.chatjournal";
+static std::string snapshot_filename = "default.chatsnapshot";
+
+/*
+    Hash for the name indexes that also takes string views, so that names read from the journal are looked up without copying them.
+*/
+struct NameHash {
+    using is_transparent = void;
+    u64 operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+};
+
+using NameIndex = std::unordered_map<std::string, u32, NameHash, std::equal_to<>>;
+
+// Deleted messages are dropped from the message index as records are applied, and removed from the message store in one pass later.
+static NameIndex user_indices;
+static NameIndex group_indices;
+static std::unordered_map<i32, u32> message_indices;
+
+// Unlike the indexes above, this one is kept up to date with the message store at all times. Downloads are authorized with it,
+// so they do not scan every message.
+static std::unordered_map<std::string, std::unordered_map<std::string, u32>> attachment_users;
+
+static bool read_only = false;
+static bool replaying = false;
+// Set while a bootstrap from the primary is being written to a journal of its own, which replaces the journal of this server
+// once the bootstrap is complete (see 'reset_state()').
+static bool bootstrap_journal_open = false;
+
+/*
+    A conversation received while the message history is still being replayed that needs all of it (see 'defer_request()').
+    Only its opcode has been read, and the rest of the request waits in the socket until the replay is done.
+*/
+struct DeferredRequest {
+    u32 socket;
+    Opcode opcode;
+};
+
+static Util::IchigoVector<DeferredRequest> deferred_requests;
+// Followers hand out negative login IDs, so logging in never writes to the journal (and never collides with the IDs of the primary).
+static i32 next_session_id = -2;
+// The port of the primary to follow, and how long to wait for it to come back before taking over (0 to wait forever).
+static u16 primary_port = 0;
+static u64 promote_after_seconds = 0;
+static u64 primary_contact_time = 0;
+static u64 last_connect_attempt = 0;
+// The port to accept followers on once this server is the primary (0 for none).
+static u16 replication_port = 0;
+// The user allowed to take backups (none if empty), and the client waiting on the backup being taken (-1 for none). The backup is
+// begun once the snapshot being written, if any, is done.
+static std::string admin_username;
+static i32 backup_socket = -1;
+static bool backup_started = false;
+static std::string backup_name;
+static u64 backup_position = 0;
+
 /*
     Poll the specified socket for new data and receive it if data is made available before the connection times out.
     Parameter 'socket': The socket to poll and receive data from.
@@ -65,6 +169,90 @@ static i32 poll_recv(u32 socket, char *buffer, u64 buffer_length, u32 timeout =
     return -1;
 }
 
+/*
+    Poll the specified socket and receive exactly the number of bytes requested, calling recv() as many times as required.
+    Parameter 'socket': The socket to poll and receive data from.
+    Parameter 'buffer': The buffer to write the response data into.
+    Parameter 'length': The number of bytes to receive.
+    Returns 'length', or -1 if the connection timed out or was dropped before all of the data arrived.
+*/
+static i32 poll_recv_all(u32 socket, char *buffer, u64 length) {
+    for (u64 received = 0; received < length;) {
+        i32 n = poll_recv(socket, buffer + received, length - received);
+        if (n <= 0)
+            return -1;
+
+        received += n;
+    }
+
+    return length;
+}
+
+/*
+    Receive a string (length followed by 'length' characters) from the specified socket.
+    Parameter 'socket': The socket to poll and receive data from.
+    Parameter 'out': The string to write the received string into.
+    Parameter 'max_length': The maximum length of string to accept.
+    Returns the length of the string, or -1 if the connection was dropped or the string was longer than 'max_length'.
+*/
+static i32 poll_recv_string(u32 socket, std::string &out, u32 max_length) {
+    u32 length;
+    if (poll_recv_all(socket, reinterpret_cast<char *>(&length), sizeof(length)) == -1 || length > max_length || length > sizeof(buffer))
+        return -1;
+
+    if (poll_recv_all(socket, buffer, length) == -1)
+        return -1;
+
+    out.assign(buffer, length);
+    return length;
+}
+
+/*
+    Send the final result of a conversation that committed to the journal. The result is held back until the
+    journal batch containing its records is durable (see 'release_durable_results()'), so a client is never told
+    that a request succeeded before it would survive a crash. A conversation that did not commit anything is released
+    once everything committed before it is durable.
+    Parameter 'socket': The client socket we are talking to.
+    Parameter 'result': The result to send.
+*/
+static void send_result_when_durable(u32 socket, Error result) {
+    pending_results.append({ socket, static_cast<u8>(result), 0 });
+}
+
+/*
+    Hand every transaction committed during this event loop iteration to the journal writer as a single batch (group commit),
+    then release the results of every batch the writer has finished with. The server never waits on the disk here: results
+    stay pending across iterations until their batch is reported complete. If a batch could not be made durable, the waiting
+    clients are told that their requests failed.
+*/
+static void release_durable_results() {
+    u64 batch_end = Journal::flush();
+    Replication::batch_flushed(batch_end);
+    for (u64 i = pending_results.size(); i > 0 && pending_results.at(i - 1).batch_end == 0; --i)
+        pending_results.at(i - 1).batch_end = batch_end;
+
+    // Results are pending in journal order, so completed batches release them from the front. The last batch reported
+    // complete is checked first, since a result may be waiting on nothing newer than it.
+    u32 released = 0;
+    do {
+        Replication::batch_completed(last_completed_batch.end_position);
+        for (; released < pending_results.size() && pending_results.at(released).batch_end <= last_completed_batch.end_position; ++released) {
+            char result = last_completed_batch.durable ? pending_results.at(released).result : static_cast<u8>(Error::INVALID_REQUEST);
+            send(pending_results.at(released).socket, &result, 1, 0);
+        }
+    } while (Journal::next_completed_batch(&last_completed_batch));
+
+    // The results still pending are moved down over the released ones in one pass.
+    if (released == 0)
+        return;
+
+    for (u32 i = released; i < pending_results.size(); ++i)
+        pending_results.at(i - released) = pending_results.at(i);
+
+    for (; released > 0; --released)
+        pending_results.remove(pending_results.size() - 1);
+}
+
 /*
     Get the index of a user by their username.
     Parameter 'name': The username to search for.
@@ -121,6 +309,117 @@ static i32 find_message_index_by_id(i32 id) {
     return -1;
 }
 
+/*
+    Record that the sender and recipient of a message may download its attachment. Call whenever a message is added to the store.
+    Parameter 'message': The message being added.
+*/
+static void add_attachment_users(const Message &message) {
+    if (!message.has_attachment())
+        return;
+
+    std::unordered_map<std::string, u32> &users_of_attachment = attachment_users[message.attachment_digest()];
+    ++users_of_attachment[message.sender()->name()];
+    ++users_of_attachment[message.recipient()->usernames().at(0)];
+}
+
+/*
+    Undo 'add_attachment_users()' for a message. Call whenever a message is removed from (or deleted in) the store.
+    Parameter 'message': The message being removed.
+*/
+static void remove_attachment_users(const Message &message) {
+    if (!message.has_attachment())
+        return;
+
+    auto it = attachment_users.find(message.attachment_digest());
+    assert(it != attachment_users.end());
+    for (const std::string &username : { message.sender()->name(), message.recipient()->usernames().at(0) }) {
+        auto user = it->second.find(username);
+        assert(user != it->second.end());
+        if (--user->second == 0)
+            it->second.erase(user);
+    }
+
+    if (it->second.empty())
+        attachment_users.erase(it);
+}
+
+/*
+    Check whether a user sent or received a message with an attachment.
+    Parameter 'digest': The digest of the attachment.
+    Parameter 'username': The name of the user.
+*/
+static bool may_download_attachment(const std::string &digest, const std::string &username) {
+    auto it = attachment_users.find(digest);
+    return it != attachment_users.end() && it->second.contains(username);
+}
+
+/*
+    How far an encoding of the server state (see 'write_state()') has got. The state is encoded a part at a time, as of when the
+    encoding began: users, groups, and messages added since are left out, and messages deleted since before they were encoded are
+    set aside to be encoded anyway. Users and groups are never removed, so only the messages move under the cursor.
+*/
+struct StateCursor {
+    bool active        = false;
+    u32 user_end       = 0;
+    u32 group_end      = 0;
+    u32 message_end    = 0;
+    u32 next_user      = 0;
+    u32 next_group     = 0;
+    u32 next_message   = 0;
+    i32 id_lease_limit = 0;
+    Util::IchigoVector<Message> deleted_messages;
+};
+
+static StateCursor snapshot_cursor;
+static StateCursor bootstrap_cursor;
+
+/*
+    Keep an encoding of the server state in step with a message being removed from the store.
+    Parameter 'cursor': The encoding.
+    Parameter 'index': The index of the message in the store.
+    Parameter 'message': The message.
+*/
+static void message_removed(StateCursor &cursor, u32 index, const Message &message) {
+    if (!cursor.active || index >= cursor.message_end)
+        return;
+
+    if (index >= cursor.next_message)
+        cursor.deleted_messages.append(message);
+    else
+        --cursor.next_message;
+
+    --cursor.message_end;
+}
+
+/*
+    Keep the encodings of the server state in step with a message being removed from the store. Call before the messages after it
+    move down over it.
+    Parameter 'index': The index of the message in the store.
+    Parameter 'message': The message.
+*/
+static void message_removed(u32 index, const Message &message) {
+    message_removed(snapshot_cursor, index, message);
+    message_removed(bootstrap_cursor, index, message);
+}
+
+/*
+    Look up a name in one of the indexes kept while applying journal records.
+    Parameter 'index': The index to search.
+    Parameter 'name': The name to search for.
+    Returns the index of the user or group in its vector if found, -1 if not.
+*/
+static i32 find_indexed(const NameIndex &index, std::string_view name) {
+    auto it = index.find(name);
+    return it == index.end() ? -1 : static_cast<i32>(it->second);
+}
+
+/*
+    Estimate the size of the journal record that created a message (or the part of a group message's record for this copy).
+*/
+static u64 message_record_size(const Message &message) {
+    return sizeof(u32) * 8 + message.content().length() + message.attachment_digest().length() + message.attachment_name().length();
+}
+
 /*
     Get the index of a user by the TCP socket file descriptor of the client that is logged in as them.
     Parameter 'socket': The file descriptor to search for.
@@ -136,16 +435,34 @@ static i32 find_user_index_by_socket_fd(u32 socket) {
 }
 
 /*
-    Automatically commit an UPDATE_ID transaction to the journal and get the next ID.
-    Returns the next ID to use.
+    Get the next ID(s). IDs are leased from the journal in blocks of ID_LEASE_SIZE: an UPDATE_ID transaction recording the
+    end of the block is only committed when the current block runs out. On restart the server continues after the end
+    of the last block, so IDs are never reused (but the rest of a block is skipped).
+    Parameter 'count': The number of consecutive IDs to get (default 1).
+    Returns the first of the IDs.
 */
-static i32 get_next_id() {
-    i32 ret = ++next_id;
-    Journal::UpdateIdTransaction transaction(ret);
-    Journal::commit_transaction(&transaction);
+static i32 get_next_id(u32 count = 1) {
+    i32 ret = next_id + 1;
+    next_id += count;
+
+    if (next_id > id_lease_limit) {
+        id_lease_limit = next_id + ID_LEASE_SIZE;
+        Journal::UpdateIdTransaction transaction(id_lease_limit);
+        Journal::commit_transaction(&transaction);
+    }
+
     return ret;
 }
 
+/*
+    Replay more of the message history. Users and groups are replayed before the server starts taking requests, but
+    messages (which make up most of the journal) are replayed a few at a time from the event loop, so that clients can
+    log in right away. Users registered since the last snapshot may also only be replayed here.
+    Once the end of the journal is reached the replay is finished off (see 'ChatServer::init()').
+    Parameter 'max_records': The most records to replay. UINT32_MAX replays the rest of the journal.
+*/
+static void replay_records(u32 max_records);
+
 /*
     Get all users conversation function.
 
@@ -260,7 +577,7 @@ static void get_groups(u32 socket) {
         send(socket, group.name().c_str(), group.name().length(), 0);
 
         // Step 6b
-        auto usernames = group.usernames();
+        const auto &usernames = group.members();
         size = usernames.size();
         send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
 
@@ -308,8 +625,7 @@ static void register_user(u32 socket) {
     ICHIGO_INFO("Registered user: %s", buffer);
 
     // Step 3
-    buffer[0] = Error::SUCCESS;
-    send(socket, buffer, 1, 0);
+    send_result_when_durable(socket, Error::SUCCESS);
 }
 
 /*
@@ -372,15 +688,20 @@ static void register_group(u32 socket) {
             group_users.append(buffer);
     }
 
+    // Step 6
+    // The member list is only bounded by what fits in a journal record.
     if (!failed) {
         const Journal::NewGroupTransaction transaction(group_name, group_users);
-        Journal::commit_transaction(&transaction);
-        groups.append(Group(group_name, std::move(group_users)));
+        failed = !Journal::commit_transaction(&transaction);
     }
 
-    // Step 6
-    buffer[0] = failed ? Error::INVALID_REQUEST : Error::SUCCESS;
-    send(socket, buffer, 1, 0);
+    if (!failed) {
+        groups.append(Group(group_name, std::move(group_users)));
+        send_result_when_durable(socket, Error::SUCCESS);
+    } else {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+    }
 }
 
 /*
@@ -401,8 +722,9 @@ static void login(u32 socket) {
 
     buffer[n] = 0;
 
-    // Step 2
+    // Step 2. Every user exists before replay is over, as users registered since the last snapshot are read ahead of it.
     i32 index = find_user_index_by_name(buffer);
+
     if (index == -1 || users.at(index).is_logged_in()) {
         ICHIGO_INFO("User %s already logged in or does not exist.", buffer);
 
@@ -413,7 +735,8 @@ static void login(u32 socket) {
         return;
     }
 
-    i32 id = get_next_id();
+    // Nothing can be committed to the journal before it is fully replayed, so logins during startup get session IDs like on a follower.
+    i32 id = read_only || replaying ? next_session_id-- : get_next_id();
 
     users.at(index).set_status("Online");
     users.at(index).set_logged_in(true);
@@ -425,8 +748,7 @@ static void login(u32 socket) {
     send(socket, reinterpret_cast<char *>(&id), sizeof(id), 0);
     ICHIGO_INFO("User logged in: %s", buffer);
     // Step 4
-    buffer[0] = Error::SUCCESS;
-    send(socket, buffer, 1, 0);
+    send_result_when_durable(socket, Error::SUCCESS);
 }
 
 /*
@@ -576,7 +898,10 @@ static void set_status(u32 socket) {
     3. Receive the type of the recipient.
     4. Receive the name of the recipient.
     5. Receive the message content.
-    6. If the length of the string is too long or the recipient cannot be found, send Error::INVALID_REQUEST. Otherwise, send Error::SUCCESS.
+    6. Receive the attachment digest and attachment name strings (both empty if there is no attachment).
+       The attachment must have been uploaded beforehand with UPLOAD_ATTACHMENT.
+    7. If the length of the string is too long, the recipient cannot be found, or the attachment is not stored, send Error::INVALID_REQUEST.
+       Otherwise, send Error::SUCCESS.
 
     Parameter 'socket': The client socket we are talking to.
 */
@@ -620,41 +945,52 @@ static void send_message(i32 socket) {
     RETURN_IF_DROPPED((n = poll_recv(socket, buffer, message_size)));
     buffer[n] = 0;
 
+    std::string message_content = buffer;
+
     // Step 6
-    if (recipient_index == -1 || n > CHAT_MAX_MESSAGE_LENGTH) {
+    std::string attachment_digest;
+    std::string attachment_name;
+    RETURN_IF_DROPPED(poll_recv_string(socket, attachment_digest, 64));
+    RETURN_IF_DROPPED(poll_recv_string(socket, attachment_name, CHAT_MAX_ATTACHMENT_NAME_LENGTH));
+
+    // Step 7
+    if (recipient_index == -1 || n > CHAT_MAX_MESSAGE_LENGTH || (!attachment_digest.empty() && !BlobStore::contains(attachment_digest))) {
         buffer[0] = Error::INVALID_REQUEST;
         send(socket, buffer, 1, 0);
         return;
     }
 
     // Create the message(s)
-    std::string message_content = buffer;
-    message_id = get_next_id();
-
     if (recipient_type == RECIPIENT_TYPE_USER) {
-        const Message message(message_content, &users.at(recipient_index), sender, message_id);
-        const Journal::NewMessageTransaction transaction(message.sender()->name(), recipient_name, recipient_type, message.content());
+        message_id = get_next_id();
+        Message message(message_content, &users.at(recipient_index), sender, message_id);
+        message.set_attachment(attachment_digest, attachment_name);
+        const Journal::NewMessageTransaction transaction(message.sender()->name(), recipient_name, recipient_type, message.content(), attachment_digest, attachment_name, message_id);
         Journal::commit_transaction(&transaction);
-        messages.append(message);
+        add_attachment_users(message);
+        messages.append(std::move(message));
     } else {
-        const Journal::NewMessageTransaction transaction(sender->name(), recipient_name, recipient_type, message_content);
+        // Each member gets their own copy of the message with consecutive IDs, so the journal only needs the first one.
+        Group &group = groups.at(recipient_index);
+        const Util::IchigoVector<std::string> &usernames = group.members();
+        message_id = get_next_id(usernames.size());
+
+        const Journal::NewMessageTransaction transaction(sender->name(), recipient_name, recipient_type, message_content, attachment_digest, attachment_name, message_id);
         Journal::commit_transaction(&transaction);
 
-        Group &group = groups.at(recipient_index);
-        for (u32 i = 0; i < group.usernames().size(); ++i) {
-            ICHIGO_INFO("Group message sending to %s with id %d", group.usernames().at(i).c_str(), message_id);
-            recipient_index = find_user_index_by_name(group.usernames().at(i));
+        // Every member's copy of the message references the same blob, so the attachment is stored once regardless of group size.
+        for (u32 i = 0; i < usernames.size(); ++i, ++message_id) {
+            ICHIGO_INFO("Group message sending to %s with id %d", usernames.at(i).c_str(), message_id);
+            recipient_index = find_user_index_by_name(usernames.at(i));
             assert(recipient_index != -1);
-            const Message message(message_content, &users.at(recipient_index), sender, message_id);
-            messages.append(message);
-
-            // FIXME: This is a pointless commit at the end of the loop. Not a big deal, but just something to note.
-            message_id = get_next_id();
+            Message message(message_content, &users.at(recipient_index), sender, message_id);
+            message.set_attachment(attachment_digest, attachment_name);
+            add_attachment_users(message);
+            messages.append(std::move(message));
         }
     }
 
-    buffer[0] = Error::SUCCESS;
-    send(socket, buffer, 1, 0);
+    send_result_when_durable(socket, Error::SUCCESS);
 }
 
 /*
@@ -702,9 +1038,11 @@ static void delete_message(i32 socket) {
         const Journal::DeleteMessageTransaction transaction(id);
         Journal::commit_transaction(&transaction);
 
+        deleted_bytes_since_snapshot += message_record_size(messages.at(message_index));
+        remove_attachment_users(messages.at(message_index));
+        message_removed(message_index, messages.at(message_index));
         messages.remove(message_index);
-        buffer[0] = Error::SUCCESS;
-        send(socket, buffer, 1, 0);
+        send_result_when_durable(socket, Error::SUCCESS);
     } else {
         buffer[0] = Error::UNAUTHORIZED;
         send(socket, buffer, 1, 0);
@@ -719,8 +1057,9 @@ static void delete_message(i32 socket) {
     2. Resolve this user. If the user was not found, is not logged in, or the socket fds do not match, send Error::INVALID_REQUEST and abort.
     3. Send Error::SUCCESS.
     4. Send the number of messages addressed to the user provided.
-    5. Send n message ID and content pairs (i32 and string).
-    6. Send Error::SUCCESS.
+    5. Send n messages (i32 ID, then sender, content, attachment digest, and attachment name strings).
+    6. Send Error::SUCCESS, or Error::PARTIAL if the message history is still being replayed (the client gets the rest
+       on a later refresh). The journal is replayed for up to INBOX_WAIT_MS first, so that small histories are complete.
 
     Parameter 'socket': The client socket we are talking to.
 */
@@ -741,12 +1080,21 @@ static void get_messages(i32 socket) {
     buffer[0] = Error::SUCCESS;
     send(socket, buffer, 1, 0);
 
-    // Gather all messages that are addressed to this user
+    // A user's messages can be anywhere in the journal, so there is no telling when they are all loaded before the replay ends.
+    const auto wait_start = std::chrono::steady_clock::now();
+    while (replaying && std::chrono::steady_clock::now() - wait_start < std::chrono::milliseconds(INBOX_WAIT_MS))
+        replay_records(STARTUP_REPLAY_MAX_APPLY);
+
+    // Gather all messages that are addressed to this user. While replaying, deleted messages are only gone from the message index.
     const std::string &username = users.at(index).name();
-    Util::IchigoVector<Message> messages_for_user;
+    // Nothing changes the message store until they are sent, so the messages are gathered by pointer instead of copied.
+    Util::IchigoVector<const Message *> messages_for_user;
     for (u32 i = 0; i < messages.size(); ++i) {
+        if (replaying && !message_indices.contains(messages.at(i).id()))
+            continue;
+
         if (messages.at(i).recipient()->usernames().index_of(username) != -1)
-            messages_for_user.append(messages.at(i));
+            messages_for_user.append(&messages.at(i));
     }
 
     // Step 4
@@ -755,173 +1103,1095 @@ static void get_messages(i32 socket) {
 
     // Step 5
     for (u32 i = 0; i < message_count; ++i) {
-        i32 message_id = messages_for_user.at(i).id();
+        i32 message_id = messages_for_user.at(i)->id();
         send(socket, reinterpret_cast<char *>(&message_id), sizeof(message_id), 0);
 
-        u32 size = messages_for_user.at(i).sender()->name().length();
+        u32 size = messages_for_user.at(i)->sender()->name().length();
+        send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
+        send(socket, messages_for_user.at(i)->sender()->name().c_str(), size, 0);
+
+        size = messages_for_user.at(i)->content().length();
         send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
-        send(socket, messages_for_user.at(i).sender()->name().c_str(), size, 0);
+        send(socket, messages_for_user.at(i)->content().c_str(), size, 0);
 
-        size = messages_for_user.at(i).content().length();
+        size = messages_for_user.at(i)->attachment_digest().length();
         send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
-        send(socket, messages_for_user.at(i).content().c_str(), size, 0);
+        send(socket, messages_for_user.at(i)->attachment_digest().c_str(), size, 0);
+
+        size = messages_for_user.at(i)->attachment_name().length();
+        send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
+        send(socket, messages_for_user.at(i)->attachment_name().c_str(), size, 0);
     }
 
     // Step 6
-    buffer[0] = Error::SUCCESS;
+    buffer[0] = replaying ? Error::PARTIAL : Error::SUCCESS;
     send(socket, buffer, 1, 0);
 }
 
 /*
-    Close all connections to sockets that have not sent Opcode::HEARTBEAT in more than 20 seconds.
-    They are presumed to be dead at that point.
-*/
-static void prune_dead_connections() {
-    u64 now = time(nullptr);
-    for (u32 i = 0; i < connection_heartbeat_times.size(); ++i) {
-        if (now - connection_heartbeat_times.at(i) > 20) {
-            ICHIGO_INFO("Socket did not say goodbye properly, but they are assumed to be dead since the last heartbeat was a long time ago!");
-            i32 user_index = find_user_index_by_socket_fd(poll_connection_fds.at(i).fd);
-
-            if (user_index != -1) {
-                users.at(user_index).set_logged_in(false);
-                users.at(user_index).set_status("Offline");
-                users.at(user_index).set_connection_fd(-1);
-            }
+    Begin (or resume) uploading an attachment to the blob store.
 
-            goodbye(poll_connection_fds.at(i).fd);
-        }
-    }
-}
+    The flow between the server and the client is as follows:
+    1. Receive the ID of the logged in user.
+    2. Resolve this user. If the user was not found, is not logged in, or the socket fds do not match, send Error::INVALID_REQUEST and abort.
+    3. Send Error::SUCCESS.
+    4. Receive the SHA-256 digest of the attachment as a string, and the size of the attachment (u64).
+    5. If the digest is malformed, the attachment is too large, or the upload cannot be begun (eg. an empty attachment that does
+       not match its digest), send Error::INVALID_REQUEST and abort.
+    6. Send Error::SUCCESS.
+    7. Send the number of bytes of the attachment already stored (u64). If this is equal to the size, the attachment is
+       already stored (by any user) and nothing has to be uploaded. Otherwise, the client sends the remaining bytes
+       starting at this offset with UPLOAD_ATTACHMENT_CHUNK.
 
-/*
-    Init and run server.
+    Parameter 'socket': The client socket we are talking to.
 */
-void ChatServer::init() {
-    // Initialize the journal with the default filename of "default.chatjournal".
-    Journal::init("default.chatjournal");
+static void upload_attachment(u32 socket) {
+    // Step 1
+    i32 id;
+    RETURN_IF_DROPPED(poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id)));
 
-    // Read all transactions from the journal file to rebuild the user, group, and message stores.
-    while (Journal::has_more_transactions()) {
-        Journal::Transaction *transaction = Journal::next_transaction();
-        if (!transaction) {
-            ICHIGO_ERROR("Failed to parse transaction. The server will now operate without a journal!");
-            break;
-        }
+    // Step 2
+    i32 index = find_user_index_by_id(id);
+    if (index == -1 || !users.at(index).is_logged_in() || users.at(index).connection_fd() != socket) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
 
-        switch (transaction->operation()) {
-            case Journal::Operation::NEW_USER: {
-                Journal::NewUserTransaction *new_user_transaction = static_cast<Journal::NewUserTransaction *>(transaction);
-                ICHIGO_INFO("New user read from journal: %s", new_user_transaction->username().c_str());
-                users.append(ServerUser(new_user_transaction->username()));
-            } break;
-            case Journal::Operation::NEW_MESSAGE: {
-                Journal::NewMessageTransaction *new_message_transaction = static_cast<Journal::NewMessageTransaction *>(transaction);
-                ICHIGO_INFO("New message read from journal: sender=%s recipient=%s content=%s", new_message_transaction->sender().c_str(), new_message_transaction->recipient().c_str(), new_message_transaction->content().c_str());
-                i32 sender_index = find_user_index_by_name(new_message_transaction->sender());
-                assert(sender_index != -1);
-
-                Recipient *recipient = nullptr;
-                if (new_message_transaction->recipient_type() == RECIPIENT_TYPE_USER) {
-                    i32 recipient_index = find_user_index_by_name(new_message_transaction->recipient());
-                    assert(recipient_index != -1);
-                    recipient = &users.at(recipient_index);
-                    // The journal is expected to have updated the 'next id' through the 'UPDATE_ID' transaction before adding a new message
-                    messages.append(Message(new_message_transaction->content(), recipient, &users.at(sender_index), next_id));
-                } else if (new_message_transaction->recipient_type() == RECIPIENT_TYPE_GROUP) {
-                    i32 group_index = find_group_index_by_name(new_message_transaction->recipient());
-                    assert(group_index != -1);
-                    Group &group = groups.at(group_index);
-                    for (u32 i = 0; i < group.usernames().size(); ++i) {
-                        i32 user_index = find_user_index_by_name(group.usernames().at(i));
-                        assert(user_index != -1);
-                        ICHIGO_INFO("Sending group message to %s content %s", users.at(user_index).name().c_str(), new_message_transaction->content().c_str());
-                        messages.append(Message(new_message_transaction->content(), &users.at(user_index), &users.at(sender_index), next_id++));
-                    }
-                } else {
-                    ICHIGO_ERROR("Invalid recipient type when reading new message from journal");
-                    continue;
-                }
-            } break;
-            case Journal::Operation::DELETE_MESSAGE: {
-                Journal::DeleteMessageTransaction *delete_message_transaction = static_cast<Journal::DeleteMessageTransaction *>(transaction);
-                ICHIGO_INFO("Deleting message id: %u", delete_message_transaction->id());
-                i32 message_index = find_message_index_by_id(delete_message_transaction->id());
-                assert(message_index != -1);
-                messages.remove(message_index);
-            }; break;
-            case Journal::Operation::UPDATE_ID: {
-                Journal::UpdateIdTransaction *update_id_transaction = static_cast<Journal::UpdateIdTransaction *>(transaction);
-                ICHIGO_INFO("Updating next id from journal: %u", update_id_transaction->id());
-                next_id = update_id_transaction->id();
-            } break;
-            case Journal::Operation::NEW_GROUP: {
-                Journal::NewGroupTransaction *new_group_transaction = static_cast<Journal::NewGroupTransaction *>(transaction);
-                ICHIGO_INFO("New group read from journal: %s users: %u", new_group_transaction->name().c_str(), new_group_transaction->user_count());
-                groups.append(Group(new_group_transaction->name(), new_group_transaction->users()));
-            } break;
-            default: {
-                ICHIGO_ERROR("Unimplemented");
-            }
-        }
+    // Step 3
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
+
+    // Step 4
+    std::string digest;
+    u64 size;
+    RETURN_IF_DROPPED(poll_recv_string(socket, digest, 64));
+    RETURN_IF_DROPPED(poll_recv_all(socket, reinterpret_cast<char *>(&size), sizeof(size)));
 
-        Journal::return_transaction(transaction);
+    // Step 5
+    u64 offset;
+    if (!Util::Sha256::is_valid_digest(digest) || size > CHAT_MAX_ATTACHMENT_SIZE || !BlobStore::begin_upload(users.at(index).name(), digest, size, &offset)) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
     }
 
-    ICHIGO_INFO("Running");
+    // Step 6
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
 
-    // Initialize winsock2
-    [[maybe_unused]] WSADATA wsa_data;
-    assert(WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0);
+    // Step 7
+    send(socket, reinterpret_cast<char *>(&offset), sizeof(offset), 0);
+    ICHIGO_INFO("Attachment upload %s: %llu of %llu bytes already stored", digest.c_str(), static_cast<unsigned long long>(offset), static_cast<unsigned long long>(size));
+}
 
-    // Listen on localhost port 8080
-    u32 listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    InetPton(AF_INET, "127.0.0.1", &server_addr.sin_addr.S_un.S_addr);
-    server_addr.sin_port = htons(8080);
+/*
+    Receive one chunk of an attachment upload. Each chunk is its own request so that other clients are served
+    between the chunks of a large upload.
 
-    assert(bind(listen_fd, reinterpret_cast<sockaddr *>(&server_addr), sizeof(server_addr)) != SOCKET_ERROR);
-    assert(listen(listen_fd, 10) != SOCKET_ERROR);
+    The flow between the server and the client is as follows:
+    1. Receive the ID of the logged in user.
+    2. Resolve this user. If the user was not found, is not logged in, or the socket fds do not match, send Error::INVALID_REQUEST and abort.
+    3. Send Error::SUCCESS.
+    4. Receive the SHA-256 digest of the attachment as a string, the offset of the chunk (u64), and the length of the chunk (u32).
+    5. If the chunk is longer than CHAT_ATTACHMENT_CHUNK_SIZE, send Error::INVALID_REQUEST and abort. Otherwise, send Error::SUCCESS.
+    6. Receive 'length' bytes of attachment data.
+    7. If the chunk was out of order, no upload is in progress, or this was the final chunk and the contents do not
+       match the digest, send Error::INVALID_REQUEST. Otherwise, send Error::SUCCESS.
 
-    // Set non-blocking IO mode so we can poll for new connections
-    unsigned long imode = 1;
-    ioctlsocket(listen_fd, FIONBIO, &imode);
+    Parameter 'socket': The client socket we are talking to.
+*/
+static void upload_attachment_chunk(u32 socket) {
+    // Step 1
+    i32 id;
+    RETURN_IF_DROPPED(poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id)));
 
-    pollfd poll_listen_fd {
-        .fd = listen_fd,
-        .events = POLLRDNORM,
-        .revents = 0,
-    };
+    // Step 2
+    i32 index = find_user_index_by_id(id);
+    if (index == -1 || !users.at(index).is_logged_in() || users.at(index).connection_fd() != socket) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
 
-    // Main server event loop
-    for (;;) {
-        // Look for new connections
-        i32 poll_result = WSAPoll(&poll_listen_fd, 1, 1);
+    // Step 3
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
 
-        if (poll_result == SOCKET_ERROR) {
-            ICHIGO_ERROR("Poll failed. Error code: %d", WSAGetLastError());
-            break;
-        }
+    // Step 4
+    std::string digest;
+    u64 offset;
+    u32 length;
+    RETURN_IF_DROPPED(poll_recv_string(socket, digest, 64));
+    RETURN_IF_DROPPED(poll_recv_all(socket, reinterpret_cast<char *>(&offset), sizeof(offset)));
+    RETURN_IF_DROPPED(poll_recv_all(socket, reinterpret_cast<char *>(&length), sizeof(length)));
 
-        // Accept a new connection if one is being made and set up corresponding data
-        if (poll_result > 0 && poll_listen_fd.revents & POLLRDNORM) {
-            u32 connection_fd = accept(listen_fd, nullptr, nullptr);
-            poll_connection_fds.append({ connection_fd, POLLRDNORM, 0 });
-            connection_heartbeat_times.append(time(nullptr));
+    // Step 5
+    if (length > sizeof(chunk_buffer)) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
 
-            ICHIGO_INFO("Accepted new connection");
-        }
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
 
-        // Check if any client has sent us new data to process.
-        poll_result = WSAPoll(poll_connection_fds.data(), poll_connection_fds.size(), 1);
+    // Step 6
+    RETURN_IF_DROPPED(poll_recv_all(socket, chunk_buffer, length));
 
-        if (poll_result > 0) {
-            for (u32 i = 0; i < poll_connection_fds.size(); ++i) {
-                if (poll_connection_fds.at(i).revents & POLLRDNORM) {
-                    u32 connection_fd = poll_connection_fds.at(i).fd;
+    // Step 7
+    buffer[0] = BlobStore::write_chunk(digest, offset, chunk_buffer, length) ? Error::SUCCESS : Error::INVALID_REQUEST;
+    send(socket, buffer, 1, 0);
+}
 
-                    // Receive the opcode of the operation the client wishes to complete, then execute the corresponding conversation function.
+/*
+    Check that a user may download an attachment, and tell the client if not.
+    Parameter 'socket': The client socket we are talking to.
+    Parameter 'user_index': The index of the user, or -1 if it could not be resolved.
+    Parameter 'digest': The SHA-256 digest of the attachment.
+    Returns whether or not the download may go ahead. If not, Error::INVALID_REQUEST (the user could not be resolved, or the
+    attachment is not stored) or Error::UNAUTHORIZED (the user did not send or receive a message with it) was sent.
+*/
+static bool authorize_download(u32 socket, i32 user_index, const std::string &digest) {
+    if (user_index == -1 || !users.at(user_index).is_logged_in() || users.at(user_index).connection_fd() != socket || !BlobStore::contains(digest)) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return false;
+    }
+
+    if (!may_download_attachment(digest, users.at(user_index).name())) {
+        buffer[0] = Error::UNAUTHORIZED;
+        send(socket, buffer, 1, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+    Begin the download of an attachment. The attachment is then downloaded a chunk at a time with
+    Opcode::DOWNLOAD_ATTACHMENT_CHUNK, so that other clients are served between the chunks of a large download.
+
+    The flow between the server and the client is as follows:
+    1. Receive the ID of the logged in user.
+    2. Receive the SHA-256 digest of the attachment as a string.
+    3. If the user was not found, is not logged in, or the socket fds do not match, or the attachment is not stored, send
+       Error::INVALID_REQUEST and abort. If the user did not send or receive a message with this attachment, send Error::UNAUTHORIZED and abort.
+    4. Send Error::SUCCESS, followed by the size of the attachment (u64).
+
+    Parameter 'socket': The client socket we are talking to.
+*/
+static void download_attachment(u32 socket) {
+    // Step 1
+    i32 id;
+    RETURN_IF_DROPPED(poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id)));
+
+    // Step 2
+    std::string digest;
+    RETURN_IF_DROPPED(poll_recv_string(socket, digest, 64));
+
+    // Step 3
+    if (!authorize_download(socket, find_user_index_by_id(id), digest))
+        return;
+
+    // Step 4
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
+    u64 size = BlobStore::size_of(digest);
+    send(socket, reinterpret_cast<char *>(&size), sizeof(size), 0);
+}
+
+/*
+    Send one chunk of an attachment download. The chunk is sent straight from the blob store file to the socket by the
+    platform layer, so its contents are never copied through user space. The client can pick up an interrupted download
+    from any offset.
+
+    The flow between the server and the client is as follows:
+    1. Receive the ID of the logged in user.
+    2. Receive the SHA-256 digest of the attachment as a string, and the offset of the chunk (u64).
+    3. Send Error::INVALID_REQUEST or Error::UNAUTHORIZED and abort, as for Opcode::DOWNLOAD_ATTACHMENT. Also send
+       Error::INVALID_REQUEST and abort if the offset is not inside the attachment.
+    4. Send Error::SUCCESS, followed by the next CHAT_ATTACHMENT_CHUNK_SIZE bytes of the attachment from the offset (or the
+       rest of it, if less).
+
+    Parameter 'socket': The client socket we are talking to.
+*/
+static void download_attachment_chunk(u32 socket) {
+    // Step 1
+    i32 id;
+    RETURN_IF_DROPPED(poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id)));
+
+    // Step 2
+    std::string digest;
+    u64 offset;
+    RETURN_IF_DROPPED(poll_recv_string(socket, digest, 64));
+    RETURN_IF_DROPPED(poll_recv_all(socket, reinterpret_cast<char *>(&offset), sizeof(offset)));
+
+    // Step 3
+    if (!authorize_download(socket, find_user_index_by_id(id), digest))
+        return;
+
+    u64 size = BlobStore::size_of(digest);
+    if (offset >= size) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
+
+    // Step 4
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
+
+    u32 length = size - offset < CHAT_ATTACHMENT_CHUNK_SIZE ? size - offset : CHAT_ATTACHMENT_CHUNK_SIZE;
+    if (!ChatServer::platform_send_file(socket, BlobStore::path_of(digest), offset, length))
+        ICHIGO_ERROR("Failed to send attachment %s", digest.c_str());
+}
+
+/*
+    Take a backup of the journal (and the latest snapshot) while the server keeps running. The backup is written next to the journal
+    under the name given, as a journal of its own that the server can be started from with '--journal-name'.
+
+    The flow between the server and the client is as follows:
+    1. Receive the ID of the logged in user.
+    2. Resolve this user. If it is not logged in, was not found, or the socket fds do not match, send Error::INVALID_REQUEST.
+       If it is not the admin user (see '--admin'), send Error::UNAUTHORIZED. Otherwise, send Error::SUCCESS.
+    3. Receive the name of the backup.
+    4. If the name is not a plain file name, a journal by that name exists, or a backup is already being taken, send Error::INVALID_REQUEST.
+    5. Once the backup is complete and durable, send Error::SUCCESS followed by the journal position the backup covers up to (u64).
+       If it could not be written, send Error::INVALID_REQUEST. (See 'check_backup()'.)
+
+    Parameter 'socket': The client socket we are talking to.
+*/
+static void backup(u32 socket) {
+    // Step 1
+    i32 id;
+    RETURN_IF_DROPPED(poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id)));
+
+    // Step 2
+    i32 index = find_user_index_by_id(id);
+    if (index == -1 || !users.at(index).is_logged_in() || users.at(index).connection_fd() != socket) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
+
+    if (admin_username.empty() || users.at(index).name() != admin_username) {
+        ICHIGO_INFO("User \"%s\" is not allowed to take backups", users.at(index).name().c_str());
+        buffer[0] = Error::UNAUTHORIZED;
+        send(socket, buffer, 1, 0);
+        return;
+    }
+
+    buffer[0] = Error::SUCCESS;
+    send(socket, buffer, 1, 0);
+
+    // Step 3
+    std::string name;
+    RETURN_IF_DROPPED(poll_recv_string(socket, name, CHAT_MAX_ATTACHMENT_NAME_LENGTH));
+
+    // Step 4
+    const std::string journal_name = name + ".chatjournal";
+    if (name.empty() || name.find_first_of("/\\:") != std::string::npos || name == "." || name == ".." || journal_name == journal_filename
+     || ChatServer::platform_file_exists((journal_name + ".manifest").c_str()) || ChatServer::platform_file_exists(journal_name.c_str())
+     || backup_socket != -1 || Journal::backup_in_progress()) {
+        buffer[0] = Error::INVALID_REQUEST;
+        send(socket, buffer, 1, 0);
+        return;
+    }
+
+    // Step 5
+    backup_socket  = socket;
+    backup_started = false;
+    backup_name    = name;
+}
+
+/*
+    Move the backup requested by a client along: begin it once no snapshot is being written, and send the client the result once it
+    is done. The journal is copied in the background, so this never waits on the disk. See 'backup()'.
+*/
+static void check_backup() {
+    if (backup_socket == -1)
+        return;
+
+    // The client is blocked on the result, so it cannot send heartbeats in the meantime.
+    for (u32 i = 0; i < poll_connection_fds.size(); ++i) {
+        if (poll_connection_fds.at(i).fd == static_cast<u32>(backup_socket))
+            connection_heartbeat_times.at(i) = time(nullptr);
+    }
+
+    bool succeeded = false;
+    if (!backup_started) {
+        if (Journal::snapshot_in_progress())
+            return;
+
+        backup_started = Journal::begin_backup(backup_name + ".chatjournal", backup_name + ".chatsnapshot", &backup_position);
+        if (backup_started)
+            return;
+    } else if (!Journal::poll_backup(&succeeded)) {
+        return;
+    }
+
+    buffer[0] = succeeded ? Error::SUCCESS : Error::INVALID_REQUEST;
+    send(backup_socket, buffer, 1, 0);
+    if (succeeded)
+        send(backup_socket, reinterpret_cast<char *>(&backup_position), sizeof(backup_position), 0);
+
+    backup_socket = -1;
+}
+
+/*
+    Refuse a conversation that would change the state of the server, because this server is a read-only follower.
+
+    The flow between the server and the client is as follows:
+    1. Receive the first step of the conversation as usual (the name for REGISTER and REGISTER_GROUP, the ID of the logged in user otherwise).
+    2. Send Error::INVALID_REQUEST, which the client reads as the result of that step.
+
+    Parameter 'socket': The client socket we are talking to.
+    Parameter 'opcode': The opcode the client sent.
+    Returns whether or not the conversation was refused (ie. it would have changed the state of the server).
+*/
+static bool reject_write(u32 socket, Opcode opcode) {
+    // Step 1
+    i32 n;
+    switch (opcode) {
+        case Opcode::REGISTER: {
+            n = poll_recv(socket, buffer, sizeof(buffer) - 1);
+        } break;
+        case Opcode::REGISTER_GROUP: {
+            std::string name;
+            n = poll_recv_string(socket, name, sizeof(buffer) - 1);
+        } break;
+        case Opcode::SEND_MESSAGE:
+        case Opcode::DELETE_MESSAGE:
+        case Opcode::UPLOAD_ATTACHMENT:
+        case Opcode::UPLOAD_ATTACHMENT_CHUNK: {
+            i32 id;
+            n = poll_recv(socket, reinterpret_cast<char *>(&id), sizeof(id));
+        } break;
+        default: {
+            return false;
+        }
+    }
+
+    // Step 2
+    if (n == -1) {
+        ICHIGO_ERROR("Client dropped connection");
+        return true;
+    }
+
+    buffer[0] = Error::INVALID_REQUEST;
+    send(socket, buffer, 1, 0);
+    return true;
+}
+
+/*
+    Carry out the conversation the client asked for.
+    Parameter 'socket': The client socket we are talking to.
+    Parameter 'opcode': The opcode the client sent.
+*/
+static void converse(u32 socket, Opcode opcode) {
+    switch (opcode) {
+        case Opcode::SEND_MESSAGE:   send_message(socket);   break;
+        case Opcode::DELETE_MESSAGE: delete_message(socket); break;
+        case Opcode::GET_MESSAGES:   get_messages(socket);   break;
+        case Opcode::REGISTER:       register_user(socket);  break;
+        case Opcode::REGISTER_GROUP: register_group(socket); break;
+        case Opcode::LOGIN:          login(socket);          break;
+        case Opcode::LOGOUT:         logout(socket);         break;
+        case Opcode::GET_USERS:      get_users(socket);      break;
+        case Opcode::GET_GROUPS:     get_groups(socket);     break;
+        case Opcode::SET_STATUS:     set_status(socket);     break;
+        case Opcode::GOODBYE:        goodbye(socket);        break;
+        case Opcode::HEARTBEAT:      heartbeat(socket);      break;
+        case Opcode::UPLOAD_ATTACHMENT:         upload_attachment(socket);         break;
+        case Opcode::UPLOAD_ATTACHMENT_CHUNK:   upload_attachment_chunk(socket);   break;
+        case Opcode::DOWNLOAD_ATTACHMENT:       download_attachment(socket);       break;
+        case Opcode::DOWNLOAD_ATTACHMENT_CHUNK: download_attachment_chunk(socket); break;
+        case Opcode::BACKUP:                    backup(socket);                    break;
+    }
+}
+
+/*
+    Hold back a conversation that needs the whole message history until the replay is done. Conversations that change the state
+    of the server, or look messages up by ID, need it. The client is blocked on the result in the meantime, so the server keeps
+    replaying (and serving other clients) instead of waiting on the rest of the replay here.
+    Parameter 'socket': The client socket we are talking to.
+    Parameter 'opcode': The opcode the client sent.
+    Returns whether or not the conversation was held back.
+*/
+static bool defer_request(u32 socket, Opcode opcode) {
+    if (!replaying || (opcode != Opcode::SEND_MESSAGE && opcode != Opcode::DELETE_MESSAGE && opcode != Opcode::REGISTER
+                    && opcode != Opcode::REGISTER_GROUP && opcode != Opcode::DOWNLOAD_ATTACHMENT && opcode != Opcode::DOWNLOAD_ATTACHMENT_CHUNK))
+        return false;
+
+    deferred_requests.append({ socket, opcode });
+    return true;
+}
+
+/*
+    Check whether a conversation is being held back on a socket. The rest of its request is not read until it is carried out.
+    Parameter 'socket': The client socket to check.
+*/
+static bool is_deferred(u32 socket) {
+    for (u32 i = 0; i < deferred_requests.size(); ++i) {
+        if (deferred_requests.at(i).socket == socket)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+    Carry out the conversations held back while replaying, once the replay is done. Until then, their clients are kept from
+    being presumed dead, since they cannot send heartbeats while blocked on the result.
+*/
+static void run_deferred_requests() {
+    if (deferred_requests.size() == 0)
+        return;
+
+    if (replaying) {
+        for (u32 i = 0; i < poll_connection_fds.size(); ++i) {
+            if (is_deferred(poll_connection_fds.at(i).fd))
+                connection_heartbeat_times.at(i) = time(nullptr);
+        }
+
+        return;
+    }
+
+    for (u32 i = 0; i < deferred_requests.size(); ++i)
+        converse(deferred_requests.at(i).socket, deferred_requests.at(i).opcode);
+
+    deferred_requests.clear();
+}
+
+/*
+    Close all connections to sockets that have not sent Opcode::HEARTBEAT in more than 20 seconds.
+    They are presumed to be dead at that point.
+*/
+static void prune_dead_connections() {
+    u64 now = time(nullptr);
+    for (u32 i = 0; i < connection_heartbeat_times.size(); ++i) {
+        if (now - connection_heartbeat_times.at(i) > 20) {
+            ICHIGO_INFO("Socket did not say goodbye properly, but they are assumed to be dead since the last heartbeat was a long time ago!");
+            i32 user_index = find_user_index_by_socket_fd(poll_connection_fds.at(i).fd);
+
+            if (user_index != -1) {
+                users.at(user_index).set_logged_in(false);
+                users.at(user_index).set_status("Offline");
+                users.at(user_index).set_connection_fd(-1);
+            }
+
+            goodbye(poll_connection_fds.at(i).fd);
+        }
+    }
+}
+
+/*
+    Apply a journal record to the user, group, and message stores. Used to replay the journal at startup, and by followers
+    to apply the records streamed from the primary. The record is only read: the stores get copies of what they keep.
+    Deleted messages are only dropped from the message index; call 'remove_deleted_messages()' once done applying records.
+    Nothing is logged per record, since a replay applies every record since the snapshot.
+    Parameter 'record': The record to apply.
+*/
+static void apply_record(const Journal::NewUserRecord &record) {
+    // Users created since the snapshot were already added when the journal was read ahead (see 'apply_ahead()').
+    if (user_indices.contains(record.username))
+        return;
+
+    user_indices.insert_or_assign(std::string(record.username), users.append(ServerUser(std::string(record.username))));
+}
+
+static void apply_record(const Journal::NewMessageRecord &record) {
+    i32 sender_index = find_indexed(user_indices, record.sender);
+    assert(sender_index != -1);
+
+    // Messages journaled before IDs were leased in blocks expect the 'next id' to have been updated through the 'UPDATE_ID' transaction before them.
+    const bool legacy_id = record.id == -1;
+    i32 message_id       = legacy_id ? next_id : record.id;
+
+    if (record.recipient_type == RECIPIENT_TYPE_USER) {
+        i32 recipient_index = find_indexed(user_indices, record.recipient);
+        assert(recipient_index != -1);
+        Message message(record.content, &users.at(recipient_index), &users.at(sender_index), message_id);
+        message.set_attachment(record.attachment_digest, record.attachment_name);
+        add_attachment_users(message);
+        message_indices[message_id] = messages.append(std::move(message));
+    } else if (record.recipient_type == RECIPIENT_TYPE_GROUP) {
+        i32 group_index = find_indexed(group_indices, record.recipient);
+        assert(group_index != -1);
+        const Util::IchigoVector<std::string> &members = groups.at(group_index).members();
+        for (u32 i = 0; i < members.size(); ++i) {
+            i32 user_index = find_indexed(user_indices, members.at(i));
+            assert(user_index != -1);
+            Message message(record.content, &users.at(user_index), &users.at(sender_index), message_id);
+            message.set_attachment(record.attachment_digest, record.attachment_name);
+            add_attachment_users(message);
+            message_indices[message_id++] = messages.append(std::move(message));
+        }
+
+        if (legacy_id)
+            next_id = message_id;
+    } else {
+        ICHIGO_ERROR("Invalid recipient type when reading new message from journal");
+    }
+}
+
+static void apply_record(const Journal::DeleteMessageRecord &record) {
+    auto it = message_indices.find(record.id);
+    assert(it != message_indices.end());
+    deleted_bytes_since_snapshot += message_record_size(messages.at(it->second));
+    remove_attachment_users(messages.at(it->second));
+    message_indices.erase(it);
+}
+
+static void apply_record(const Journal::UpdateIdRecord &record) {
+    next_id        = record.id;
+    id_lease_limit = record.id;
+}
+
+static void apply_record(const Journal::NewGroupRecord &record) {
+    if (group_indices.contains(record.name))
+        return;
+
+    Util::IchigoVector<std::string> members;
+    u32 offset = 0;
+    for (u32 i = 0; i < record.user_count; ++i)
+        members.append(std::string(record.next_user(&offset)));
+
+    group_indices.insert_or_assign(std::string(record.name), groups.append(Group(record.name, std::move(members))));
+}
+
+static void apply_record(const Journal::RestoreMessageRecord &record) {
+    i32 sender_index    = find_indexed(user_indices, record.sender);
+    i32 recipient_index = find_indexed(user_indices, record.recipient);
+    assert(sender_index != -1 && recipient_index != -1);
+    Message message(record.content, &users.at(recipient_index), &users.at(sender_index), record.id);
+    message.set_attachment(record.attachment_digest, record.attachment_name);
+    add_attachment_users(message);
+    message_indices[record.id] = messages.append(std::move(message));
+}
+
+static void apply_record(const Journal::Record &record) {
+    std::visit([](const auto &record) { apply_record(record); }, record);
+}
+
+/*
+    Add a user or group created in the journal after the snapshot before replay gets to it, so that logins (and the user and
+    group lists) are answered without waiting on the rest of the history. Replay skips the record once it reaches it.
+    Parameter 'record': A NEW_USER or NEW_GROUP record read ahead by 'Journal::read_ahead()'.
+*/
+static void apply_ahead(const Journal::Record &record) {
+    apply_record(record);
+}
+
+/*
+    Remove the messages deleted by the records applied since the last call in a single pass, keeping the rest in order.
+*/
+static void remove_deleted_messages() {
+    if (message_indices.size() == messages.size())
+        return;
+
+    u32 kept = 0;
+    for (u32 i = 0; i < messages.size(); ++i) {
+        // The messages removed so far are gone from in front of this one, so it is at 'kept' as far as the encodings of the state go.
+        auto it = message_indices.find(messages.at(i).id());
+        if (it == message_indices.end()) {
+            message_removed(kept, messages.at(i));
+            continue;
+        }
+
+        if (kept != i) {
+            messages.at(kept) = std::move(messages.at(i));
+            it->second        = kept;
+        }
+
+        ++kept;
+    }
+
+    ICHIGO_INFO("Removed %u deleted messages", static_cast<u32>(messages.size() - kept));
+    while (messages.size() > kept)
+        messages.remove(messages.size() - 1);
+}
+
+/*
+    Drop the indexes used while applying journal records. The server looks users, groups, and messages up by scanning
+    the stores once it takes requests of its own, so the indexes would go stale.
+*/
+static void clear_indexes() {
+    user_indices.clear();
+    group_indices.clear();
+    message_indices.clear();
+}
+
+/*
+    Begin encoding the server state as of now. An encoding already begun with the cursor is abandoned.
+    Parameter 'cursor': The cursor to encode the state with 'write_state()'.
+*/
+static void begin_state(StateCursor &cursor) {
+    cursor.active         = true;
+    cursor.user_end       = users.size();
+    cursor.group_end      = groups.size();
+    cursor.message_end    = messages.size();
+    cursor.next_user      = 0;
+    cursor.next_group     = 0;
+    cursor.next_message   = 0;
+    cursor.id_lease_limit = id_lease_limit;
+    cursor.deleted_messages.clear();
+}
+
+/*
+    Encode the next part of the server state as journal transactions, at most STATE_ENCODE_MAX_RECORDS of them. The same state is
+    written to snapshots and sent to new followers: every user and group first, then the messages, then the ID lease.
+    Parameter 'cursor': The encoding, begun with 'begin_state()'.
+    Parameter 'write': Called with each transaction.
+    Returns whether or not the whole state has been encoded. The cursor is then no longer active.
+*/
+template<typename F>
+static bool write_state(StateCursor &cursor, F write) {
+    // Deleted messages are simply not in the state. Messages are always addressed to a single user (group messages are fanned out).
+    const auto write_message = [&write](const Message &message) {
+        Journal::RestoreMessageTransaction transaction(message.id(), message.sender()->name(), message.recipient()->usernames().at(0), message.content(),
+                                                       message.attachment_digest(), message.attachment_name());
+        write(&transaction);
+    };
+
+    u32 written = 0;
+    for (; cursor.next_user < cursor.user_end && written < STATE_ENCODE_MAX_RECORDS; ++cursor.next_user, ++written) {
+        Journal::NewUserTransaction transaction(users.at(cursor.next_user).name());
+        write(&transaction);
+    }
+
+    for (; cursor.next_group < cursor.group_end && written < STATE_ENCODE_MAX_RECORDS; ++cursor.next_group, ++written) {
+        Journal::NewGroupTransaction transaction(groups.at(cursor.next_group).name(), groups.at(cursor.next_group).members());
+        write(&transaction);
+    }
+
+    for (; cursor.next_message < cursor.message_end && written < STATE_ENCODE_MAX_RECORDS; ++cursor.next_message, ++written)
+        write_message(messages.at(cursor.next_message));
+
+    // Messages deleted since the encoding began are still part of the state it is of: the deletes come after it.
+    for (; cursor.deleted_messages.size() > 0 && written < STATE_ENCODE_MAX_RECORDS; ++written)
+        write_message(cursor.deleted_messages.remove(cursor.deleted_messages.size() - 1));
+
+    if (written == STATE_ENCODE_MAX_RECORDS)
+        return false;
+
+    // Messages committed after this point may use any ID in the current lease.
+    Journal::UpdateIdTransaction transaction(cursor.id_lease_limit);
+    write(&transaction);
+    cursor.active = false;
+    return true;
+}
+
+/*
+    Encode the server state as journal records for a new follower, a part at a time.
+    Parameter 'out': The buffer to append the records to.
+    Parameter 'restart': Whether to begin a new encoding of the state as of now, instead of continuing the one begun before.
+    Returns whether or not the whole state has been encoded.
+*/
+static bool encode_state_records(std::string &out, bool restart) {
+    if (restart)
+        begin_state(bootstrap_cursor);
+
+    return write_state(bootstrap_cursor, [&out](const Journal::Transaction *transaction) { Journal::encode_record(transaction, out); });
+}
+
+/*
+    Encode the next part of the snapshot being taken, and once all of it is encoded, have it written in the background. The state
+    is encoded on the server thread, a part per event loop iteration, so it is consistent with the journal; only the file I/O
+    happens in the background. Once it is durable, the journal before it is deleted.
+*/
+static void continue_snapshot() {
+    if (snapshot_cursor.active && write_state(snapshot_cursor, Journal::snapshot_transaction))
+        Journal::finish_snapshot();
+}
+
+/*
+    Take a snapshot of the server state as of now. See 'continue_snapshot()'.
+*/
+static void take_snapshot() {
+    Journal::begin_snapshot();
+    begin_state(snapshot_cursor);
+    deleted_bytes_since_snapshot = 0;
+    continue_snapshot();
+}
+
+/*
+    Take a snapshot of the server state once enough has been written to the journal since the last one (or enough of it
+    is deleted messages), and move along the snapshot being encoded or written in the background.
+*/
+static void maybe_take_snapshot() {
+    if (replaying)
+        return;
+
+    continue_snapshot();
+    Journal::poll_snapshot();
+
+    if (Journal::snapshot_in_progress() || Journal::backup_in_progress())
+        return;
+
+    if (Journal::bytes_since_snapshot() >= snapshot_interval_bytes || deleted_bytes_since_snapshot >= snapshot_interval_bytes / 4)
+        take_snapshot();
+}
+
+/*
+    Finish off the replay of the journal: drop the deleted messages and the indexes, and start taking on followers.
+*/
+static void end_replay() {
+    replaying = false;
+
+    // Cutting off a torn tail moved the end of the journal back, so the batches to come end before the one completed at startup.
+    // Counting from there would release their results before they are durable. Results pending on the old end wait for the next batch.
+    if (Journal::torn_tail_size() > 0) {
+        last_completed_batch = { Journal::flush(), true };
+        for (u32 i = 0; i < pending_results.size(); ++i)
+            pending_results.at(i).batch_end = 0;
+    }
+
+    remove_deleted_messages();
+    clear_indexes();
+    ICHIGO_INFO("Replay complete: %u users, %u groups, %u messages", static_cast<u32>(users.size()), static_cast<u32>(groups.size()),
+                static_cast<u32>(messages.size()));
+
+    // Replay threw away deleted messages. A snapshot now purges them from the journal, so the next start does not read them again.
+    // If a backup is being taken, the next regular snapshot does it instead.
+    if (deleted_bytes_since_snapshot > 0 && !Journal::backup_in_progress()) {
+        ICHIGO_INFO("Replay read about %llu bytes of deleted messages. Taking a snapshot to purge them from the journal.",
+                    static_cast<unsigned long long>(deleted_bytes_since_snapshot));
+        take_snapshot();
+    }
+
+    // Followers start following (and accepting followers of their own only once promoted) from here.
+    primary_contact_time = time(nullptr);
+    if (!read_only && replication_port != 0)
+        Replication::start_primary(replication_port);
+}
+
+/*
+    Begin replaying the journal just opened, to rebuild the user, group, and message stores from the latest snapshot and the journal.
+    A snapshot holds every user and group before its first message, and the users and groups created since are read ahead of the
+    rest of the journal, so only that much is replayed here. The messages are replayed from the event loop (see 'replay_records()'),
+    which also finishes the replay once it reaches the end. The stores are sized for the snapshot up front, so they do not grow
+    (and move every element) over and over during replay.
+*/
+static void begin_replay() {
+    last_completed_batch = { Journal::flush(), true };
+
+    u32 user_count, group_count, message_count;
+    Journal::snapshot_counts(&user_count, &group_count, &message_count);
+    users.reserve(user_count);
+    groups.reserve(group_count);
+    messages.reserve(message_count);
+
+    Journal::read_ahead(apply_ahead);
+    replaying = true;
+}
+
+static void replay_records(u32 max_records) {
+    Journal::Record record;
+    for (u32 applied = 0; applied < max_records; ++applied) {
+        if (!Journal::has_more_transactions()) {
+            end_replay();
+            return;
+        }
+
+        if (!Journal::next_record(&record)) {
+            ICHIGO_ERROR("Failed to parse transaction. The server will now operate without a journal!");
+            end_replay();
+            return;
+        }
+
+        apply_record(record);
+    }
+}
+
+/*
+    Close the journal, to open another in its place. Only logins are pending on a follower, and they committed nothing to the
+    journal, so their results are sent right away. A snapshot being encoded is abandoned with the journal.
+*/
+static void close_journal() {
+    for (u32 i = 0; i < pending_results.size(); ++i) {
+        char result = pending_results.at(i).result;
+        send(pending_results.at(i).socket, &result, 1, 0);
+    }
+
+    pending_results.clear();
+    Journal::deinit();
+    snapshot_cursor.active = false;
+    snapshot_cursor.deleted_messages.clear();
+}
+
+/*
+    Open a journal and skip to the end of it, without applying anything. The state is already in memory.
+    Parameter 'journal': The base path of the journal.
+    Parameter 'snapshot': The path of its snapshot.
+*/
+static void open_journal_at_end(const std::string &journal, const std::string &snapshot) {
+    Journal::init(journal, snapshot);
+    Journal::Record record;
+    while (Journal::has_more_transactions())
+        Journal::next_record(&record);
+
+    last_completed_batch = { Journal::flush(), true };
+}
+
+/*
+    Discard the user, group, and message stores.
+*/
+static void clear_state() {
+    messages.clear();
+    attachment_users.clear();
+    groups.clear();
+    users.clear();
+    clear_indexes();
+    next_id        = 0;
+    id_lease_limit = 0;
+    deleted_bytes_since_snapshot = 0;
+}
+
+/*
+    Discard all state before applying a new bootstrap from the primary. Clients logged in to this follower have to log in again
+    once the bootstrap is applied. The bootstrap is written to a journal of its own: the journal of this server is only replaced
+    by it once it is complete (see 'finish_bootstrap()'), so a follower that loses the primary midway still has its own history.
+*/
+static void reset_state() {
+    ICHIGO_INFO("Bootstrapping from the primary");
+
+    close_journal();
+    Journal::destroy(journal_filename + ".bootstrap", snapshot_filename + ".bootstrap");
+    open_journal_at_end(journal_filename + ".bootstrap", snapshot_filename + ".bootstrap");
+    bootstrap_journal_open = true;
+    clear_state();
+}
+
+/*
+    Make the journal that the bootstrap from the primary was written to the journal of this server, now that the bootstrap is complete.
+*/
+static void finish_bootstrap() {
+    ICHIGO_INFO("Bootstrap from the primary is complete. Replacing the journal of this server with it.");
+    bootstrap_journal_open = false;
+    close_journal();
+    if (!Journal::rename(journal_filename + ".bootstrap", snapshot_filename + ".bootstrap", journal_filename, snapshot_filename))
+        ICHIGO_ERROR("Failed to move the bootstrap from the primary into place. This server will bootstrap again after it restarts.");
+
+    open_journal_at_end(journal_filename, snapshot_filename);
+}
+
+/*
+    Throw away a bootstrap from the primary that did not complete, and go back to the journal of this server. The state is
+    replayed from it again, so clients logged in to this follower have to log in again.
+*/
+static void discard_bootstrap() {
+    ICHIGO_ERROR("Lost the primary before the bootstrap was complete. Going back to the journal of this server.");
+    bootstrap_journal_open = false;
+    close_journal();
+    Journal::destroy(journal_filename + ".bootstrap", snapshot_filename + ".bootstrap");
+    Journal::init(journal_filename, snapshot_filename);
+    clear_state();
+    begin_replay();
+}
+
+/*
+    Take over as the primary once the primary has been unreachable for too long. Everything the primary streamed is
+    already in this server's journal, and IDs continue after the last lease of the primary.
+*/
+static void promote() {
+    ICHIGO_INFO("The primary has been unreachable for %llu seconds. Taking over as the primary.", static_cast<unsigned long long>(promote_after_seconds));
+    read_only = false;
+    Replication::stop_following();
+    clear_indexes();
+    next_id = id_lease_limit;
+
+    if (replication_port != 0)
+        Replication::start_primary(replication_port);
+}
+
+/*
+    Apply the records streamed from the primary, reconnecting to it if the connection was lost. Every record is also
+    committed to this server's own journal, so a follower restarted without '--follow' continues as a primary.
+    A bootstrap is applied as fast as it arrives (clients are not served until it is complete, so they never see half of
+    it); after that, at most FOLLOWER_MAX_APPLY records are applied per call.
+*/
+static void follow_primary() {
+    // The records from the primary come after the whole of this server's own journal.
+    if (!read_only || replaying)
+        return;
+
+    const u64 now = time(nullptr);
+    if (!Replication::is_following()) {
+        if (bootstrap_journal_open) {
+            discard_bootstrap();
+            return;
+        }
+
+        if (promote_after_seconds > 0 && now - primary_contact_time >= promote_after_seconds) {
+            promote();
+            return;
+        }
+
+        // Try to reconnect at most once a second.
+        if (now == last_connect_attempt)
+            return;
+
+        last_connect_attempt = now;
+        if (!Replication::connect_to_primary(primary_port))
+            return;
+    }
+
+    for (u32 applied = 0; applied < FOLLOWER_MAX_APPLY || !Replication::bootstrapped(); ++applied) {
+        Journal::Record record;
+        std::string_view encoded;
+        bool reset;
+        if (!Replication::next_record(&record, &encoded, &reset))
+            break;
+
+        if (reset)
+            reset_state();
+
+        apply_record(record);
+        Journal::commit_record(encoded.data(), encoded.length());
+    }
+
+    remove_deleted_messages();
+    if (Replication::bootstrapped()) {
+        if (bootstrap_journal_open)
+            finish_bootstrap();
+
+        primary_contact_time = now;
+    }
+}
+
+/*
+    Init and run server.
+*/
+void ChatServer::init(i32 argc, char **argv) {
+    Journal::Durability durability = Journal::Durability::SYNC;
+    u32 sync_interval_ms           = 100;
+    u64 segment_size               = 64 * 1024 * 1024;
+    bool compress_segments         = true;
+    bool run_benchmark             = false;
+    u32 benchmark_records          = 20000;
+    u32 benchmark_batch            = 16;
+    u16 port                       = 8080;
+
+    for (i32 i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+
+        if (std::strcmp(argv[i], "--durability") == 0 && has_value) {
+            const char *mode = argv[++i];
+            if (std::strcmp(mode, "sync") == 0)
+                durability = Journal::Durability::SYNC;
+            else if (std::strcmp(mode, "interval") == 0)
+                durability = Journal::Durability::INTERVAL;
+            else if (std::strcmp(mode, "none") == 0)
+                durability = Journal::Durability::NONE;
+            else
+                ICHIGO_ERROR("Unknown durability mode: %s (expected sync, interval, or none)", mode);
+        } else if (std::strcmp(argv[i], "--sync-interval-ms") == 0 && has_value) {
+            sync_interval_ms = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--snapshot-interval-mb") == 0 && has_value) {
+            snapshot_interval_bytes = std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (std::strcmp(argv[i], "--segment-size-mb") == 0 && has_value) {
+            segment_size = std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (std::strcmp(argv[i], "--no-segment-compression") == 0) {
+            compress_segments = false;
+        } else if (std::strcmp(argv[i], "--port") == 0 && has_value) {
+            port = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--journal-name") == 0 && has_value) {
+            journal_filename  = std::string(argv[i + 1]) + ".chatjournal";
+            snapshot_filename = std::string(argv[++i]) + ".chatsnapshot";
+        } else if (std::strcmp(argv[i], "--replication-port") == 0 && has_value) {
+            replication_port = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--follow") == 0 && has_value) {
+            primary_port = std::strtoul(argv[++i], nullptr, 10);
+            read_only    = true;
+        } else if (std::strcmp(argv[i], "--admin") == 0 && has_value) {
+            admin_username = argv[++i];
+        } else if (std::strcmp(argv[i], "--promote-after-s") == 0 && has_value) {
+            promote_after_seconds = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--journal-benchmark") == 0) {
+            run_benchmark = true;
+        } else if (std::strcmp(argv[i], "--benchmark-records") == 0 && has_value) {
+            benchmark_records = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--benchmark-batch") == 0 && has_value) {
+            benchmark_batch = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            ICHIGO_ERROR("Unknown option: %s", argv[i]);
+        }
+    }
+
+    if (run_benchmark) {
+        JournalBenchmark::run(benchmark_records, benchmark_batch > 0 ? benchmark_batch : 1);
+        return;
+    }
+
+    // Initialize the journal with the default filename of "default.chatjournal". Snapshots of the server state are kept next to it.
+    Journal::set_segment_size(segment_size > 0 ? segment_size : 64 * 1024 * 1024);
+    Journal::set_segment_compression(compress_segments);
+    Journal::init(journal_filename, snapshot_filename);
+    Journal::set_durability(durability, sync_interval_ms);
+    ICHIGO_INFO("Journal durability: %s", durability == Journal::Durability::SYNC ? "sync" : durability == Journal::Durability::INTERVAL ? "interval" : "none");
+    // Attachments are stored next to the journal, one file per unique attachment.
+    BlobStore::init("attachments");
+
+    // Initialize winsock2
+    [[maybe_unused]] WSADATA wsa_data;
+    assert(WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0);
+
+    // Only the users and groups are read before taking requests. The messages are replayed from the event loop.
+    begin_replay();
+
+    ICHIGO_INFO("Running%s while replaying the message history", read_only ? " as a read-only follower" : "");
+
+    // Listen on localhost (port 8080 by default)
+    u32 listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    InetPton(AF_INET, "127.0.0.1", &server_addr.sin_addr.S_un.S_addr);
+    server_addr.sin_port = htons(port);
+
+    assert(bind(listen_fd, reinterpret_cast<sockaddr *>(&server_addr), sizeof(server_addr)) != SOCKET_ERROR);
+    assert(listen(listen_fd, 10) != SOCKET_ERROR);
+
+    // Set non-blocking IO mode so we can poll for new connections
+    unsigned long imode = 1;
+    ioctlsocket(listen_fd, FIONBIO, &imode);
+
+    pollfd poll_listen_fd {
+        .fd = listen_fd,
+        .events = POLLRDNORM,
+        .revents = 0,
+    };
+
+    // Main server event loop
+    for (;;) {
+        // Look for new connections. The replay does not wait on the sockets.
+        i32 poll_result = WSAPoll(&poll_listen_fd, 1, replaying ? 0 : 1);
+
+        if (poll_result == SOCKET_ERROR) {
+            ICHIGO_ERROR("Poll failed. Error code: %d", WSAGetLastError());
+            break;
+        }
+
+        // Accept a new connection if one is being made and set up corresponding data
+        if (poll_result > 0 && poll_listen_fd.revents & POLLRDNORM) {
+            u32 connection_fd = accept(listen_fd, nullptr, nullptr);
+            poll_connection_fds.append({ connection_fd, POLLRDNORM, 0 });
+            connection_heartbeat_times.append(time(nullptr));
+
+            ICHIGO_INFO("Accepted new connection");
+        }
+
+        // Check if any client has sent us new data to process. A follower in the middle of a bootstrap leaves them waiting.
+        const bool bootstrapping = read_only && Replication::is_following() && !Replication::bootstrapped();
+        poll_result = bootstrapping ? 0 : WSAPoll(poll_connection_fds.data(), poll_connection_fds.size(), replaying ? 0 : 1);
+
+        if (poll_result > 0) {
+            for (u32 i = 0; i < poll_connection_fds.size(); ++i) {
+                if (poll_connection_fds.at(i).revents & POLLRDNORM && !is_deferred(poll_connection_fds.at(i).fd)) {
+                    u32 connection_fd = poll_connection_fds.at(i).fd;
+
+                    // Receive the opcode of the operation the client wishes to complete, then execute the corresponding conversation function.
                     if (poll_recv(connection_fd, buffer, 1) == -1) {
                         ICHIGO_ERROR("Client dropped connection before sending opcode");
                         continue;
@@ -930,24 +2200,36 @@ void ChatServer::init() {
                     Opcode opcode = static_cast<Opcode>(buffer[0]);
                     ICHIGO_INFO("opcode=%d", opcode);
 
-                    switch (opcode) {
-                        case Opcode::SEND_MESSAGE:   send_message(connection_fd);   break;
-                        case Opcode::DELETE_MESSAGE: delete_message(connection_fd); break;
-                        case Opcode::GET_MESSAGES:   get_messages(connection_fd);   break;
-                        case Opcode::REGISTER:       register_user(connection_fd);  break;
-                        case Opcode::REGISTER_GROUP: register_group(connection_fd); break;
-                        case Opcode::LOGIN:          login(connection_fd);          break;
-                        case Opcode::LOGOUT:         logout(connection_fd);         break;
-                        case Opcode::GET_USERS:      get_users(connection_fd);      break;
-                        case Opcode::GET_GROUPS:     get_groups(connection_fd);     break;
-                        case Opcode::SET_STATUS:     set_status(connection_fd);     break;
-                        case Opcode::GOODBYE:        goodbye(connection_fd);        break;
-                        case Opcode::HEARTBEAT:      heartbeat(connection_fd);      break;
-                    }
+                    if (read_only && reject_write(connection_fd, opcode))
+                        continue;
+
+                    if (!defer_request(connection_fd, opcode))
+                        converse(connection_fd, opcode);
                 }
             }
         }
 
+        // Replay more of the message history, if the server is still loading it, then carry out what was waiting on it.
+        if (replaying)
+            replay_records(STARTUP_REPLAY_MAX_APPLY);
+
+        run_deferred_requests();
+
+        // Followers apply what the primary has streamed since the last iteration.
+        follow_primary();
+
+        // Everything committed during this iteration is made durable together before any of it is acknowledged.
+        release_durable_results();
+
+        // Stream what became durable to the followers, if this server is the primary.
+        Replication::serve_followers(encode_state_records);
+
+        // Snapshot the server state every so often so that the journal (and startup time) does not grow without limit.
+        maybe_take_snapshot();
+
+        // Answer the client waiting on a backup, once it is done.
+        check_backup();
+
         // Make sure to periodically check for dead connections.
         prune_dead_connections();
     }
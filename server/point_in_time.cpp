@@ -0,0 +1,182 @@
+/*
+    Point-in-time reconstruction implementation. See header (point_in_time.hpp) for public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "point_in_time.hpp"
+
+/*
+    Check if replaying a record would go past a bound.
+    Parameter 'record': The record.
+    Parameter 'position': The journal position just past the record.
+*/
+static bool past_bound(const PointInTime::Bound &bound, const Journal::Record &record, u64 position) {
+    if (position > bound.end_position)
+        return true;
+
+    if (bound.before_id == -1)
+        return false;
+
+    if (const Journal::NewMessageRecord *new_message = std::get_if<Journal::NewMessageRecord>(&record))
+        return new_message->id != -1 && new_message->id >= bound.before_id;
+
+    if (const Journal::RestoreMessageRecord *restore_message = std::get_if<Journal::RestoreMessageRecord>(&record))
+        return restore_message->id >= bound.before_id;
+
+    return false;
+}
+
+/*
+    Apply each type of record to a state. See 'PointInTime::apply()'.
+*/
+static void apply_record(PointInTime::State *state, const Journal::NewUserRecord &record, u64) {
+    state->users.append(std::string(record.username));
+}
+
+static void apply_record(PointInTime::State *state, const Journal::NewGroupRecord &record, u64) {
+    Util::IchigoVector<std::string> members;
+    u32 offset = 0;
+    for (u32 i = 0; i < record.user_count; ++i)
+        members.append(std::string(record.next_user(&offset)));
+
+    state->group_names.append(std::string(record.name));
+    state->groups[std::string(record.name)] = std::move(members);
+}
+
+static void apply_record(PointInTime::State *state, const Journal::NewMessageRecord &record, u64 position) {
+    // Messages journaled before IDs were leased in blocks take the next ID, like the server does on replay.
+    const bool legacy_id = record.id == -1;
+    i32 id               = legacy_id ? state->next_id : record.id;
+    PointInTime::Message message{ id, std::string(record.sender), std::string(record.recipient), "", std::string(record.content),
+                                  std::string(record.attachment_digest), std::string(record.attachment_name), position };
+
+    if (record.recipient_type == RECIPIENT_TYPE_USER) {
+        state->messages[id] = std::move(message);
+    } else if (record.recipient_type == RECIPIENT_TYPE_GROUP) {
+        auto group = state->groups.find(message.recipient);
+        if (group == state->groups.end()) {
+            ICHIGO_ERROR("Message %d was sent to group %s, which does not exist", id, message.recipient.c_str());
+            return;
+        }
+
+        message.group = message.recipient;
+        for (u32 i = 0; i < group->second.size(); ++i) {
+            message.id        = id;
+            message.recipient = group->second.at(i);
+            state->messages[id++] = message;
+        }
+
+        if (legacy_id)
+            state->next_id = id;
+    }
+}
+
+static void apply_record(PointInTime::State *state, const Journal::RestoreMessageRecord &record, u64 position) {
+    state->messages[record.id] = { static_cast<i32>(record.id), std::string(record.sender), std::string(record.recipient), "", std::string(record.content),
+                                   std::string(record.attachment_digest), std::string(record.attachment_name), position };
+}
+
+static void apply_record(PointInTime::State *state, const Journal::DeleteMessageRecord &record, u64) {
+    state->deleted += state->messages.erase(record.id);
+}
+
+static void apply_record(PointInTime::State *state, const Journal::UpdateIdRecord &record, u64) {
+    state->next_id        = record.id;
+    state->id_lease_limit = record.id;
+}
+
+void PointInTime::apply(State *state, const Journal::Record &record, u64 position) {
+    state->position = position;
+    ++state->records;
+    std::visit([&](const auto &record) { apply_record(state, record, position); }, record);
+}
+
+/*
+    Replay a journal into a state up to a bound.
+    Returns whether or not every record before the bound could be read.
+*/
+static bool replay(const std::string &journal_filename, const std::string &snapshot_filename, const PointInTime::Bound &bound, PointInTime::State *state) {
+    if (!Journal::open_read_only(journal_filename, snapshot_filename)) {
+        Journal::deinit();
+        return false;
+    }
+
+    // A snapshot (or, once compacted, the oldest live segment) that starts after the bound cannot show the state before it.
+    if (Journal::replay_position() > bound.end_position) {
+        ICHIGO_ERROR("Replay starts at journal position %llu, after the bound", static_cast<unsigned long long>(Journal::replay_position()));
+        Journal::deinit();
+        return false;
+    }
+
+    bool ret     = true;
+    bool stopped = false;
+    Journal::Record record;
+    while (Journal::has_more_transactions()) {
+        if (!Journal::next_record(&record)) {
+            ICHIGO_ERROR("Failed to read the record after journal position %llu", static_cast<unsigned long long>(state->position));
+            ret = false;
+            break;
+        }
+
+        if (past_bound(bound, record, Journal::replay_position())) {
+            stopped = true;
+            break;
+        }
+
+        PointInTime::apply(state, record, Journal::replay_position());
+    }
+
+    if (ret && !stopped && bound.end_position != UINT64_MAX && state->position < bound.end_position)
+        ICHIGO_INFO("The journal ends at position %llu, before the bound", static_cast<unsigned long long>(state->position));
+
+    Journal::deinit();
+    return ret;
+}
+
+bool PointInTime::reconstruct(const std::string &journal_filename, const std::string &snapshot_filename, const Bound &bound, State *state) {
+    *state = {};
+    if (!snapshot_filename.empty() && replay(journal_filename, snapshot_filename, bound, state))
+        return true;
+
+    // The snapshot is useless for a point before it was taken. The live segments may still reach back far enough.
+    if (!snapshot_filename.empty())
+        ICHIGO_INFO("Replaying the journal without the snapshot");
+
+    *state = {};
+    return replay(journal_filename, "", bound, state);
+}
+
+const PointInTime::Message *PointInTime::find_message(const State &state, i32 id) {
+    auto message = state.messages.find(id);
+    return message != state.messages.end() ? &message->second : nullptr;
+}
+
+Util::IchigoVector<const PointInTime::Message *> PointInTime::messages_of(const State &state, const std::string &username, const std::string &other) {
+    Util::IchigoVector<const Message *> ret;
+    for (const auto &[id, message] : state.messages) {
+        const bool sent     = message.sender == username;
+        const bool received = message.recipient == username;
+        if (!sent && !received)
+            continue;
+
+        // A group conversation is every copy the user received from the group, and (once) every message the user sent to it.
+        if (!other.empty()) {
+            if (message.group.empty() ? (sent ? message.recipient : message.sender) != other : message.group != other)
+                continue;
+        }
+
+        // Every copy of a group message the user sent has the user as its sender. Only the first copy left is listed.
+        if (!message.group.empty() && sent) {
+            auto previous = state.messages.find(id - 1);
+            if (previous != state.messages.end() && previous->second.position == message.position && previous->second.group == message.group
+             && previous->second.sender == username)
+                continue;
+        }
+
+        ret.append(&message);
+    }
+
+    return ret;
+}
@@ -0,0 +1,97 @@
+/*
+    Point-in-time reconstruction. Rebuilds the server state as of a point in the history of a journal into a state object of its
+    own, using the same replay as the server (see 'Journal::open_read_only()'), so incidents can be looked into without touching
+    the running server. Used by the 'state' command of chatjournal.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+
+#include "../common.hpp"
+#include "journal.hpp"
+#include <map>
+#include <string>
+#include <unordered_map>
+
+namespace PointInTime {
+    /*
+        A message in the reconstructed state. A group message has a copy (with its own ID) for every member of the group.
+    */
+    struct Message {
+        i32 id;
+        std::string sender;
+        // The user the message (or this copy of a group message) was delivered to.
+        std::string recipient;
+        // The group the message was sent to, or an empty string for a direct message.
+        std::string group;
+        std::string content;
+        std::string attachment_digest;
+        std::string attachment_name;
+        // The journal position just past the record that created the message (the snapshot position for messages from the snapshot).
+        u64 position;
+    };
+
+    /*
+        The server state as of a point in the journal.
+    */
+    struct State {
+        // Users and groups in the order they were created.
+        Util::IchigoVector<std::string> users;
+        Util::IchigoVector<std::string> group_names;
+        std::unordered_map<std::string, Util::IchigoVector<std::string>> groups;
+        // Live messages by ID. IDs are handed out in increasing order, so this is also the order they were sent in.
+        std::map<i32, Message> messages;
+        i32 next_id        = 0;
+        u32 id_lease_limit = 0;
+        u64 deleted        = 0;
+        // The journal position the state is as of, and the number of records applied to reach it.
+        u64 position       = 0;
+        u64 records        = 0;
+    };
+
+    /*
+        Where to stop replaying. The state is as of the earliest of the bounds.
+    */
+    struct Bound {
+        // Only apply records that end at or before this journal position.
+        u64 end_position = UINT64_MAX;
+        // Stop before the first record that creates a message with this ID or a later one (-1 for no bound). Records carry no
+        // timestamps, and IDs are handed out in increasing order, so this is how to stop just before a given message was sent.
+        i64 before_id    = -1;
+    };
+
+    /*
+        Rebuild the state as of a bound.
+        Parameter 'journal_filename': The base path of the journal.
+        Parameter 'snapshot_filename': A snapshot to start from, or an empty string. It is not used if it was taken after the bound.
+        Parameter 'bound': Where to stop.
+        Parameter 'state': Set to the reconstructed state.
+        Returns whether or not the state could be rebuilt up to the bound: the journal must still hold the history before it
+        (it is lost once compacted away), and every record before the bound must be readable.
+    */
+    bool reconstruct(const std::string &journal_filename, const std::string &snapshot_filename, const Bound &bound, State *state);
+
+    /*
+        Apply a record to a state, the way the server does on replay.
+        Parameter 'state': The state to update.
+        Parameter 'record': The record.
+        Parameter 'position': The journal position just past the record.
+    */
+    void apply(State *state, const Journal::Record &record, u64 position);
+
+    /*
+        Find a live message.
+        Parameter 'id': The ID of the message.
+        Returns the message, or nullptr if it does not exist (or was deleted) in the state.
+    */
+    const Message *find_message(const State &state, i32 id);
+
+    /*
+        Get the live messages that a user sent or received, oldest first.
+        Parameter 'username': The user.
+        Parameter 'other': If not empty, only the messages between the user and this user (or group) are returned.
+    */
+    Util::IchigoVector<const Message *> messages_of(const State &state, const std::string &username, const std::string &other);
+}
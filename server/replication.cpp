@@ -0,0 +1,440 @@
+/*
+    Journal replication module implementation. See header (replication.hpp) for public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "replication.hpp"
+#include "chat_server.hpp"
+#include <cstring>
+#include <ctime>
+
+// The magic at the start of every replication stream.
+#define REPLICATION_MAGIC "CHATREPL"
+// How long to wait for the primary to accept a connection, in seconds.
+#define REPLICATION_CONNECT_TIMEOUT 2
+// A follower with more than this many bytes of the stream waiting to be sent to it is disconnected.
+#define REPLICATION_MAX_BACKLOG (64 * 1024 * 1024)
+// The most bytes handed to send() or read with recv() at a time.
+#define REPLICATION_IO_SIZE (1024 * 1024)
+
+struct StreamHeader {
+    char magic[8];
+    u64 bootstrap_length;
+};
+
+static_assert(sizeof(StreamHeader) == 16);
+
+/*
+    A follower connected to this server.
+    The bootstrap is encoded into 'bootstrap' over many calls to 'serve_followers()', from the time it is 'started'. The records
+    published meanwhile go to the outbox, which the bootstrap is put in front of once it is complete.
+*/
+struct Follower {
+    u32 socket        = 0;
+    bool started      = false;
+    bool bootstrapped = false;
+    std::string bootstrap;
+    std::string outbox;
+    u64 sent          = 0;
+};
+
+/*
+    A journal batch that was flushed but not yet reported complete, and the stream offset of the end of its records.
+*/
+struct FlushedBatch {
+    u64 batch_end;
+    u64 stream_end;
+};
+
+// The socket followers connect to, if this server is a primary
+static u32 listen_socket = 0;
+static bool primary      = false;
+// Every follower connected to this server
+static Util::IchigoVector<Follower *> followers;
+// The follower whose bootstrap is being encoded, if any. Bootstraps are encoded one at a time.
+static Follower *bootstrapping = nullptr;
+// Records committed but not yet sent to the followers. The stream offset of the first of them is 'published_offset'.
+static std::string unpublished_records;
+static u64 published_offset = 0;
+// Batches that were flushed but not yet reported complete, in journal order
+static Util::IchigoVector<FlushedBatch> flushed_batches;
+
+// The connection to the primary, if this server is a follower
+static u32 primary_socket = 0;
+static bool following     = false;
+// Set until the connection to the primary is established, with the time the connection was started
+static bool connecting    = false;
+static u64 connect_time   = 0;
+// Bytes received from the primary that have not been decoded yet start at 'inbound_position'
+static std::string inbound;
+static u64 inbound_position     = 0;
+static bool header_received     = false;
+static u64 bootstrap_remaining  = 0;
+static bool reset_pending       = false;
+
+static void record_committed(const char *record, u64 length) {
+    unpublished_records.append(record, length);
+}
+
+static void drop_follower(u32 index) {
+    Follower *follower = followers.remove(index);
+    if (follower == bootstrapping)
+        bootstrapping = nullptr;
+
+    ICHIGO_INFO("Follower on socket %u disconnected", follower->socket);
+    closesocket(follower->socket);
+    delete follower;
+}
+
+/*
+    Send the records committed up to a stream offset to the followers.
+    Parameter 'end': The stream offset to publish up to.
+*/
+static void publish(u64 end) {
+    if (end <= published_offset)
+        return;
+
+    for (u32 i = 0; i < followers.size(); ++i) {
+        if (followers.at(i)->started)
+            followers.at(i)->outbox.append(unpublished_records, 0, end - published_offset);
+    }
+
+    unpublished_records.erase(0, end - published_offset);
+    published_offset = end;
+}
+
+/*
+    Send as much of a follower's outbox as its socket takes without blocking.
+    Parameter 'follower': The follower to send to.
+    Returns whether or not the follower is still connected.
+*/
+static bool send_outbox(Follower *follower) {
+    while (follower->sent < follower->outbox.size()) {
+        u64 remaining = follower->outbox.size() - follower->sent;
+        i32 n = send(follower->socket, follower->outbox.data() + follower->sent, remaining < REPLICATION_IO_SIZE ? remaining : REPLICATION_IO_SIZE, 0);
+        if (n == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+                return false;
+
+            // Drop what was sent so the outbox does not keep growing while the follower keeps up.
+            if (follower->sent >= REPLICATION_IO_SIZE) {
+                follower->outbox.erase(0, follower->sent);
+                follower->sent = 0;
+            }
+
+            return true;
+        }
+
+        follower->sent += n;
+    }
+
+    follower->outbox.clear();
+    follower->sent = 0;
+    return true;
+}
+
+bool Replication::start_primary(u16 port) {
+    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    InetPton(AF_INET, "127.0.0.1", &address.sin_addr.S_un.S_addr);
+    address.sin_port = htons(port);
+
+    if (bind(listen_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR || listen(listen_socket, 10) == SOCKET_ERROR) {
+        ICHIGO_ERROR("Failed to listen for followers on port %u. Error code: %d", port, WSAGetLastError());
+        closesocket(listen_socket);
+        return false;
+    }
+
+    unsigned long imode = 1;
+    ioctlsocket(listen_socket, FIONBIO, &imode);
+
+    primary = true;
+    unpublished_records.clear();
+    published_offset = 0;
+    flushed_batches.clear();
+    Journal::set_commit_observer(record_committed);
+    ICHIGO_INFO("Accepting followers on port %u", port);
+    return true;
+}
+
+bool Replication::is_primary() {
+    return primary;
+}
+
+void Replication::batch_flushed(u64 batch_end) {
+    if (!primary)
+        return;
+
+    const u64 stream_end = published_offset + unpublished_records.size();
+    const u64 last_end   = flushed_batches.size() > 0 ? flushed_batches.at(flushed_batches.size() - 1).stream_end : published_offset;
+    if (stream_end != last_end)
+        flushed_batches.append({ batch_end, stream_end });
+}
+
+void Replication::batch_completed(u64 end_position) {
+    if (!primary)
+        return;
+
+    u32 completed = 0;
+    u64 stream_end = published_offset;
+    for (; completed < flushed_batches.size() && flushed_batches.at(completed).batch_end <= end_position; ++completed)
+        stream_end = flushed_batches.at(completed).stream_end;
+
+    // The batches still waiting are moved down over the completed ones in one pass.
+    if (completed > 0) {
+        for (u32 i = completed; i < flushed_batches.size(); ++i)
+            flushed_batches.at(i - completed) = flushed_batches.at(i);
+
+        for (; completed > 0; --completed)
+            flushed_batches.remove(flushed_batches.size() - 1);
+    }
+
+    publish(stream_end);
+}
+
+/*
+    Encode the next part of a bootstrap, beginning with the first follower still waiting for one if none is being encoded.
+    Parameter 'encode_state': See 'Replication::serve_followers()'.
+*/
+static void continue_bootstrap(bool (*encode_state)(std::string &out, bool restart)) {
+    const bool restart = bootstrapping == nullptr;
+    if (restart) {
+        // The state includes every record committed so far, so it is only encoded once all of them are durable (and published).
+        // Otherwise the follower could be bootstrapped with records that the primary loses, if the batch they are in fails.
+        if (!unpublished_records.empty())
+            return;
+
+        for (u32 i = 0; i < followers.size() && !bootstrapping; ++i) {
+            if (!followers.at(i)->started)
+                bootstrapping = followers.at(i);
+        }
+
+        if (!bootstrapping)
+            return;
+
+        // The follower continues the stream from the end of the records in the state.
+        bootstrapping->started = true;
+    }
+
+    if (!encode_state(bootstrapping->bootstrap, restart))
+        return;
+
+    StreamHeader header;
+    std::memcpy(header.magic, REPLICATION_MAGIC, sizeof(header.magic));
+    header.bootstrap_length = bootstrapping->bootstrap.size();
+
+    std::string outbox(reinterpret_cast<const char *>(&header), sizeof(header));
+    outbox.append(bootstrapping->bootstrap);
+    outbox.append(bootstrapping->outbox);
+    bootstrapping->outbox = std::move(outbox);
+    bootstrapping->bootstrap.clear();
+    bootstrapping->bootstrap.shrink_to_fit();
+    bootstrapping->bootstrapped = true;
+    ICHIGO_INFO("Bootstrap of the follower on socket %u is %llu bytes", bootstrapping->socket, static_cast<unsigned long long>(header.bootstrap_length));
+    bootstrapping = nullptr;
+}
+
+void Replication::serve_followers(bool (*encode_state)(std::string &out, bool restart)) {
+    if (!primary)
+        return;
+
+    for (;;) {
+        pollfd poll_listen_fd {
+            .fd = listen_socket,
+            .events = POLLRDNORM,
+            .revents = 0,
+        };
+
+        if (WSAPoll(&poll_listen_fd, 1, 0) <= 0 || !(poll_listen_fd.revents & POLLRDNORM))
+            break;
+
+        SOCKET socket = accept(listen_socket, nullptr, nullptr);
+        if (socket == INVALID_SOCKET)
+            break;
+
+        unsigned long imode = 1;
+        ioctlsocket(socket, FIONBIO, &imode);
+
+        Follower *follower = new Follower;
+        follower->socket   = static_cast<u32>(socket);
+        followers.append(follower);
+        ICHIGO_INFO("Follower connected on socket %u", follower->socket);
+    }
+
+    continue_bootstrap(encode_state);
+
+    for (u32 i = followers.size(); i > 0; --i) {
+        Follower *follower = followers.at(i - 1);
+        if (!follower->bootstrapped)
+            continue;
+
+        if (!send_outbox(follower)) {
+            drop_follower(i - 1);
+        } else if (follower->outbox.size() - follower->sent > REPLICATION_MAX_BACKLOG) {
+            ICHIGO_ERROR("Follower on socket %u fell too far behind", follower->socket);
+            drop_follower(i - 1);
+        }
+    }
+}
+
+void Replication::stop_primary() {
+    if (!primary)
+        return;
+
+    while (followers.size() > 0)
+        drop_follower(followers.size() - 1);
+
+    Journal::set_commit_observer(nullptr);
+    closesocket(listen_socket);
+    primary = false;
+}
+
+bool Replication::connect_to_primary(u16 port) {
+    primary_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    InetPton(AF_INET, "127.0.0.1", &address.sin_addr.S_un.S_addr);
+    address.sin_port = htons(port);
+
+    // Connect without blocking, so the server keeps serving its clients while the primary is unreachable.
+    unsigned long imode = 1;
+    ioctlsocket(primary_socket, FIONBIO, &imode);
+    if (connect(primary_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        closesocket(primary_socket);
+        return false;
+    }
+
+    following           = true;
+    connecting          = true;
+    connect_time        = time(nullptr);
+    inbound.clear();
+    inbound_position    = 0;
+    header_received     = false;
+    bootstrap_remaining = 0;
+    reset_pending       = false;
+    return true;
+}
+
+bool Replication::is_following() {
+    return following;
+}
+
+/*
+    Receive whatever the primary has sent without blocking.
+    Returns whether or not the connection is still open.
+*/
+static bool receive_from_primary() {
+    if (inbound_position > 0) {
+        inbound.erase(0, inbound_position);
+        inbound_position = 0;
+    }
+
+    u64 size = inbound.size();
+    inbound.resize(size + REPLICATION_IO_SIZE);
+    i32 n = recv(primary_socket, inbound.data() + size, REPLICATION_IO_SIZE, 0);
+    inbound.resize(size + (n > 0 ? n : 0));
+
+    if (n == 0 || (n == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) {
+        ICHIGO_ERROR("Lost the connection to the primary");
+        return false;
+    }
+
+    return true;
+}
+
+bool Replication::next_record(Journal::Record *record, std::string_view *encoded, bool *reset) {
+    *reset = false;
+    if (!following)
+        return false;
+
+    if (connecting) {
+        pollfd poll_connect_fd {
+            .fd = primary_socket,
+            .events = POLLWRNORM,
+            .revents = 0,
+        };
+
+        i32 poll_result = WSAPoll(&poll_connect_fd, 1, 0);
+        if (poll_result > 0 && (poll_connect_fd.revents & (POLLERR | POLLHUP) || !(poll_connect_fd.revents & POLLWRNORM))) {
+            stop_following();
+            return false;
+        } else if (poll_result <= 0) {
+            if (static_cast<u64>(time(nullptr)) - connect_time > REPLICATION_CONNECT_TIMEOUT)
+                stop_following();
+
+            return false;
+        }
+
+        connecting = false;
+        ICHIGO_INFO("Connected to the primary");
+    }
+
+    // Only go to the socket once everything received so far has been decoded.
+    bool received = false;
+    for (;;) {
+        const char *data = inbound.data() + inbound_position;
+        u64 length       = inbound.size() - inbound_position;
+
+        if (!header_received && length >= sizeof(StreamHeader)) {
+            StreamHeader header;
+            std::memcpy(&header, data, sizeof(header));
+            if (std::memcmp(header.magic, REPLICATION_MAGIC, sizeof(header.magic)) != 0) {
+                ICHIGO_ERROR("Replication stream has an invalid header");
+                stop_following();
+                return false;
+            }
+
+            header_received      = true;
+            bootstrap_remaining  = header.bootstrap_length;
+            reset_pending        = true;
+            inbound_position    += sizeof(header);
+            continue;
+        }
+
+        if (header_received) {
+            u64 record_length;
+            if (Journal::decode_record(data, length, &record_length, record)) {
+                *encoded             = std::string_view(data, record_length);
+                inbound_position    += record_length;
+                bootstrap_remaining -= record_length < bootstrap_remaining ? record_length : bootstrap_remaining;
+                *reset               = reset_pending;
+                reset_pending        = false;
+                return true;
+            }
+
+            if (record_length > 0) {
+                ICHIGO_ERROR("Replication stream has a malformed record");
+                stop_following();
+                return false;
+            }
+        }
+
+        if (received)
+            return false;
+
+        if (!receive_from_primary()) {
+            stop_following();
+            return false;
+        }
+
+        received = true;
+    }
+}
+
+bool Replication::bootstrapped() {
+    return following && !connecting && header_received && bootstrap_remaining == 0;
+}
+
+void Replication::stop_following() {
+    if (!following)
+        return;
+
+    closesocket(primary_socket);
+    following  = false;
+    connecting = false;
+    inbound.clear();
+    inbound_position = 0;
+}
@@ -0,0 +1,94 @@
+/*
+    Journal replication module. A primary server streams every journal record it commits to any number of read-only
+    followers over local TCP connections. Followers apply the records to their in-memory state (and their own journal),
+    so they can serve reads and be promoted to primary if the primary goes away.
+
+    The stream on each connection is:
+        char magic[8] ("CHATREPL"), u64 bootstrap_length
+        'bootstrap_length' bytes of records encoding the whole state of the primary when the bootstrap was begun, which waits
+            until the journal writer has finished with every record committed before
+        the records committed on the primary since then, as they are reported complete by the journal writer
+    Records are in the journal record format (see 'Journal::encode_record()'). Records are only sent once the journal
+    writer has finished with the batch they are in, so a follower never sees state that the primary could still lose.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+
+#include "../common.hpp"
+#include "journal.hpp"
+#include <string>
+
+namespace Replication {
+    /*
+        Start accepting followers and streaming committed records to them. Takes over the journal commit observer.
+        Parameter 'port': The localhost port to listen for followers on.
+        Returns whether or not the port could be listened on.
+    */
+    bool start_primary(u16 port);
+
+    /*
+        Check if this server is streaming to followers (ie. 'start_primary()' was called).
+    */
+    bool is_primary();
+
+    /*
+        Note that the journal was flushed. Every record committed so far is in the batch ending at 'batch_end'.
+        Parameter 'batch_end': The batch ticket returned by 'Journal::flush()'.
+    */
+    void batch_flushed(u64 batch_end);
+
+    /*
+        Send the records of every flushed batch up to a completed batch to the followers.
+        Parameter 'end_position': The end position of the batch reported complete by 'Journal::next_completed_batch()'.
+    */
+    void batch_completed(u64 end_position);
+
+    /*
+        Accept new followers, encode the next part of a bootstrap, and send as much of the stream as each follower socket will take
+        without blocking. Followers that fall too far behind are disconnected (they bootstrap again when they reconnect).
+        Parameter 'encode_state': Called to encode the whole server state as records for a new follower, a part per call. It appends
+                                  the next records to 'out', beginning a new encoding of the state as of now if 'restart' is set, and
+                                  returns whether or not the whole state has been encoded.
+    */
+    void serve_followers(bool (*encode_state)(std::string &out, bool restart));
+
+    /*
+        Stop accepting followers and disconnect the ones connected.
+    */
+    void stop_primary();
+
+    /*
+        Start connecting to a primary server. Never blocks: the connection is finished by 'next_record()'.
+        Parameter 'port': The localhost port the primary accepts followers on.
+        Returns whether or not the connection could be started.
+    */
+    bool connect_to_primary(u16 port);
+
+    /*
+        Check if this server is connected (or connecting) to a primary.
+    */
+    bool is_following();
+
+    /*
+        Receive whatever the primary has sent and decode the next record from it.
+        Parameter 'record': Set to the record. Its strings are views into the receive buffer, valid until the next call.
+        Parameter 'encoded': Set to the record as it was encoded by the primary (eg. to commit it with 'Journal::commit_record()').
+        Parameter 'reset': Set to true if this is the first record of a new bootstrap, ie. all state must be discarded before applying it.
+        Returns whether or not a whole record had arrived.
+        If the stream is malformed or the primary disconnects, the connection is closed and 'is_following()' returns false.
+    */
+    bool next_record(Journal::Record *record, std::string_view *encoded, bool *reset);
+
+    /*
+        Check if the bootstrap of the current connection has been received and applied in full.
+    */
+    bool bootstrapped();
+
+    /*
+        Disconnect from the primary.
+    */
+    void stop_following();
+}
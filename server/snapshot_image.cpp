@@ -0,0 +1,367 @@
+/*
+    Snapshot image implementation. See header (snapshot_image.hpp) for the image format and public function documentation.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#include "snapshot_image.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
+#include <cstddef>
+
+#define SNAPSHOT_IMAGE_VERSION 1
+
+struct ImageHeader {
+    char magic[8];
+    u32 version;
+    u32 reserved;
+    u64 start_position;
+    u32 user_count;
+    u32 group_count;
+    u32 message_count;
+    u32 string_count;
+    u64 records_size;
+    u64 body_size;
+    u32 block_count;
+    u32 checksum;
+};
+
+static_assert(sizeof(ImageHeader) == 64);
+
+static inline u64 align8(u64 offset) {
+    return (offset + 7) & ~7ull;
+}
+
+/*
+    Work out where each array starts in the body of an image from the counts. The string data starts at 'strings'.
+*/
+static void layout(SnapshotImage::Layout *layout) {
+    const u64 message_column_size = static_cast<u64>(layout->message_count) * sizeof(u32);
+    layout->users              = 0;
+    layout->groups             = align8(layout->users + static_cast<u64>(layout->user_count) * sizeof(u32));
+    layout->message_ids        = align8(layout->groups + static_cast<u64>(layout->group_count) * 3 * sizeof(u32));
+    layout->senders            = align8(layout->message_ids + message_column_size);
+    layout->recipients         = align8(layout->senders + message_column_size);
+    layout->contents           = align8(layout->recipients + message_column_size);
+    layout->attachment_digests = align8(layout->contents + message_column_size);
+    layout->attachment_names   = align8(layout->attachment_digests + message_column_size);
+    layout->string_offsets     = align8(layout->attachment_names + message_column_size);
+    layout->records            = layout->string_offsets + (static_cast<u64>(layout->string_count) + 1) * sizeof(u64);
+    layout->strings            = align8(layout->records + layout->records_size);
+}
+
+/*
+    Get the offset of the body of an image from the start of the file.
+*/
+static u64 body_start(u32 block_count) {
+    return align8(sizeof(ImageHeader) + static_cast<u64>(block_count) * sizeof(u32));
+}
+
+bool SnapshotImage::is_image(const char *data, u64 size) {
+    return size >= sizeof(SNAPSHOT_IMAGE_MAGIC) - 1 && std::memcmp(data, SNAPSHOT_IMAGE_MAGIC, sizeof(SNAPSHOT_IMAGE_MAGIC) - 1) == 0;
+}
+
+SnapshotImage::Builder::Builder() : m_string_set(0, StringHash{this}, StringEqual{this}) {
+    m_string_offsets.append(0);
+}
+
+std::string_view SnapshotImage::Builder::string_at(u32 index) const {
+    return std::string_view(m_string_data.data() + m_string_offsets.at(index), m_string_offsets.at(index + 1) - m_string_offsets.at(index));
+}
+
+u32 SnapshotImage::Builder::intern(std::string_view string) {
+    auto it = m_string_set.find(string);
+    if (it != m_string_set.end())
+        return *it;
+
+    const u32 index = m_string_offsets.size() - 1;
+    m_string_data.append(string);
+    m_string_offsets.append(m_string_data.length());
+    m_string_set.insert(index);
+    return index;
+}
+
+void SnapshotImage::Builder::add(const Journal::Transaction *transaction) {
+    switch (transaction->operation()) {
+        case Journal::Operation::NEW_USER: {
+            const Journal::NewUserTransaction *new_user_transaction = static_cast<const Journal::NewUserTransaction *>(transaction);
+            const u32 name = intern(new_user_transaction->username());
+            m_user_indices[name] = m_users.size();
+            m_users.append(name);
+        } return;
+        case Journal::Operation::NEW_GROUP: {
+            const Journal::NewGroupTransaction *new_group_transaction = static_cast<const Journal::NewGroupTransaction *>(transaction);
+            std::string members;
+            for (u32 i = 0; i < new_group_transaction->user_count(); ++i) {
+                const std::string &username = new_group_transaction->users().at(i);
+                const u32 length            = username.length();
+                members.append(reinterpret_cast<const char *>(&length), sizeof(length));
+                members.append(username);
+            }
+
+            m_groups.append(intern(new_group_transaction->name()));
+            m_groups.append(new_group_transaction->user_count());
+            m_groups.append(intern(members));
+        } return;
+        case Journal::Operation::RESTORE_MESSAGE: {
+            const Journal::RestoreMessageTransaction *restore_message_transaction = static_cast<const Journal::RestoreMessageTransaction *>(transaction);
+            auto sender    = m_user_indices.find(intern(restore_message_transaction->sender()));
+            auto recipient = m_user_indices.find(intern(restore_message_transaction->recipient()));
+            if (sender == m_user_indices.end() || recipient == m_user_indices.end())
+                break;
+
+            m_message_ids.append(restore_message_transaction->id());
+            m_senders.append(sender->second);
+            m_recipients.append(recipient->second);
+            m_contents.append(intern(restore_message_transaction->content()));
+            m_attachment_digests.append(intern(restore_message_transaction->attachment_digest()));
+            m_attachment_names.append(intern(restore_message_transaction->attachment_name()));
+        } return;
+        default:
+            break;
+    }
+
+    // A message between users the image does not have (yet) is kept as a record, so that replay reports it the same way.
+    Journal::encode_record(transaction, m_records);
+}
+
+void SnapshotImage::Builder::write(u64 start_position, std::string &out) const {
+    Layout body;
+    body.user_count    = m_users.size();
+    body.group_count   = m_groups.size() / 3;
+    body.message_count = m_message_ids.size();
+    body.string_count  = m_string_offsets.size() - 1;
+    body.records_size  = m_records.length();
+    layout(&body);
+
+    const u64 body_size   = body.strings + m_string_data.length();
+    const u32 block_count = (body_size + SNAPSHOT_IMAGE_BLOCK_SIZE - 1) / SNAPSHOT_IMAGE_BLOCK_SIZE;
+    const u64 start       = body_start(block_count);
+    out.assign(start + body_size, 0);
+
+    char *data = out.data() + start;
+    std::memcpy(data + body.users, m_users.data(), m_users.size() * sizeof(u32));
+    std::memcpy(data + body.groups, m_groups.data(), m_groups.size() * sizeof(u32));
+    std::memcpy(data + body.message_ids, m_message_ids.data(), m_message_ids.size() * sizeof(u32));
+    std::memcpy(data + body.senders, m_senders.data(), m_senders.size() * sizeof(u32));
+    std::memcpy(data + body.recipients, m_recipients.data(), m_recipients.size() * sizeof(u32));
+    std::memcpy(data + body.contents, m_contents.data(), m_contents.size() * sizeof(u32));
+    std::memcpy(data + body.attachment_digests, m_attachment_digests.data(), m_attachment_digests.size() * sizeof(u32));
+    std::memcpy(data + body.attachment_names, m_attachment_names.data(), m_attachment_names.size() * sizeof(u32));
+    std::memcpy(data + body.string_offsets, m_string_offsets.data(), m_string_offsets.size() * sizeof(u64));
+    std::memcpy(data + body.records, m_records.data(), m_records.length());
+    std::memcpy(data + body.strings, m_string_data.data(), m_string_data.length());
+
+    for (u32 i = 0; i < block_count; ++i) {
+        const u64 offset   = static_cast<u64>(i) * SNAPSHOT_IMAGE_BLOCK_SIZE;
+        const u32 checksum = Util::crc32c(data + offset, std::min<u64>(SNAPSHOT_IMAGE_BLOCK_SIZE, body_size - offset));
+        std::memcpy(out.data() + sizeof(ImageHeader) + i * sizeof(u32), &checksum, sizeof(checksum));
+    }
+
+    ImageHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_IMAGE_MAGIC, sizeof(header.magic));
+    header.version        = SNAPSHOT_IMAGE_VERSION;
+    header.start_position = start_position;
+    header.user_count     = body.user_count;
+    header.group_count    = body.group_count;
+    header.message_count  = body.message_count;
+    header.string_count   = body.string_count;
+    header.records_size   = body.records_size;
+    header.body_size      = body_size;
+    header.block_count    = block_count;
+    header.checksum       = Util::crc32c(&header, offsetof(ImageHeader, checksum));
+    header.checksum       = Util::crc32c(out.data() + sizeof(ImageHeader), block_count * sizeof(u32), header.checksum);
+    std::memcpy(out.data(), &header, sizeof(header));
+}
+
+void SnapshotImage::Builder::clear() {
+    m_users              = {};
+    m_groups             = {};
+    m_message_ids        = {};
+    m_senders            = {};
+    m_recipients         = {};
+    m_contents           = {};
+    m_attachment_digests = {};
+    m_attachment_names   = {};
+    m_string_offsets     = {};
+    m_string_offsets.append(0);
+    m_string_data        = {};
+    m_records            = {};
+    m_string_set.clear();
+    m_string_set.rehash(0);
+    m_user_indices.clear();
+    m_user_indices.rehash(0);
+}
+
+bool SnapshotImage::Reader::open(const char *data, u64 size, u64 *start_position) {
+    close();
+
+    ImageHeader header;
+    if (size < sizeof(header))
+        return false;
+
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, SNAPSHOT_IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_IMAGE_VERSION)
+        return false;
+
+    const u64 start = body_start(header.block_count);
+    if (start > size || header.body_size > size - start
+     || header.block_count != (header.body_size + SNAPSHOT_IMAGE_BLOCK_SIZE - 1) / SNAPSHOT_IMAGE_BLOCK_SIZE)
+        return false;
+
+    u32 checksum = Util::crc32c(&header, offsetof(ImageHeader, checksum));
+    checksum     = Util::crc32c(data + sizeof(header), header.block_count * sizeof(u32), checksum);
+    if (checksum != header.checksum)
+        return false;
+
+    m_layout.user_count    = header.user_count;
+    m_layout.group_count   = header.group_count;
+    m_layout.message_count = header.message_count;
+    m_layout.string_count  = header.string_count;
+    m_layout.records_size  = header.records_size;
+    layout(&m_layout);
+    if (header.records_size > header.body_size || m_layout.strings > header.body_size)
+        return false;
+
+    m_data            = data;
+    m_body            = data + start;
+    m_body_size       = header.body_size;
+    m_block_checksums = data + sizeof(header);
+    for (u32 i = 0; i < header.block_count; ++i)
+        m_verified_blocks.append(false);
+
+    m_record_start  = static_cast<u64>(header.user_count) + header.group_count + header.message_count;
+    *start_position = header.start_position;
+    return true;
+}
+
+void SnapshotImage::Reader::close() {
+    *this = {};
+}
+
+bool SnapshotImage::Reader::verify_blocks(u64 offset, u64 length) {
+    if (offset > m_body_size || length > m_body_size - offset)
+        return false;
+
+    if (length == 0)
+        return true;
+
+    for (u64 block = offset / SNAPSHOT_IMAGE_BLOCK_SIZE; block <= (offset + length - 1) / SNAPSHOT_IMAGE_BLOCK_SIZE; ++block) {
+        if (m_verified_blocks.at(block))
+            continue;
+
+        const u64 block_offset = block * SNAPSHOT_IMAGE_BLOCK_SIZE;
+        u32 checksum;
+        std::memcpy(&checksum, m_block_checksums + block * sizeof(u32), sizeof(checksum));
+        if (Util::crc32c(m_body + block_offset, std::min<u64>(SNAPSHOT_IMAGE_BLOCK_SIZE, m_body_size - block_offset)) != checksum) {
+            ICHIGO_ERROR("Snapshot image block %llu checksum mismatch", static_cast<unsigned long long>(block));
+            return false;
+        }
+
+        m_verified_blocks.at(block) = true;
+    }
+
+    return true;
+}
+
+bool SnapshotImage::Reader::read_u32(u64 array, u64 index, u32 *value) {
+    const u64 offset = array + index * sizeof(u32);
+    if (!verify(offset, sizeof(u32)))
+        return false;
+
+    std::memcpy(value, m_body + offset, sizeof(u32));
+    return true;
+}
+
+bool SnapshotImage::Reader::read_string(u32 index, std::string_view *string) {
+    const u64 offset = m_layout.string_offsets + static_cast<u64>(index) * sizeof(u64);
+    if (index >= m_layout.string_count || !verify(offset, 2 * sizeof(u64)))
+        return false;
+
+    u64 bounds[2];
+    std::memcpy(bounds, m_body + offset, sizeof(bounds));
+    if (bounds[0] > bounds[1] || !verify(m_layout.strings + bounds[0], bounds[1] - bounds[0]))
+        return false;
+
+    *string = std::string_view(m_body + m_layout.strings + bounds[0], bounds[1] - bounds[0]);
+    return true;
+}
+
+bool SnapshotImage::Reader::next(Journal::Record *record) {
+    const u64 index = m_index++;
+    if (index < m_layout.user_count) {
+        u32 name;
+        std::string_view username;
+        if (!read_u32(m_layout.users, index, &name) || !read_string(name, &username))
+            return false;
+
+        *record = Journal::NewUserRecord{ username };
+        return true;
+    }
+
+    if (index - m_layout.user_count < m_layout.group_count) {
+        const u64 group = index - m_layout.user_count;
+        u32 fields[3];
+        Journal::NewGroupRecord new_group;
+        for (u32 i = 0; i < 3; ++i) {
+            if (!read_u32(m_layout.groups, group * 3 + i, &fields[i]))
+                return false;
+        }
+
+        if (!read_string(fields[0], &new_group.name) || !read_string(fields[2], &new_group.encoded_users))
+            return false;
+
+        // The usernames are checked here, so that 'next_user()' never has to.
+        u64 offset = 0;
+        for (u32 i = 0; i < fields[1]; ++i) {
+            u32 length;
+            if (new_group.encoded_users.length() - offset < sizeof(length))
+                return false;
+
+            std::memcpy(&length, new_group.encoded_users.data() + offset, sizeof(length));
+            if (new_group.encoded_users.length() - offset - sizeof(length) < length)
+                return false;
+
+            offset += sizeof(length) + length;
+        }
+
+        if (offset != new_group.encoded_users.length())
+            return false;
+
+        new_group.user_count = fields[1];
+        *record = new_group;
+        return true;
+    }
+
+    if (index < m_record_start) {
+        const u64 message = index - m_layout.user_count - m_layout.group_count;
+        u32 sender, recipient, content, attachment_digest, attachment_name;
+        Journal::RestoreMessageRecord restore_message;
+        if (!read_u32(m_layout.message_ids, message, &restore_message.id) || !read_u32(m_layout.senders, message, &sender)
+         || !read_u32(m_layout.recipients, message, &recipient) || !read_u32(m_layout.contents, message, &content)
+         || !read_u32(m_layout.attachment_digests, message, &attachment_digest) || !read_u32(m_layout.attachment_names, message, &attachment_name))
+            return false;
+
+        if (sender >= m_layout.user_count || recipient >= m_layout.user_count || !read_u32(m_layout.users, sender, &sender)
+         || !read_u32(m_layout.users, recipient, &recipient))
+            return false;
+
+        if (!read_string(sender, &restore_message.sender) || !read_string(recipient, &restore_message.recipient)
+         || !read_string(content, &restore_message.content) || !read_string(attachment_digest, &restore_message.attachment_digest)
+         || !read_string(attachment_name, &restore_message.attachment_name))
+            return false;
+
+        *record = restore_message;
+        return true;
+    }
+
+    // The records section is in the journal format, which has a checksum per record.
+    m_index = m_record_start;
+    u64 record_length;
+    if (!Journal::decode_record(m_body + m_layout.records + m_record_position, m_layout.records_size - m_record_position, &record_length, record))
+        return false;
+
+    m_record_position += record_length;
+    return true;
+}
@@ -0,0 +1,205 @@
+/*
+    Snapshot images. The server state laid out as a position-independent image, so that replay can map a snapshot and hand its
+    users, groups, and messages straight out of it, without parsing (or checksumming) a record per message first.
+
+    Image format (all integers are little endian, every array starts at a multiple of 8 bytes from the start of the body):
+    The image begins with a file header like the journal's (see journal.cpp), with the magic "CHATSIMG". Its start position is
+    the journal position the snapshot was taken at. Then:
+        user count (u32), group count (u32), message count (u32), string count (u32)
+        records size (u64)   - The size of the records section (see below).
+        body size (u64)      - The size of everything after the block checksums.
+        block count (u32)    - The number of SNAPSHOT_IMAGE_BLOCK_SIZE blocks the body is split into.
+        checksum (u32)       - The CRC32C of the file header, the fields above, and the block checksums.
+        block checksums      - The CRC32C of every block of the body (u32 each).
+    The body holds arrays of offsets instead of pointers, so that the image can be used wherever it is mapped:
+        users                - The name of every user (a string index, u32 each).
+        groups               - The name, member count, and members of every group (3 u32 each). The members are a single string
+                               holding each username as its length (u32) followed by its raw bytes, as in a NEW_GROUP record.
+        message columns      - The ID, sender (a user index), recipient (a user index), content, attachment digest, and attachment
+                               name of every message, one array (of u32) per field.
+        string offsets       - Where every string starts in the string data (u64 each), followed by the size of the string data.
+        records              - Transactions that do not fit the arrays above (eg. the last ID lease), as journal records.
+        string data          - Every distinct string once: users, groups, and messages that share a string (eg. the copies of a
+                               group message) share its bytes.
+    Blocks are checked against their checksum the first time anything in them is read, so opening an image takes the same
+    time whatever its size.
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+#include "../common.hpp"
+#include "../util.hpp"
+#include "journal.hpp"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#define SNAPSHOT_IMAGE_MAGIC "CHATSIMG"
+#define SNAPSHOT_IMAGE_BLOCK_SIZE (64 * 1024)
+
+namespace SnapshotImage {
+    /*
+        Check if a file is a snapshot image (as opposed to a snapshot written as journal records).
+        Parameter 'data': The start of the file.
+        Parameter 'size': The size of the file in bytes.
+    */
+    bool is_image(const char *data, u64 size);
+
+    /*
+        The counts of a snapshot image, and where each of its arrays starts in the body. See 'layout()' in snapshot_image.cpp.
+    */
+    struct Layout {
+        u32 user_count    = 0;
+        u32 group_count   = 0;
+        u32 message_count = 0;
+        u32 string_count  = 0;
+        u64 records_size  = 0;
+        u64 users, groups, message_ids, senders, recipients, contents, attachment_digests, attachment_names, string_offsets, records, strings;
+    };
+
+    /*
+        Builds a snapshot image from the transactions that rebuild the server state.
+    */
+    class Builder {
+    public:
+        Builder();
+        Builder(const Builder &) = delete;
+        Builder &operator=(const Builder &) = delete;
+
+        /*
+            Add a transaction to the image. Users, groups, and restored messages go in the arrays; any other transaction goes
+            in the records section. Replay hands out all users first, then all groups, all messages, and the records, each in
+            the order they were added, so the state must not depend on any other order.
+            Parameter 'transaction': The transaction to add.
+        */
+        void add(const Journal::Transaction *transaction);
+
+        /*
+            Write the image.
+            Parameter 'start_position': The journal position the snapshot was taken at.
+            Parameter 'out': The buffer to write the image to (its contents are replaced).
+        */
+        void write(u64 start_position, std::string &out) const;
+
+        /*
+            Drop everything added, to build a new image.
+        */
+        void clear();
+
+        u32 user_count() const    { return m_users.size(); }
+        u32 group_count() const   { return m_groups.size() / 3; }
+        u32 message_count() const { return m_message_ids.size(); }
+
+    private:
+        /*
+            Hash and equality for the set of strings, which holds string indexes but is looked up with string views.
+        */
+        struct StringHash {
+            using is_transparent = void;
+            const Builder *builder;
+            u64 operator()(std::string_view string) const { return std::hash<std::string_view>{}(string); }
+            u64 operator()(u32 index) const               { return operator()(builder->string_at(index)); }
+        };
+
+        struct StringEqual {
+            using is_transparent = void;
+            const Builder *builder;
+            template<typename A, typename B>
+            bool operator()(const A &a, const B &b) const { return view(a) == view(b); }
+            std::string_view view(std::string_view string) const { return string; }
+            std::string_view view(u32 index) const                { return builder->string_at(index); }
+        };
+
+        /*
+            Get the index of a string, adding it if it is not in the image yet.
+        */
+        u32 intern(std::string_view string);
+        std::string_view string_at(u32 index) const;
+
+        Util::IchigoVector<u32> m_users;
+        Util::IchigoVector<u32> m_groups;
+        Util::IchigoVector<u32> m_message_ids;
+        Util::IchigoVector<u32> m_senders;
+        Util::IchigoVector<u32> m_recipients;
+        Util::IchigoVector<u32> m_contents;
+        Util::IchigoVector<u32> m_attachment_digests;
+        Util::IchigoVector<u32> m_attachment_names;
+        Util::IchigoVector<u64> m_string_offsets;
+        std::string m_string_data;
+        std::string m_records;
+        std::unordered_set<u32, StringHash, StringEqual> m_string_set;
+        // Users by the index of their name, so that messages can refer to them by index.
+        std::unordered_map<u32, u32> m_user_indices;
+    };
+
+    /*
+        Reads the state back out of a mapped snapshot image, in the order described in 'Builder::add()'.
+    */
+    class Reader {
+    public:
+        /*
+            Open an image. Only the header and the block checksums are checked here.
+            Parameter 'data': The mapped image. Must stay mapped until the reader is closed.
+            Parameter 'size': The size of the image in bytes.
+            Parameter 'start_position': Set to the journal position the snapshot was taken at.
+            Returns whether or not the image has a valid header.
+        */
+        bool open(const char *data, u64 size, u64 *start_position);
+
+        /*
+            Close the image. Records read from it can no longer be used.
+        */
+        void close();
+
+        /*
+            Check if there are any more records to read.
+        */
+        bool has_more() const { return m_data && (m_index < m_record_start || m_record_position < m_layout.records_size); }
+
+        /*
+            Get the counts of the open image (all 0 if no image is open).
+        */
+        const Layout &image_layout() const { return m_layout; }
+
+        /*
+            Read the next record.
+            Parameter 'record': Set to the record. Its strings are views into the image.
+            Returns whether or not the record is well formed (and the blocks it is in match their checksums).
+        */
+        bool next(Journal::Record *record);
+
+    private:
+        /*
+            Check that the blocks holding part of the body match their checksums. Most reads are within a block that was
+            already checked, which is handled here; the rest goes through 'verify_blocks()'.
+            Parameter 'offset', 'length': The part of the body.
+        */
+        bool verify(u64 offset, u64 length) {
+            const u64 block = offset / SNAPSHOT_IMAGE_BLOCK_SIZE;
+            if (offset <= m_body_size && length <= m_body_size - offset
+             && (length == 0 || (block == (offset + length - 1) / SNAPSHOT_IMAGE_BLOCK_SIZE && m_verified_blocks.at(block))))
+                return true;
+
+            return verify_blocks(offset, length);
+        }
+
+        bool verify_blocks(u64 offset, u64 length);
+        bool read_u32(u64 array, u64 index, u32 *value);
+        bool read_string(u32 index, std::string_view *string);
+
+        const char *m_data  = nullptr;
+        const char *m_body  = nullptr;
+        u64 m_body_size     = 0;
+        const char *m_block_checksums = nullptr;
+        Util::IchigoVector<bool> m_verified_blocks;
+        Layout m_layout;
+        // The index of the next user, group, or message (in that order), where the records section starts in that count,
+        // and how far into the records section replay has read.
+        u64 m_index           = 0;
+        u64 m_record_start    = 0;
+        u64 m_record_position = 0;
+    };
+}
@@ -8,12 +8,15 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "../common.hpp"
 #include <cstdio>
+#include <cerrno>
+#include <io.h>
 #include "chat_server.hpp"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 
 static wchar_t *to_wide_char(const char *str) {
     i32 buf_size = MultiByteToWideChar(CP_UTF8, 0, str, -1, nullptr, 0);
@@ -127,9 +130,134 @@ Util::IchigoVector<std::string> ChatServer::platform_recurse_directory(const std
     return ret;
 }
 
-i32 main() {
+bool ChatServer::platform_sync_file(std::FILE *file) {
+    HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+    if (handle == INVALID_HANDLE_VALUE || !FlushFileBuffers(handle)) {
+        std::printf("win32 plat: Failed to flush file buffers! error=%lu\n", GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool ChatServer::platform_preallocate_file(std::FILE *file, u64 size) {
+    HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+    FILE_ALLOCATION_INFO allocation_info;
+    allocation_info.AllocationSize.QuadPart = size;
+
+    if (handle == INVALID_HANDLE_VALUE || !SetFileInformationByHandle(handle, FileAllocationInfo, &allocation_info, sizeof(allocation_info))) {
+        std::printf("win32 plat: Failed to preallocate file! error=%lu\n", GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool ChatServer::platform_truncate_file(std::FILE *file, u64 size) {
+    if (std::fflush(file) != 0 || _chsize_s(_fileno(file), size) != 0) {
+        std::printf("win32 plat: Failed to truncate file! errno=%d\n", errno);
+        return false;
+    }
+
+    return true;
+}
+
+void ChatServer::platform_create_directory(const std::string &path) {
+    wchar_t *wide_path = to_wide_char(path.c_str());
+    if (!CreateDirectoryW(wide_path, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        std::printf("win32 plat: Failed to create directory! error=%lu\n", GetLastError());
+
+    free_wide_char_conversion(wide_path);
+}
+
+u64 ChatServer::platform_file_size(const std::string &path) {
+    wchar_t *wide_path = to_wide_char(path.c_str());
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    u64 ret = 0;
+
+    if (GetFileAttributesExW(wide_path, GetFileExInfoStandard, &attributes))
+        ret = (static_cast<u64>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+
+    free_wide_char_conversion(wide_path);
+    return ret;
+}
+
+bool ChatServer::platform_replace_file(const std::string &source, const std::string &destination) {
+    wchar_t *wide_source      = to_wide_char(source.c_str());
+    wchar_t *wide_destination = to_wide_char(destination.c_str());
+    bool ret = MoveFileExW(wide_source, wide_destination, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    if (!ret)
+        std::printf("win32 plat: Failed to replace file! error=%lu\n", GetLastError());
+
+    free_wide_char_conversion(wide_source);
+    free_wide_char_conversion(wide_destination);
+    return ret;
+}
+
+const char *ChatServer::platform_map_file(const std::string &path, u64 *out_size) {
+    *out_size = 0;
+    wchar_t *wide_path = to_wide_char(path.c_str());
+    HANDLE file = CreateFileW(wide_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    free_wide_char_conversion(wide_path);
+
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+
+        return nullptr;
+    }
+
+    // The view keeps the mapping (and the file) alive, so both handles can be closed right away.
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        std::printf("win32 plat: Failed to create file mapping! error=%lu\n", GetLastError());
+        return nullptr;
+    }
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        std::printf("win32 plat: Failed to map view of file! error=%lu\n", GetLastError());
+        return nullptr;
+    }
+
+    // Ask for the whole file to be read in ahead of the page faults, like madvise(MADV_SEQUENTIAL | MADV_WILLNEED).
+    WIN32_MEMORY_RANGE_ENTRY range{ view, static_cast<SIZE_T>(size.QuadPart) };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+
+    *out_size = size.QuadPart;
+    return static_cast<const char *>(view);
+}
+
+void ChatServer::platform_unmap_file(const char *mapping, [[maybe_unused]] u64 size) {
+    UnmapViewOfFile(mapping);
+}
+
+bool ChatServer::platform_send_file(u32 socket, const std::string &path, u64 offset, u32 length) {
+    wchar_t *wide_path = to_wide_char(path.c_str());
+    HANDLE file = CreateFileW(wide_path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    free_wide_char_conversion(wide_path);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER position;
+    position.QuadPart = offset;
+    bool ret = SetFilePointerEx(file, position, nullptr, FILE_BEGIN);
+    if (ret && !TransmitFile(socket, file, length, 0, nullptr, nullptr, 0)) {
+        std::printf("win32 plat: TransmitFile failed! error=%d\n", WSAGetLastError());
+        ret = false;
+    }
+
+    CloseHandle(file);
+    return ret;
+}
+
+i32 main(i32 argc, char **argv) {
     SetConsoleOutputCP(CP_UTF8);
-    ChatServer::init();
+    ChatServer::init(argc, argv);
     ChatServer::deinit();
     return 0;
 }
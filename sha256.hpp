@@ -0,0 +1,139 @@
+/*
+    A small streaming SHA-256 implementation. Used to content-address attachments on both the client
+    (to skip uploading blobs the server already has) and the server (to verify uploads).
+
+    Author: Braeden Hong
+      Date: October 17, 2026
+*/
+
+#pragma once
+#include "common.hpp"
+#include <cstring>
+#include <string>
+
+namespace Util {
+
+class Sha256 {
+public:
+    Sha256() { reset(); }
+
+    // Reset the hash state so that a new digest can be computed.
+    void reset() {
+        static constexpr u32 INITIAL_STATE[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+
+        std::memcpy(m_state, INITIAL_STATE, sizeof(m_state));
+        m_total_length = 0;
+        m_block_length = 0;
+    }
+
+    /*
+        Feed more data into the hash.
+        Parameter 'data': The data to hash.
+        Parameter 'length': The length of said data in bytes.
+    */
+    void update(const void *data, u64 length) {
+        const u8 *bytes = reinterpret_cast<const u8 *>(data);
+        m_total_length += length;
+
+        while (length > 0) {
+            u64 to_copy = sizeof(m_block) - m_block_length < length ? sizeof(m_block) - m_block_length : length;
+            std::memcpy(m_block + m_block_length, bytes, to_copy);
+            m_block_length += to_copy;
+            bytes          += to_copy;
+            length         -= to_copy;
+
+            if (m_block_length == sizeof(m_block)) {
+                compress(m_block);
+                m_block_length = 0;
+            }
+        }
+    }
+
+    /*
+        Finish the hash. The object must be reset before it can be used again.
+        Returns the digest as a 64 character lowercase hex string.
+    */
+    std::string finish() {
+        u64 bit_length = m_total_length * 8;
+        u8 padding[72] = { 0x80 };
+        u64 padding_length = (m_block_length < 56 ? 56 : 120) - m_block_length;
+
+        for (u32 i = 0; i < 8; ++i)
+            padding[padding_length + i] = static_cast<u8>(bit_length >> (56 - i * 8));
+
+        update(padding, padding_length + 8);
+
+        static constexpr char HEX_DIGITS[] = "0123456789abcdef";
+        std::string ret(64, '0');
+        for (u32 i = 0; i < 8; ++i) {
+            for (u32 j = 0; j < 8; ++j)
+                ret[i * 8 + j] = HEX_DIGITS[(m_state[i] >> (28 - j * 4)) & 0xF];
+        }
+
+        return ret;
+    }
+
+    /*
+        Check if a string is a well formed digest (64 lowercase hex characters). Digests are used as file names,
+        so anything else must be rejected.
+        Parameter 'digest': The string to check.
+    */
+    static bool is_valid_digest(const std::string &digest) {
+        if (digest.length() != 64)
+            return false;
+
+        for (char c : digest) {
+            if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    u32 m_state[8];
+    u64 m_total_length;
+    u8 m_block[64];
+    u64 m_block_length;
+
+    static u32 rotr(u32 x, u32 n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const u8 *block) {
+        static constexpr u32 K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        u32 w[64];
+        for (u32 i = 0; i < 16; ++i)
+            w[i] = (u32(block[i * 4]) << 24) | (u32(block[i * 4 + 1]) << 16) | (u32(block[i * 4 + 2]) << 8) | u32(block[i * 4 + 3]);
+
+        for (u32 i = 16; i < 64; ++i) {
+            u32 s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            u32 s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        u32 a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+        u32 e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+        for (u32 i = 0; i < 64; ++i) {
+            u32 t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            u32 t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+        m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+    }
+};
+}
@@ -11,6 +11,11 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace Util {
 
@@ -28,82 +33,150 @@ inline u32 clamp(u32 value, u32 min, u32 max) {
 }
 
 /*
-    A basic 'vector' implementation providing automatically expanding array storage.
+    The inline storage of an 'IchigoVectorBase': room for N elements inside the vector itself. Holds nothing when N is 0.
 */
+template<typename T, u64 N>
+class IchigoInlineStorage {
+protected:
+    T *inline_data()             { return reinterpret_cast<T *>(m_inline); }
+    const T *inline_data() const { return reinterpret_cast<const T *>(m_inline); }
+
+private:
+    alignas(T) unsigned char m_inline[N * sizeof(T)];
+};
+
 template<typename T>
-class IchigoVector {
+class IchigoInlineStorage<T, 0> {
+protected:
+    T *inline_data()             { return nullptr; }
+    const T *inline_data() const { return nullptr; }
+};
+
+/*
+    The element handling shared by 'IchigoVector' and 'IchigoSmallVector'. The elements are kept in the inline storage while they
+    fit in it (never, when N is 0), and on the heap otherwise.
+    Only the first size() elements are constructed; the rest of the capacity is raw storage. Elements are relocated (when the vector
+    grows, or to open or close a gap) by moving them, or by copying their bytes if the type is trivially copyable.
+*/
+template<typename T, u64 N>
+class IchigoVectorBase : private IchigoInlineStorage<T, N> {
 public:
-    // Construct a new vector with the specified inital capacity
-    IchigoVector(u64 initial_capacity) : m_capacity(initial_capacity), m_data(new T[initial_capacity]) {}
-    // Construct a vector with a initial capacity of 16
-    IchigoVector() : IchigoVector(16) {}
-    IchigoVector(const IchigoVector<T> &other) { operator=(other); }
-    IchigoVector(IchigoVector<T> &&other) : m_capacity(other.m_capacity), m_size(other.m_size), m_data(other.m_data) { other.m_data = nullptr; other.m_capacity = 0; other.m_size = 0; }
-    IchigoVector &operator=(const IchigoVector<T> &other) {
-        m_capacity = other.m_capacity;
+    // Construct a new vector with the specified inital capacity (only allocates if it is more than N, and no elements are constructed until they are added)
+    IchigoVectorBase(u64 initial_capacity) {
+        if (initial_capacity > N) {
+            m_data     = allocate(initial_capacity);
+            m_capacity = initial_capacity;
+        }
+    }
+    IchigoVectorBase() = default;
+    IchigoVectorBase(const IchigoVectorBase &other) : IchigoVectorBase(other.m_size) { operator=(other); }
+    IchigoVectorBase(IchigoVectorBase &&other) { operator=(std::move(other)); }
+    // Copies into the storage already held if it is large enough.
+    IchigoVectorBase &operator=(const IchigoVectorBase &other) {
+        if (this == &other)
+            return *this;
+
+        clear();
+        if (m_capacity < other.m_size)
+            reallocate(other.m_size);
+
+        std::uninitialized_copy(other.m_data, other.m_data + other.m_size, m_data);
         m_size = other.m_size;
+        return *this;
+    }
+    // Takes the storage of the other vector if it is on the heap. Inline elements are moved one by one.
+    IchigoVectorBase &operator=(IchigoVectorBase &&other) {
+        if (this == &other)
+            return *this;
 
-        if (m_data)
-            delete[] m_data;
+        clear();
+        if (other.is_inline()) {
+            if (m_capacity < other.m_size)
+                reallocate(other.m_size);
 
-        m_data = new T[m_capacity];
+            std::uninitialized_move(other.m_data, other.m_data + other.m_size, m_data);
+            m_size = other.m_size;
+            other.clear();
+            return *this;
+        }
 
-        for (u64 i = 0; i < m_size; ++i)
-            m_data[i] = other.m_data[i];
+        if (!is_inline())
+            deallocate(m_data);
 
+        m_capacity = other.m_capacity;
+        m_size     = other.m_size;
+        m_data     = other.m_data;
+        other.m_data = other.inline_data(); other.m_capacity = N; other.m_size = 0;
         return *this;
     }
-    ~IchigoVector() { if (m_data) delete[] m_data; }
+    ~IchigoVectorBase() { clear(); if (!is_inline()) deallocate(m_data); }
 
     T &at(u64 i)             { return m_data[i]; }
     const T &at(u64 i) const { assert(i < m_size); return m_data[i]; }
     const T *data() const    { return m_data; }
     T *data()                { return m_data; }
-    // Release the data managed by this vector. Useful for dynamically allocating an unknown amount of data and passing it along to library functions expecting a raw buffer.
-    T *release_data()        { T *ret = m_data; m_data = nullptr; m_capacity = 0; m_size = 0; return ret; }
     u64 size() const         { return m_size; }
-    void clear()             { m_size = 0; }
+    void clear()             { std::destroy(m_data, m_data + m_size); m_size = 0; }
 
     void insert(u64 i, T item) {
         assert(i <= m_size);
 
         if (m_size == m_capacity)
-            expand();
+            reallocate(grown_capacity());
 
         if (i == m_size) {
-            m_data[m_size++] = item;
+            new (&m_data[m_size++]) T(std::move(item));
             return;
         }
 
-        std::memmove(&m_data[i + 1], &m_data[i], (m_size - i) * sizeof(T));
-        m_data[i] = item;
+        // The last element moves into the raw storage past the end, and every other one after 'i' moves up into the slot it left.
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            std::memmove(&m_data[i + 1], &m_data[i], (m_size - i) * sizeof(T));
+        } else {
+            new (&m_data[m_size]) T(std::move(m_data[m_size - 1]));
+            std::move_backward(&m_data[i], &m_data[m_size - 1], &m_data[m_size]);
+        }
+
+        m_data[i] = std::move(item);
         ++m_size;
     }
 
-    u64 append(T item) {
-        if (m_size == m_capacity)
-            expand();
+    u64 append(const T &item) { return emplace_back(item); }
+    u64 append(T &&item)      { return emplace_back(std::move(item)); }
 
-        m_data[m_size++] = item;
-        return m_size - 1;
+    // Construct an element in place at the end of the vector from the specified arguments. Returns its index, like 'append()'.
+    template<typename... Args>
+    u64 emplace_back(Args &&...args) {
+        if (m_size == m_capacity) {
+            // The arguments may refer to elements of this vector, so the new element is constructed before they are relocated.
+            const u64 capacity = grown_capacity();
+            T *new_data = allocate(capacity);
+            new (&new_data[m_size]) T(std::forward<Args>(args)...);
+            move_to(new_data, capacity);
+        } else {
+            new (&m_data[m_size]) T(std::forward<Args>(args)...);
+        }
+
+        return m_size++;
     }
 
     T remove(u64 i) {
         assert(i < m_size);
 
-        if (i == m_size - 1)
-            return m_data[--m_size];
+        T ret = std::move(m_data[i]);
+        if constexpr (std::is_trivially_copyable_v<T>)
+            std::memmove(&m_data[i], &m_data[i + 1], (m_size - i - 1) * sizeof(T));
+        else
+            std::move(&m_data[i + 1], &m_data[m_size], &m_data[i]);
 
-        T ret = m_data[i];
-        std::memmove(&m_data[i], &m_data[i + 1], (m_size - i - 1) * sizeof(T));
-        --m_size;
+        std::destroy_at(&m_data[--m_size]);
         return ret;
     }
 
     i64 index_of(const T &item) const {
-        for (i64 i = 0; i < m_size; ++i) {
+        for (u64 i = 0; i < m_size; ++i) {
             if (m_data[i] == item)
-                return i;
+                return static_cast<i64>(i);
         }
 
         return -1;
@@ -111,30 +184,98 @@ public:
 
     void resize(u64 size) {
         assert(size >= m_size);
-        T *new_data = new T[size];
+        reallocate(size);
+    }
 
-        for (u64 i = 0; i < m_size; ++i)
-            new_data[i] = m_data[i];
+    // Make room for at least the specified number of elements, so that adding up to that many does not relocate them.
+    void reserve(u64 capacity) {
+        if (capacity > m_capacity)
+            reallocate(capacity);
+    }
 
-        delete[] m_data;
-        m_data = new_data;
-        m_capacity = size;
+    // Give back the capacity that is not used by any element. The elements move back inside the vector if they fit.
+    void shrink_to_fit() {
+        if (m_capacity > m_size && !is_inline())
+            reallocate(m_size);
     }
 
+    u64 capacity() const     { return m_capacity; }
 
 private:
-    u64 m_capacity = 0;
-    u64 m_size = 0;
-    T *m_data = nullptr;
+    using IchigoInlineStorage<T, N>::inline_data;
 
-    void expand() {
-        T *new_data = new T[m_capacity *= 2];
+    u64 m_capacity = N;
+    u64 m_size     = 0;
+    T *m_data      = inline_data();
 
-        for (u64 i = 0; i < m_size; ++i)
-            new_data[i] = m_data[i];
+    // Whether the elements are in the inline storage. A vector without inline storage is "inline" while it holds no storage at all.
+    bool is_inline() const { return m_data == inline_data(); }
+    u64 grown_capacity() const { return m_capacity > 0 ? m_capacity * 2 : 16; }
+
+    static T *allocate(u64 capacity) {
+        return static_cast<T *>(::operator new(capacity * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    static void deallocate(T *data) {
+        ::operator delete(data, std::align_val_t(alignof(T)));
+    }
+
+    // Move the elements into storage of the specified capacity: the inline storage if they fit in it, or else the heap.
+    void reallocate(u64 capacity) {
+        if (capacity > N) {
+            move_to(allocate(capacity), capacity);
+        } else if (!is_inline()) {
+            if constexpr (N > 0) {
+                move_to(inline_data(), N);
+            } else {
+                // Without inline storage, this is a vector with no elements giving up its storage.
+                assert(m_size == 0);
+                deallocate(m_data);
+                m_data = nullptr; m_capacity = 0;
+            }
+        }
+    }
+
+    // Move the elements into the specified storage, and release the storage they were in if it was on the heap.
+    void move_to(T *new_data, u64 capacity) {
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            if (m_size > 0)
+                std::memcpy(new_data, m_data, m_size * sizeof(T));
+        } else {
+            std::uninitialized_move(m_data, m_data + m_size, new_data);
+            std::destroy(m_data, m_data + m_size);
+        }
+
+        if (!is_inline())
+            deallocate(m_data);
 
-        delete[] m_data;
         m_data = new_data;
+        m_capacity = capacity;
     }
 };
+
+/*
+    A basic 'vector' implementation providing automatically expanding array storage.
+*/
+template<typename T>
+class IchigoVector : public IchigoVectorBase<T, 0> {
+public:
+    // Construct a new vector with the specified inital capacity (no elements are constructed until they are added)
+    IchigoVector(u64 initial_capacity) : IchigoVectorBase<T, 0>(initial_capacity) {}
+    // Construct a vector with a initial capacity of 16
+    IchigoVector() : IchigoVector(16) {}
+};
+
+/*
+    An 'IchigoVector' that keeps its first N elements inside the vector itself, so that short lists (eg. the usernames of a single
+    user) do not allocate at all. Has the same interface as 'IchigoVector'; it moves its elements to the heap once it grows past N.
+*/
+template<typename T, u64 N>
+class IchigoSmallVector : public IchigoVectorBase<T, N> {
+    static_assert(N > 0, "A small vector needs room for at least one element");
+public:
+    // Construct a new vector with the specified inital capacity (only allocates if it is more than N)
+    IchigoSmallVector(u64 initial_capacity) : IchigoVectorBase<T, N>(initial_capacity) {}
+    IchigoSmallVector() = default;
+};
 }
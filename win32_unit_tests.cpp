@@ -7,6 +7,85 @@
 u32 index_ = 0;
 u32 success_count_ = 0;
 
+/*
+    Delete a journal (its manifest, segments, and the single file of an old journal) and its snapshot.
+    Parameter 'name': The name the journal was started with, as passed to '--journal-name'.
+*/
+static void delete_journal(const std::string &name) {
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA((name + ".chatjournal*").c_str(), &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            DeleteFileA(find_data.cFileName);
+        } while (FindNextFileA(find, &find_data));
+
+        FindClose(find);
+    }
+
+    DeleteFileA((name + ".chatsnapshot").c_str());
+}
+
+/*
+    Append bytes to the segment being appended to, as if the server crashed while writing a record.
+    Parameter 'name': The name the journal was started with, as passed to '--journal-name'.
+    Parameter 'length': The number of bytes to append.
+*/
+static void tear_journal_tail(const std::string &name, u32 length) {
+    // Segments are numbered with a fixed width, so the newest one sorts last.
+    std::string tail_segment;
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA((name + ".chatjournal.0*").c_str(), &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (tail_segment < find_data.cFileName)
+                tail_segment = find_data.cFileName;
+        } while (FindNextFileA(find, &find_data));
+
+        FindClose(find);
+    }
+
+    std::FILE *segment_file = std::fopen(tail_segment.c_str(), "ab");
+    for (u32 i = 0; i < length; ++i)
+        std::fputc(0xFF, segment_file);
+    std::fclose(segment_file);
+}
+
+/*
+    Start the server, with its output appended to the server log.
+    Parameter 'command_line': The command line to start the server with.
+    Parameter 'output_file': The file to write the output of the server to.
+    Returns the process information of the server.
+*/
+static PROCESS_INFORMATION start_server(const char *command_line, HANDLE output_file) {
+    PROCESS_INFORMATION pi{};
+
+    STARTUPINFO si{};
+    si.cb         = sizeof(si);
+    si.dwFlags    = STARTF_USESTDHANDLES;
+    si.hStdOutput = output_file;
+    si.hStdError  = output_file;
+
+    char command[256];
+    std::snprintf(command, sizeof(command), "%s", command_line);
+    assert(CreateProcessA(nullptr, command, nullptr, nullptr, true, 0, nullptr,
+                        nullptr, &si, &pi));
+
+    // Wait a bit to ensure the server has started.
+    Sleep(500);
+    return pi;
+}
+
+/*
+    Stop a server started with 'start_server()'.
+    Parameter 'pi': The process information of the server.
+*/
+static void stop_server(PROCESS_INFORMATION &pi) {
+    TerminateProcess(pi.hProcess, 0);
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+
 #define TEST(B, DESC)                                                \
     do {                                                             \
         if (B) {                                                     \
@@ -28,21 +107,10 @@ i32 main() {
 
     DeleteFile("unit_test_backup.chatjournal");
     MoveFile("default.chatjournal", "unit_test_backup.chatjournal");
+    delete_journal("unit_test_journal_backup");
 
-    PROCESS_INFORMATION pi{};
-
-    STARTUPINFO si{};
-    si.cb         = sizeof(si);
-    si.dwFlags    = STARTF_USESTDHANDLES;
-    si.hStdOutput = server_output_file;
-    si.hStdError  = server_output_file;
-
-    assert(CreateProcessA(nullptr, "chat.exe", nullptr, nullptr, true, 0, nullptr,
-                        nullptr, &si, &pi));
-
-    // Wait a bit to ensure the server has started.
-    Sleep(500);
-
+    // The second user is the admin, who may take backups.
+    PROCESS_INFORMATION pi = start_server("chat.exe --admin unit_test_2", server_output_file);
     ServerConnection::connect_to_server();
 
     // ** Test user registration **
@@ -90,6 +158,38 @@ i32 main() {
     TEST(ServerConnection::send_message(group_msg), "Send a group message");
     TEST(ServerConnection::refresh() == 1 && ServerConnection::cached_inbox.size() == 2, "Receive group message");
 
+    // ** Attachments **
+    std::FILE *attachment_file = std::fopen("unit_test_attachment.bin", "wb");
+    for (u32 i = 0; i < 3 * CHAT_ATTACHMENT_CHUNK_SIZE + 17; ++i)
+        std::fputc(i * 31, attachment_file);
+    std::fclose(attachment_file);
+
+    std::string digest;
+    TEST(ServerConnection::upload_attachment("unit_test_attachment.bin", &digest), "Upload a multi-chunk attachment");
+    std::string second_digest;
+    TEST(ServerConnection::upload_attachment("unit_test_attachment.bin", &second_digest) && second_digest == digest, "Upload the same attachment again (deduplicated)");
+
+    ClientMessage attachment_msg("attachment", &ServerConnection::logged_in_user, &ServerConnection::logged_in_user);
+    attachment_msg.set_attachment(digest, "unit_test_attachment.bin");
+    TEST(ServerConnection::send_message(attachment_msg), "Send a message with an attachment");
+    ClientMessage missing_attachment_msg("attachment", &ServerConnection::logged_in_user, &ServerConnection::logged_in_user);
+    missing_attachment_msg.set_attachment(std::string(64, 'a'), "missing.bin");
+    TEST(!ServerConnection::send_message(missing_attachment_msg), "Send a message referencing an attachment that was never uploaded");
+
+    ServerConnection::refresh();
+    const ClientMessage &received_attachment_msg = ServerConnection::cached_inbox.at(ServerConnection::cached_inbox.size() - 1);
+    TEST(received_attachment_msg.attachment_digest() == digest && received_attachment_msg.attachment_name() == "unit_test_attachment.bin", "Receive a message with an attachment");
+    TEST(ServerConnection::download_attachment(received_attachment_msg, "unit_test_attachment_download.bin"), "Download an attachment");
+    TEST(ServerConnection::upload_attachment("unit_test_attachment_download.bin", &second_digest) && second_digest == digest, "Downloaded attachment matches the uploaded one");
+    ServerConnection::delete_message(ServerConnection::cached_inbox.at(ServerConnection::cached_inbox.size() - 1));
+    DeleteFile("unit_test_attachment.bin");
+    DeleteFile("unit_test_attachment_download.bin");
+
+    // ** Backups **
+    // Only the second user is the admin.
+    u64 backup_position = 0;
+    TEST(!ServerConnection::backup("unit_test_journal_backup", &backup_position), "Take a backup as a user that is not the admin");
+
     // ** Delete a message **
     TEST(ServerConnection::delete_message(ServerConnection::cached_inbox.at(0)), "Delete the first message in the inbox");
 
@@ -99,14 +199,51 @@ i32 main() {
 
     // ** Receive messages on the other user **
     TEST(ServerConnection::refresh() == 1, "Receive the group message on the second user");
+
+    // ** Backups as the admin **
+    TEST(ServerConnection::backup("unit_test_journal_backup", &backup_position) && backup_position > 0, "Take a backup as the admin user");
+    ClientMessage after_backup_msg("after backup", &ServerConnection::logged_in_user, &ServerConnection::logged_in_user);
+    TEST(ServerConnection::send_message(after_backup_msg), "Send a message after the backup");
     TEST(ServerConnection::logout(), "Log out of the second user");
 
     ServerConnection::deinit();
-    TerminateProcess(pi.hProcess, 0);
-    WaitForSingleObject(pi.hProcess, INFINITE);
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+    stop_server(pi);
+
+    // ** Start from the backup **
+    // The backup holds the journal up to the position it was taken at: the group message is in it, the message sent after is not.
+    pi = start_server("chat.exe --journal-name unit_test_journal_backup", server_output_file);
+    ServerConnection::connect_to_server();
+    TEST(ServerConnection::login("unit_test_2"), "Login on a server started from the backup");
+    TEST(ServerConnection::refresh() == 1, "Only the messages sent before the backup are restored from it");
+    TEST(ServerConnection::logout(), "Log out of the server started from the backup");
+
+    ServerConnection::deinit();
+    stop_server(pi);
+
+    // ** Start from a journal with a torn tail **
+    // The torn record is cut off, and what is written after it must still be durable before it is acknowledged.
+    tear_journal_tail("unit_test_journal_backup", 14);
+    pi = start_server("chat.exe --journal-name unit_test_journal_backup", server_output_file);
+    ServerConnection::connect_to_server();
+    TEST(ServerConnection::login("unit_test_2"), "Login on a server started from a journal with a torn tail");
+    TEST(ServerConnection::refresh() == 1, "The messages before the torn tail are restored");
+    ClientMessage after_torn_tail_msg("after torn tail", &ServerConnection::logged_in_user, &ServerConnection::logged_in_user);
+    TEST(ServerConnection::send_message(after_torn_tail_msg), "Send a message after the torn tail was cut off");
+    TEST(ServerConnection::logout(), "Log out of the server started from a journal with a torn tail");
+
+    ServerConnection::deinit();
+    stop_server(pi);
+
+    pi = start_server("chat.exe --journal-name unit_test_journal_backup", server_output_file);
+    ServerConnection::connect_to_server();
+    TEST(ServerConnection::login("unit_test_2"), "Login after restarting from the recovered journal");
+    TEST(ServerConnection::refresh() == 2, "The message sent after the torn tail was cut off is restored");
+    TEST(ServerConnection::logout(), "Log out after restarting from the recovered journal");
+
+    ServerConnection::deinit();
+    stop_server(pi);
     CloseHandle(server_output_file);
+    delete_journal("unit_test_journal_backup");
 
     DeleteFile("unit_test_result.chatjournal");
     MoveFile("default.chatjournal", "unit_test_result.chatjournal");